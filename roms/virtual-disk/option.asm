@@ -37,12 +37,19 @@ rom_init:
     mov WORD [ds:bios_int19h_offset], ax
     mov ax, WORD [es:19h*4+2]
     mov WORD [ds:bios_int19h_segment], ax
+    mov ax, WORD [es:16h*4]
+    mov WORD [ds:bios_int16h_offset], ax
+    mov ax, WORD [es:16h*4+2]
+    mov WORD [ds:bios_int16h_segment], ax
 
     ; overwrite int 19h with our vector
     mov WORD [es:13h*4], int13h_handler
     mov WORD [es:13h*4+2], cs
     mov WORD [es:19h*4], int19h_handler
     mov WORD [es:19h*4+2], cs
+    ; int 28h is hooked once dos is up, see hook_int28h
+    mov WORD [es:16h*4], int16h_handler
+    mov WORD [es:16h*4+2], cs
 
     ; up the fixed disk count, get our drive number
     mov ax, 0x0040
@@ -489,12 +496,95 @@ IncrementLBA:
     pop dx
     ret
 
+    ; the waiting keyboard reads halt until the next interrupt instead of spinning on the
+    ; keystroke status, with the in-kernel irqchip the vcpu sleeps on the host meanwhile
+int16h_handler:
+    call hook_int28h
+    cmp ah, 0x00
+    je .WaitKeystroke
+    cmp ah, 0x10
+    je .WaitKeystroke
+.BIOSInt16h:
+    jmp far [cs:bios_int16h_offset]
+
+.WaitKeystroke:
+    push ax
+.WaitKeystrokeLoop:
+    ; ah 01h/11h checks for the keystroke ah 00h/10h would wait for, ZF set if there is none
+    pop ax
+    push ax
+    inc ah
+    pushf
+    call far [cs:bios_int16h_offset]
+    jnz .WaitKeystrokeReady
+    ; the status call returns with interrupts on, a keystroke that arrived since would wait for
+    ; the next timer tick. check the bda buffer (head at 41Ah, tail at 41Ch) again with interrupts
+    ; off, the sti shadow then covers the hlt
+    cli
+    push ds
+    push bx
+    mov bx, 0x0040
+    mov ds, bx
+    mov bx, [0x1A]
+    cmp bx, [0x1C]
+    pop bx
+    pop ds
+    jne .WaitKeystrokeLoop
+    sti
+    hlt
+    jmp .WaitKeystrokeLoop
+
+.WaitKeystrokeReady:
+    pop ax
+    jmp .BIOSInt16h
+
+    ; dos calls int 28h while it polls for console input, halt until the next interrupt (the
+    ; timer tick at the latest) before it polls again
+int28h_handler:
+    pushf
+    call far [cs:bios_int28h_offset]
+    sti
+    hlt
+    iret
+
+    ; dos points int 28h at a bare iret when it starts, after the option roms ran. hook it
+    ; whenever it is an iret again, a handler some tsr chained in front of ours is left alone
+hook_int28h:
+    push ax
+    push bx
+    push es
+    pushf
+    xor ax, ax
+    mov es, ax
+    les bx, [es:28h*4]
+    cmp BYTE [es:bx], 0xCF
+    jne .HookInt28hDone
+
+    mov WORD [cs:bios_int28h_offset], bx
+    mov WORD [cs:bios_int28h_segment], es
+    mov es, ax
+    cli
+    mov WORD [es:28h*4], int28h_handler
+    mov WORD [es:28h*4+2], cs
+
+.HookInt28hDone:
+    popf
+    pop es
+    pop bx
+    pop ax
+    ret
+
     section .data align=4
 indicator:           dq 0xefcdab8967452301
 bios_int13h_segment: dw 0x0000
 bios_int13h_offset:  dw 0x0000
 bios_int19h_segment: dw 0x0000
 bios_int19h_offset:  dw 0x0000
+    ; offset first, far jumps and calls go through these
+bios_int16h_offset:  dw 0x0000
+bios_int16h_segment: dw 0x0000
+bios_int28h_offset:  dw 0x0000
+bios_int28h_segment: dw 0x0000
 vdisk_drivenum:      db 0x00
 rom_message:         db 13, 10, "-= Virtual Disk Driver =-", 13, 10
                      db "v0.0.1 (2020-05-06)", 13, 10
@@ -0,0 +1,72 @@
+#ifndef BYTERING_HPP_
+#define BYTERING_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/uio.h>
+
+// fixed size byte fifo used by one thread. the free and filled parts are handed out as (at most
+// two) iovecs, so whole batches move between the ring and a descriptor with one readv/writev.
+
+template <size_t Capacity>
+class ByteRing
+{
+    static_assert(Capacity && !(Capacity & (Capacity - 1)), "capacity must be a power of two");
+
+    uint8_t mData[Capacity];
+    // free running, the difference is the fill level
+    size_t mHead;
+    size_t mTail;
+
+public:
+    ByteRing() : mData{}, mHead(0), mTail(0) {}
+
+    size_t size() const { return mTail - mHead; }
+    size_t space() const { return Capacity - size(); }
+    bool empty() const { return mHead == mTail; }
+
+    void push(uint8_t value) {
+        if (space()) {
+            mData[mTail++ & (Capacity - 1)] = value;
+        }
+    }
+
+    uint8_t pop() {
+        return mData[mHead++ & (Capacity - 1)];
+    }
+
+    // the free part, returns the number of iovecs (0 if full)
+    int writable(struct iovec (&iov)[2]) {
+        return segments(mTail, space(), iov);
+    }
+
+    void commit(size_t length) { mTail += length; }
+
+    // the filled part, returns the number of iovecs (0 if empty)
+    int readable(struct iovec (&iov)[2]) {
+        return segments(mHead, size(), iov);
+    }
+
+    void consume(size_t length) { mHead += length; }
+
+private:
+    int segments(size_t position, size_t length, struct iovec (&iov)[2]) {
+        if (!length) {
+            return 0;
+        }
+
+        size_t offset = position & (Capacity - 1);
+        size_t first = (length < Capacity - offset) ? length : Capacity - offset;
+        iov[0].iov_base = mData + offset;
+        iov[0].iov_len = first;
+        if (first == length) {
+            return 1;
+        }
+        iov[1].iov_base = mData;
+        iov[1].iov_len = length - first;
+        return 2;
+    }
+};
+
+#endif /* BYTERING_HPP_ */
@@ -0,0 +1,53 @@
+#include "DeviceActivity.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <ctime>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+    std::atomic<uint32_t> generationWord{0};
+    std::atomic<uint32_t> waiters{0};
+
+    static_assert(sizeof generationWord == sizeof(uint32_t), "futex word must be 32 bits");
+
+    uint32_t* futexWord()
+    {
+        return reinterpret_cast<uint32_t*>(&generationWord);
+    }
+} /* anonymous */
+
+uint32_t DeviceActivity::generation()
+{
+    return generationWord.load(std::memory_order_acquire);
+}
+
+// the increment and the waiter check pair with the waiter's registration and the kernel's
+// compare of the futex word, one of the two sides always sees the other
+void DeviceActivity::notify()
+{
+    generationWord.fetch_add(1, std::memory_order_seq_cst);
+    if (waiters.load(std::memory_order_seq_cst)) {
+        syscall(SYS_futex, futexWord(), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    }
+}
+
+bool DeviceActivity::wait(uint32_t generation, uint64_t timeout)
+{
+    struct timespec duration {
+        .tv_sec = (time_t) (timeout / 1000000000ULL),
+        .tv_nsec = (long) (timeout % 1000000000ULL)
+    };
+
+    waiters.fetch_add(1, std::memory_order_seq_cst);
+    long result = syscall(SYS_futex, futexWord(), FUTEX_WAIT_PRIVATE, generation, &duration,
+            nullptr, 0);
+    int error = errno;
+    waiters.fetch_sub(1, std::memory_order_relaxed);
+    return result == 0 || error != ETIMEDOUT;
+}
@@ -0,0 +1,23 @@
+#ifndef DEVICEACTIVITY_HPP_
+#define DEVICEACTIVITY_HPP_
+
+#include <cstdint>
+
+// wakes a vcpu the poll detector parked. devices signal it whenever state the guest may be
+// polling for changes or they raise an interrupt. it is a generation count in a futex word, so
+// signalling costs an atomic increment and only makes a system call while a vcpu is parked.
+
+class DeviceActivity
+{
+public:
+    DeviceActivity() = delete;
+
+    static uint32_t generation();
+    static void notify();
+
+    // sleeps until the generation moves past the given one or the timeout (ns) expires. returns
+    // false on timeout
+    static bool wait(uint32_t generation, uint64_t timeout);
+};
+
+#endif /* DEVICEACTIVITY_HPP_ */
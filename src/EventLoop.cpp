@@ -2,11 +2,18 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <mutex>
 #include <stdexcept>
+#include <vector>
 
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/eventfd.h>
 #include <sys/fcntl.h>
+#include <sys/timerfd.h>
 
 namespace
 {
@@ -19,16 +26,279 @@ namespace
 
         return fcntl(fd, F_SETFL, ret | O_NONBLOCK) != -1;
     }
+
+    constexpr uint32_t SlotsPerChunk = 64;
+    constexpr uint32_t MaximumChunks = 64;
+    constexpr uint32_t NoSlot = UINT32_MAX;
+
+    // timer wheel: 4 levels of 64 buckets, ticks of 1024 ns. level 0 spans 65 us, level 3 17 s,
+    // later deadlines wait in the last bucket of level 3 and are re-filed when it cascades
+    constexpr unsigned TickShift = 10;
+    constexpr unsigned LevelBits = 6;
+    constexpr unsigned Levels = 4;
+    constexpr uint64_t BucketsPerLevel = 1ULL << LevelBits;
+    constexpr uint64_t NoTick = UINT64_MAX;
 } /* anonymous */
 
+// slot of the handler slab, slots never move once allocated
+struct HandlerSlot {
+    EventLoop::Handler handler;
+    std::atomic<uint32_t> generation;
+    const EventLoop* owner;
+    int fd;
+    uint32_t nextFree;
+
+    HandlerSlot() : handler{}, generation(0), owner(nullptr), fd(-1), nextFree(NoSlot) {}
+};
+
+// one shot timer, linked into a wheel bucket while armed
+struct TimerSlot {
+    EventLoop::Handler handler;
+    std::atomic<uint32_t> generation;
+    const EventLoop* owner;
+    uint64_t tick;
+    uint32_t next;
+    uint32_t previous;
+    uint16_t bucket;
+    bool armed;
+
+    TimerSlot() : handler{}, generation(0), owner(nullptr), tick(0), next(NoSlot),
+            previous(NoSlot), bucket(0), armed(false) {}
+};
+
+// hierarchical timer wheel behind a single timerfd. adding and cancelling timers are list
+// operations, the timerfd is only reprogrammed when the earliest deadline moves
+struct TimerWheel {
+    std::array<std::unique_ptr<TimerSlot[]>, MaximumChunks> mChunks;
+    uint32_t mSlotCount;
+    uint32_t mFreeHead;
+    uint32_t mFreeTail;
+    // the timer whose handler is running and whether it was released meanwhile
+    uint32_t mRunning;
+    bool mRunningReleased;
+
+    std::array<uint32_t, Levels * BucketsPerLevel> mBuckets;
+    std::array<uint64_t, Levels> mOccupied;
+    // first tick that hasn't been processed
+    uint64_t mCurrent;
+    // tick the timerfd is armed for
+    uint64_t mArmed;
+
+    TimerWheel() : mChunks{}, mSlotCount(0), mFreeHead(NoSlot), mFreeTail(NoSlot),
+            mRunning(NoSlot), mRunningReleased(false), mOccupied{},
+            mCurrent(EventLoop::now() >> TickShift), mArmed(NoTick) {
+        mBuckets.fill(NoSlot);
+    }
+
+    TimerSlot& slot(uint32_t index) {
+        return mChunks[index / SlotsPerChunk][index % SlotsPerChunk];
+    }
+
+    uint64_t token(uint32_t index) {
+        return ((uint64_t) slot(index).generation.load(std::memory_order_relaxed) << 32) | index;
+    }
+
+    uint32_t allocate(const EventLoop* owner) {
+        uint32_t index;
+        if (mFreeHead != NoSlot) {
+            index = mFreeHead;
+            mFreeHead = slot(index).next;
+            if (mFreeHead == NoSlot) {
+                mFreeTail = NoSlot;
+            }
+        } else if (mSlotCount < SlotsPerChunk * MaximumChunks) {
+            if (!(mSlotCount % SlotsPerChunk)) {
+                mChunks[mSlotCount / SlotsPerChunk].reset(new TimerSlot[SlotsPerChunk]);
+            }
+            index = mSlotCount++;
+        } else {
+            return NoSlot;
+        }
+        slot(index).owner = owner;
+        return index;
+    }
+
+    // freed timers are reused last. a timer released while its handler runs (cancelled by the
+    // handler or another thread) only becomes free when the handler returns, see runTimers()
+    void release(uint32_t index) {
+        TimerSlot& timer = slot(index);
+        timer.generation.fetch_add(1, std::memory_order_release);
+        timer.owner = nullptr;
+        timer.armed = false;
+        if (index == mRunning) {
+            mRunningReleased = true;
+            return;
+        }
+        free(index);
+    }
+
+    void free(uint32_t index) {
+        slot(index).next = NoSlot;
+        if (mFreeTail == NoSlot) {
+            mFreeHead = index;
+        } else {
+            slot(mFreeTail).next = index;
+        }
+        mFreeTail = index;
+    }
+
+    void link(uint32_t index) {
+        TimerSlot& timer = slot(index);
+        uint64_t tick = std::max(timer.tick, mCurrent);
+        uint64_t delta = tick - mCurrent;
+
+        unsigned level = 0;
+        while (level < Levels - 1 && delta >= (BucketsPerLevel << (level * LevelBits))) {
+            level++;
+        }
+        if (level == Levels - 1 && delta >= (BucketsPerLevel << (level * LevelBits))) {
+            tick = mCurrent + (BucketsPerLevel << (level * LevelBits)) - 1;
+        }
+
+        unsigned position = (tick >> (level * LevelBits)) & (BucketsPerLevel - 1);
+        timer.bucket = level * BucketsPerLevel + position;
+        timer.previous = NoSlot;
+        timer.next = mBuckets[timer.bucket];
+        if (timer.next != NoSlot) {
+            slot(timer.next).previous = index;
+        }
+        mBuckets[timer.bucket] = index;
+        mOccupied[level] |= 1ULL << position;
+        timer.armed = true;
+    }
+
+    void unlink(uint32_t index) {
+        TimerSlot& timer = slot(index);
+        if (timer.previous != NoSlot) {
+            slot(timer.previous).next = timer.next;
+        } else {
+            mBuckets[timer.bucket] = timer.next;
+        }
+        if (timer.next != NoSlot) {
+            slot(timer.next).previous = timer.previous;
+        }
+        if (mBuckets[timer.bucket] == NoSlot) {
+            mOccupied[timer.bucket / BucketsPerLevel] &= ~(1ULL << (timer.bucket % BucketsPerLevel));
+        }
+        timer.armed = false;
+    }
+
+    // detach a bucket, returns the head of its list
+    uint32_t take(unsigned level, unsigned position) {
+        uint32_t head = mBuckets[level * BucketsPerLevel + position];
+        mBuckets[level * BucketsPerLevel + position] = NoSlot;
+        mOccupied[level] &= ~(1ULL << position);
+        for (uint32_t index = head; index != NoSlot; index = slot(index).next) {
+            slot(index).armed = false;
+        }
+        return head;
+    }
+
+    // next tick at which a bucket of level 0 expires or a higher level bucket cascades
+    uint64_t nextTick() {
+        uint64_t next = NoTick;
+        for (unsigned level = 0; level < Levels; level++) {
+            if (!mOccupied[level]) {
+                continue;
+            }
+
+            unsigned shift = level * LevelBits;
+            uint64_t rotation = (mCurrent >> (shift + LevelBits)) << (shift + LevelBits);
+            // the bucket at the current position is still due if its boundary hasn't been
+            // processed yet (always the case on level 0), otherwise it holds the next rotation
+            uint64_t from = ((mCurrent >> shift) & (BucketsPerLevel - 1))
+                    + ((mCurrent & ((1ULL << shift) - 1)) ? 1 : 0);
+            uint64_t pending = (from < BucketsPerLevel) ? (mOccupied[level] >> from) : 0;
+            uint64_t tick;
+            if (pending) {
+                uint64_t first = __builtin_ctzll(pending) + from;
+                tick = rotation + (first << shift);
+            } else {
+                uint64_t first = __builtin_ctzll(mOccupied[level]);
+                tick = rotation + (BucketsPerLevel << shift) + (first << shift);
+            }
+            next = std::min(next, tick);
+        }
+        return next;
+    }
+
+    // moves the wheel up to and including "target", due timers are unlinked and appended to
+    // the fired list (linked through next)
+    void advance(uint64_t target, uint32_t& firedHead, uint32_t& firedTail) {
+        for (;;) {
+            uint64_t tick = nextTick();
+            if (tick == NoTick || tick > target) {
+                mCurrent = std::max(mCurrent, target + 1);
+                return;
+            }
+            mCurrent = tick;
+
+            // cascade from the lowest level whose position wrapped
+            for (unsigned level = 1; level < Levels; level++) {
+                uint64_t mask = (1ULL << (level * LevelBits)) - 1;
+                if (mCurrent & mask) {
+                    break;
+                }
+                unsigned position = (mCurrent >> (level * LevelBits)) & (BucketsPerLevel - 1);
+                uint32_t index = take(level, position);
+                while (index != NoSlot) {
+                    uint32_t next = slot(index).next;
+                    link(index);
+                    index = next;
+                }
+            }
+
+            uint32_t index = take(0, mCurrent & (BucketsPerLevel - 1));
+            while (index != NoSlot) {
+                uint32_t next = slot(index).next;
+                if (slot(index).tick <= mCurrent) {
+                    slot(index).next = NoSlot;
+                    if (firedTail == NoSlot) {
+                        firedHead = index;
+                    } else {
+                        slot(firedTail).next = index;
+                    }
+                    firedTail = index;
+                } else {
+                    link(index);
+                }
+                index = next;
+            }
+            mCurrent++;
+        }
+    }
+};
+
 // internal event loop event-invoker
 struct EventLoopInternal {
     std::thread mLoop;
-    EventLoop::HandlerType mInterruptHandler;
     int mEpollFd;
     int mInterruptFd;
+    int mPostFd;
+    int mTimerFd;
+
+    // one shot timers
+    std::mutex mTimerMutex;
+    TimerWheel mTimers;
+
+    // handler slab. epoll_event.data carries the slot index and its generation, so an event for a
+    // handler removed earlier in the same batch is dropped instead of calling a stale handler
+    std::mutex mSlotMutex;
+    std::array<std::unique_ptr<HandlerSlot[]>, MaximumChunks> mChunks;
+    uint32_t mSlotCount;
+    uint32_t mFreeHead;
+    uint32_t mFreeTail;
+    std::vector<uint32_t> mSlotByFd;
+    // freed slots wait here until the end of the batch, see freeSlot()
+    std::vector<uint32_t> mQuarantine;
+    std::vector<uint32_t> mReclaiming;
+
+    // work posted from other threads
+    std::mutex mPostMutex;
+    std::vector<std::function<void()>> mPosted;
 
-    EventLoopInternal() {
+    EventLoopInternal() : mChunks{}, mSlotCount(0), mFreeHead(NoSlot), mFreeTail(NoSlot),
+            mSlotByFd(1024, NoSlot), mQuarantine{}, mReclaiming{} {
         mEpollFd = epoll_create1(0);
         if (mEpollFd == -1) {
             throw std::runtime_error("failed to create epoll file descriptor");
@@ -39,27 +309,69 @@ struct EventLoopInternal {
             throw std::runtime_error("failed to create eventfd");
         }
 
-        mInterruptHandler = [this] (uint32_t events) {
+        mPostFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (mPostFd == -1) {
+            throw std::runtime_error("failed to create eventfd");
+        }
+
+        mTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (mTimerFd == -1) {
+            throw std::runtime_error("failed to create timerfd");
+        }
+
+        addInternalHandler(mInterruptFd, [this] (uint32_t events) {
             close(mEpollFd);
             close(mInterruptFd);
+            close(mPostFd);
+            close(mTimerFd);
             mEpollFd = -1;
             mInterruptFd = -1;
-        };
+            mPostFd = -1;
+            mTimerFd = -1;
+        });
 
-        struct epoll_event event { .events = EPOLLIN, .data = { .ptr = &mInterruptHandler } };
-        if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mInterruptFd, &event) == -1) {
-            throw std::runtime_error("failed to add loop interrupt handler");
-        }
+        addInternalHandler(mPostFd, [this] (uint32_t events) {
+            uint64_t data;
+            read(mPostFd, &data, sizeof data);
+
+            std::vector<std::function<void()>> posted;
+            {
+                std::unique_lock<std::mutex> lock(mPostMutex);
+                posted.swap(mPosted);
+            }
+            for (auto& function : posted) {
+                function();
+            }
+        });
+
+        addInternalHandler(mTimerFd, [this] (uint32_t events) {
+            uint64_t data;
+            read(mTimerFd, &data, sizeof data);
+            runTimers();
+        });
 
         mLoop = std::thread([this] () {
             std::array<struct epoll_event, 64> events;
             int n;
-            while (mEpollFd != -1
-                    && (n = epoll_wait(mEpollFd, events.data(), events.size(), -1) != -1)) {
+            while (mEpollFd != -1) {
+                n = epoll_wait(mEpollFd, events.data(), events.size(), -1);
+                if (n == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    break;
+                }
+
                 // dispatch handlers for all events
                 std::for_each(events.begin(), events.begin() + n, [&] (struct epoll_event event) {
-                    (*reinterpret_cast<EventLoop::HandlerType*>(event.data.ptr))(event.events);
+                    uint32_t index = event.data.u64 & 0xffffffff;
+                    HandlerSlot& handlerSlot = slot(index);
+                    if (handlerSlot.generation.load(std::memory_order_acquire)
+                            == (event.data.u64 >> 32)) {
+                        handlerSlot.handler(event.events);
+                    }
                 });
+                reclaimSlots();
             }
         });
     }
@@ -77,28 +389,234 @@ struct EventLoopInternal {
     EventLoopInternal(EventLoopInternal&& loop) = delete;
     EventLoopInternal& operator=(const EventLoopInternal&) = delete;
     EventLoopInternal& operator=(EventLoopInternal&&) = delete;
+
+    HandlerSlot& slot(uint32_t index) {
+        return mChunks[index / SlotsPerChunk][index % SlotsPerChunk];
+    }
+
+    uint64_t token(uint32_t index) {
+        return ((uint64_t) slot(index).generation.load(std::memory_order_relaxed) << 32) | index;
+    }
+
+    // the following require mSlotMutex
+    uint32_t findSlot(int fd) {
+        return (fd >= 0 && (size_t) fd < mSlotByFd.size()) ? mSlotByFd[fd] : NoSlot;
+    }
+
+    uint32_t allocateSlot(int fd, const EventLoop* owner) {
+        uint32_t index;
+        if (mFreeHead != NoSlot) {
+            index = mFreeHead;
+            mFreeHead = slot(index).nextFree;
+            if (mFreeHead == NoSlot) {
+                mFreeTail = NoSlot;
+            }
+        } else if (mSlotCount < SlotsPerChunk * MaximumChunks) {
+            if (!(mSlotCount % SlotsPerChunk)) {
+                mChunks[mSlotCount / SlotsPerChunk].reset(new HandlerSlot[SlotsPerChunk]);
+            }
+            index = mSlotCount++;
+        } else {
+            return NoSlot;
+        }
+
+        if ((size_t) fd >= mSlotByFd.size()) {
+            mSlotByFd.resize(fd + 1, NoSlot);
+        }
+        mSlotByFd[fd] = index;
+        slot(index).owner = owner;
+        slot(index).fd = fd;
+        return index;
+    }
+
+    // a freed slot may still be running its handler (one that removes or re-adds itself, or
+    // one removed from another thread during the batch), so it's quarantined until the batch
+    // ends. a loop blocked in epoll_wait is woken up to reclaim it
+    void freeSlot(uint32_t index) {
+        HandlerSlot& handlerSlot = slot(index);
+        handlerSlot.generation.fetch_add(1, std::memory_order_release);
+        if (findSlot(handlerSlot.fd) == index) {
+            mSlotByFd[handlerSlot.fd] = NoSlot;
+        }
+        handlerSlot.owner = nullptr;
+        handlerSlot.fd = -1;
+
+        mQuarantine.push_back(index);
+        if (mQuarantine.size() == 1 && std::this_thread::get_id() != mLoop.get_id()) {
+            uint64_t data = 1;
+            write(mPostFd, &data, sizeof data);
+        }
+    }
+
+    // loop thread, between batches. the callables are destroyed without the lock, whatever
+    // they captured may remove handlers of its own
+    void reclaimSlots() {
+        {
+            std::unique_lock<std::mutex> lock(mSlotMutex);
+            if (mQuarantine.empty()) {
+                return;
+            }
+            mReclaiming.swap(mQuarantine);
+        }
+
+        for (uint32_t index : mReclaiming) {
+            slot(index).handler.reset();
+        }
+
+        std::unique_lock<std::mutex> lock(mSlotMutex);
+        for (uint32_t index : mReclaiming) {
+            slot(index).nextFree = NoSlot;
+            if (mFreeTail == NoSlot) {
+                mFreeHead = index;
+            } else {
+                slot(mFreeTail).nextFree = index;
+            }
+            mFreeTail = index;
+        }
+        mReclaiming.clear();
+    }
+
+    // requires mTimerMutex. reprograms the timerfd if the earliest deadline moved
+    void armTimers() {
+        uint64_t tick = mTimers.nextTick();
+        if (tick == mTimers.mArmed) {
+            return;
+        }
+
+        struct itimerspec timeout {};
+        if (tick != NoTick) {
+            // a zero it_value would disarm, anything in the past expires immediately
+            uint64_t deadline = std::max<uint64_t>(tick << TickShift, 1);
+            timeout.it_value.tv_sec = deadline / 1000000000ULL;
+            timeout.it_value.tv_nsec = deadline % 1000000000ULL;
+        }
+        timerfd_settime(mTimerFd, TFD_TIMER_ABSTIME, &timeout, nullptr);
+        mTimers.mArmed = tick;
+    }
+
+    // timer handlers are called without the timer lock, so they can add or cancel timers. a
+    // timer cancelled while it is waiting in the fired list is skipped by its generation
+    void runTimers() {
+        std::array<uint64_t, 64> fired;
+        size_t count = 0;
+        bool more = true;
+        while (more) {
+            {
+                std::unique_lock<std::mutex> lock(mTimerMutex);
+                mTimers.mArmed = NoTick;
+                uint32_t head = NoSlot, tail = NoSlot;
+                mTimers.advance(EventLoop::now() >> TickShift, head, tail);
+
+                count = 0;
+                while (head != NoSlot && count < fired.size()) {
+                    uint32_t next = mTimers.slot(head).next;
+                    fired[count++] = mTimers.token(head);
+                    head = next;
+                }
+
+                // handlers that didn't fit go back for the next round
+                more = (head != NoSlot);
+                while (head != NoSlot) {
+                    uint32_t next = mTimers.slot(head).next;
+                    mTimers.link(head);
+                    head = next;
+                }
+                armTimers();
+            }
+
+            for (size_t i = 0; i < count; i++) {
+                uint32_t index = fired[i] & 0xffffffff;
+                {
+                    std::unique_lock<std::mutex> lock(mTimerMutex);
+                    if (mTimers.token(index) != fired[i]) {
+                        continue;
+                    }
+                    mTimers.mRunning = index;
+                    mTimers.mRunningReleased = false;
+                }
+                mTimers.slot(index).handler(0);
+
+                std::unique_lock<std::mutex> lock(mTimerMutex);
+                mTimers.mRunning = NoSlot;
+                if (mTimers.mRunningReleased) {
+                    mTimers.free(index);
+                } else if (!mTimers.slot(index).armed) {
+                    mTimers.release(index);
+                }
+            }
+        }
+    }
+
+    template <typename F>
+    void addInternalHandler(int fd, F&& function) {
+        uint32_t index = allocateSlot(fd, nullptr);
+        slot(index).handler.emplace(std::forward<F>(function));
+        struct epoll_event event { .events = EPOLLIN, .data = { .u64 = token(index) } };
+        if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            throw std::runtime_error("failed to add loop internal handler");
+        }
+    }
 };
 
-// helper to drain all handlers
+// helper to drain all handlers and timers
 void EventLoop::removeHandlers()
 {
     if (mState) {
-        for (auto handlerEntry : mHandlers) {
-            epoll_ctl(mState->mEpollFd, EPOLL_CTL_DEL, handlerEntry.first, nullptr);
+        std::unique_lock<std::mutex> lock(mState->mSlotMutex);
+        for (uint32_t index = 0; index < mState->mSlotCount; index++) {
+            HandlerSlot& handlerSlot = mState->slot(index);
+            if (handlerSlot.owner == this) {
+                epoll_ctl(mState->mEpollFd, EPOLL_CTL_DEL, handlerSlot.fd, nullptr);
+                mState->freeSlot(index);
+            }
+        }
+        lock.unlock();
+
+        std::unique_lock<std::mutex> timerLock(mState->mTimerMutex);
+        TimerWheel& timers = mState->mTimers;
+        for (uint32_t index = 0; index < timers.mSlotCount; index++) {
+            if (timers.slot(index).owner == this) {
+                if (timers.slot(index).armed) {
+                    timers.unlink(index);
+                }
+                timers.release(index);
+            }
+        }
+    }
+}
+
+void EventLoop::transferHandlers(const EventLoop* from)
+{
+    if (mState) {
+        std::unique_lock<std::mutex> lock(mState->mSlotMutex);
+        for (uint32_t index = 0; index < mState->mSlotCount; index++) {
+            if (mState->slot(index).owner == from) {
+                mState->slot(index).owner = this;
+            }
+        }
+        lock.unlock();
+
+        std::unique_lock<std::mutex> timerLock(mState->mTimerMutex);
+        TimerWheel& timers = mState->mTimers;
+        for (uint32_t index = 0; index < timers.mSlotCount; index++) {
+            if (timers.slot(index).owner == from) {
+                timers.slot(index).owner = this;
+            }
         }
-        mHandlers.clear();
     }
 }
 
 // base constructor creates a new event loop
-EventLoop::EventLoop() : mState(new EventLoopInternal()), mHandlers{} {}
+EventLoop::EventLoop() : mState(new EventLoopInternal()) {}
 
 // copy constructor subscribes to the internal state, doesn't copy the handlers
-EventLoop::EventLoop(const EventLoop& loop) : mState(loop.mState), mHandlers{} {}
+EventLoop::EventLoop(const EventLoop& loop) : mState(loop.mState) {}
 
 // move constructor takes the other loop's handlers
-EventLoop::EventLoop(EventLoop&& loop)
-    : mState{std::move(loop.mState)}, mHandlers{std::move(loop.mHandlers)} {}
+EventLoop::EventLoop(EventLoop&& loop) : mState{std::move(loop.mState)}
+{
+    transferHandlers(&loop);
+}
 
 // destructor removes all of our handlers from the state
 EventLoop::~EventLoop()
@@ -118,46 +636,153 @@ EventLoop& EventLoop::operator=(const EventLoop& loop)
 EventLoop& EventLoop::operator=(EventLoop&& loop) {
     removeHandlers();
     mState = std::move(loop.mState);
-    mHandlers = std::move(loop.mHandlers);
+    transferHandlers(&loop);
     return *this;
 }
 
-bool EventLoop::addEvent(int fd, uint32_t events, EventLoop::HandlerType handler)
+EventLoop::Handler* EventLoop::acquireSlot(int fd, uint64_t& token)
 {
     // we have to be careful with state (are we a moved object?)
-    if (!mState) {
-        return false;
+    if (!mState || fd < 0) {
+        return nullptr;
+    }
+
+    std::unique_lock<std::mutex> lock(mState->mSlotMutex);
+    uint32_t index = mState->findSlot(fd);
+    if (index != NoSlot) {
+        epoll_ctl(mState->mEpollFd, EPOLL_CTL_DEL, fd, nullptr);
+        mState->freeSlot(index);
     }
 
-    if (mHandlers.find(fd) != mHandlers.end()) {
-        removeEvent(fd);
+    index = mState->allocateSlot(fd, this);
+    if (index == NoSlot) {
+        return nullptr;
     }
+    token = mState->token(index);
+    return &mState->slot(index).handler;
+}
 
+bool EventLoop::registerSlot(int fd, uint32_t events, uint64_t token)
+{
     setNonBlocking(fd);
-    auto it = mHandlers.insert({fd, handler});
-    struct epoll_event event { .events = events, .data = { .ptr = &it.first->second } };
-    return epoll_ctl(mState->mEpollFd, EPOLL_CTL_ADD, fd, &event) != -1;
+    struct epoll_event event { .events = events, .data = { .u64 = token } };
+    if (epoll_ctl(mState->mEpollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        std::unique_lock<std::mutex> lock(mState->mSlotMutex);
+        mState->freeSlot(token & 0xffffffff);
+        return false;
+    }
+    return true;
 }
 
 bool EventLoop::modifyEvent(int fd, uint32_t events) {
     // we have to be careful with state (are we a moved object?)
-    decltype(mHandlers)::iterator it;
-    if (!mState || (it = mHandlers.find(fd)) == mHandlers.end()) {
+    if (!mState) {
         return false;
     }
 
-    struct epoll_event event { .events = events, .data = { .ptr = &it->second } };
+    std::unique_lock<std::mutex> lock(mState->mSlotMutex);
+    uint32_t index = mState->findSlot(fd);
+    if (index == NoSlot || mState->slot(index).owner != this) {
+        return false;
+    }
+
+    struct epoll_event event { .events = events, .data = { .u64 = mState->token(index) } };
     return epoll_ctl(mState->mEpollFd, EPOLL_CTL_MOD, fd, &event) != -1;
 }
 
+uint64_t EventLoop::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+EventLoop::Handler* EventLoop::acquireTimer(uint64_t deadline, TimerId& timer)
+{
+    if (!mState) {
+        return nullptr;
+    }
+
+    std::unique_lock<std::mutex> lock(mState->mTimerMutex);
+    uint32_t index = mState->mTimers.allocate(this);
+    if (index == NoSlot) {
+        return nullptr;
+    }
+    mState->mTimers.slot(index).tick = (deadline + (1ULL << TickShift) - 1) >> TickShift;
+    timer = mState->mTimers.token(index);
+    return &mState->mTimers.slot(index).handler;
+}
+
+void EventLoop::armTimer(TimerId timer)
+{
+    std::unique_lock<std::mutex> lock(mState->mTimerMutex);
+    mState->mTimers.link(timer & 0xffffffff);
+    mState->armTimers();
+}
+
+bool EventLoop::cancelTimer(TimerId timer)
+{
+    if (!mState || timer == NoTimer) {
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(mState->mTimerMutex);
+    TimerWheel& timers = mState->mTimers;
+    uint32_t index = timer & 0xffffffff;
+    if (index >= timers.mSlotCount || timers.token(index) != timer
+            || timers.slot(index).owner != this) {
+        return false;
+    }
+
+    bool armed = timers.slot(index).armed;
+    if (armed) {
+        timers.unlink(index);
+    }
+    timers.release(index);
+    return armed;
+}
+
+// runs the function on the loop thread
+bool EventLoop::post(std::function<void()> function) {
+    if (!mState) {
+        return false;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mState->mPostMutex);
+        mState->mPosted.push_back(std::move(function));
+    }
+    uint64_t data = 1;
+    return write(mState->mPostFd, &data, sizeof data) == sizeof data;
+}
+
+bool EventLoop::setAffinity(const cpu_set_t& cpus) {
+    if (!mState) {
+        return false;
+    }
+    return pthread_setaffinity_np(mState->mLoop.native_handle(), sizeof cpus, &cpus) == 0;
+}
+
+bool EventLoop::setName(const char* name) {
+    if (!mState) {
+        return false;
+    }
+    return pthread_setname_np(mState->mLoop.native_handle(), name) == 0;
+}
+
 void EventLoop::removeEvent(int fd) {
     // we have to be careful with state (are we a moved object?)
-    decltype(mHandlers)::iterator it;
-    if (!mState || (it = mHandlers.find(fd)) == mHandlers.end()) {
+    if (!mState) {
         return;
     }
 
-    if (epoll_ctl(mState->mEpollFd, EPOLL_CTL_DEL, fd, nullptr) != -1) {
-        mHandlers.erase(it);
+    std::unique_lock<std::mutex> lock(mState->mSlotMutex);
+    uint32_t index = mState->findSlot(fd);
+    if (index == NoSlot || mState->slot(index).owner != this) {
+        return;
     }
+
+    // a descriptor that was already closed has left the epoll set by itself
+    epoll_ctl(mState->mEpollFd, EPOLL_CTL_DEL, fd, nullptr);
+    mState->freeSlot(index);
 }
@@ -1,11 +1,16 @@
 #ifndef EVENTLOOP_H_
 #define EVENTLOOP_H_
 
+#include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <memory>
+#include <new>
 #include <thread>
-#include <unordered_map>
+#include <type_traits>
+#include <utility>
 
+#include <sched.h>
 #include <sys/epoll.h>
 
 struct EventLoopInternal;
@@ -13,12 +18,70 @@ struct EventLoopInternal;
 class EventLoop
 {
 public:
-    using HandlerType = std::function<void(uint32_t)>;
+    // callable stored inline in a handler slot, so registering a handler doesn't allocate and a
+    // dispatch is one indirect call
+    class Handler
+    {
+    public:
+        static constexpr size_t Capacity = 48;
+
+    private:
+        alignas(std::max_align_t) unsigned char mStorage[Capacity];
+        void (*mInvoke)(void*, uint32_t);
+        void (*mDestroy)(void*);
+
+    public:
+        Handler() : mInvoke(nullptr), mDestroy(nullptr) {}
+        Handler(const Handler&) = delete;
+        Handler(Handler&&) = delete;
+
+        ~Handler() { reset(); }
+
+        Handler& operator=(const Handler&) = delete;
+        Handler& operator=(Handler&&) = delete;
+
+        template <typename F>
+        void emplace(F&& function) {
+            using Callable = typename std::decay<F>::type;
+            static_assert(sizeof(Callable) <= Capacity, "handler doesn't fit the inline storage");
+            static_assert(alignof(Callable) <= alignof(std::max_align_t),
+                    "handler is over aligned");
+
+            reset();
+            new (mStorage) Callable(std::forward<F>(function));
+            mInvoke = [] (void* callable, uint32_t events) {
+                (*static_cast<Callable*>(callable))(events);
+            };
+            mDestroy = [] (void* callable) {
+                static_cast<Callable*>(callable)->~Callable();
+            };
+        }
+
+        void reset() {
+            if (mDestroy) {
+                mDestroy(mStorage);
+                mInvoke = nullptr;
+                mDestroy = nullptr;
+            }
+        }
+
+        void operator()(uint32_t events) { mInvoke(mStorage, events); }
+    };
+
+    // one shot timer handle (slot and generation), NoTimer is never handed out
+    using TimerId = uint64_t;
+    static constexpr TimerId NoTimer = UINT64_MAX;
 
 private:
     std::shared_ptr<EventLoopInternal> mState;
-    std::unordered_map<int, HandlerType> mHandlers;
     void removeHandlers();
+    void transferHandlers(const EventLoop* from);
+
+    // two step registration so the callable is constructed directly in its slot
+    Handler* acquireSlot(int fd, uint64_t& token);
+    bool registerSlot(int fd, uint32_t events, uint64_t token);
+    Handler* acquireTimer(uint64_t deadline, TimerId& timer);
+    void armTimer(TimerId timer);
 
 public:
     EventLoop();
@@ -29,9 +92,47 @@ public:
     EventLoop& operator=(const EventLoop&);
     EventLoop& operator=(EventLoop&&);
 
-    bool addEvent(int fd, uint32_t events, HandlerType handler);
+    template <typename F>
+    bool addEvent(int fd, uint32_t events, F&& function) {
+        uint64_t token;
+        Handler* handler = acquireSlot(fd, token);
+        if (!handler) {
+            return false;
+        }
+        handler->emplace(std::forward<F>(function));
+        return registerSlot(fd, events, token);
+    }
+
     bool modifyEvent(int fd, uint32_t events);
     void removeEvent(int fd);
+
+    // CLOCK_MONOTONIC in ns, the time base of timer deadlines
+    static uint64_t now();
+
+    // run a function once on the loop thread at (or just after) deadline
+    template <typename F>
+    TimerId addTimer(uint64_t deadline, F&& function) {
+        TimerId timer;
+        Handler* handler = acquireTimer(deadline, timer);
+        if (!handler) {
+            return NoTimer;
+        }
+        handler->emplace([function = std::forward<F>(function)] (uint32_t) mutable {
+            function();
+        });
+        armTimer(timer);
+        return timer;
+    }
+
+    // returns false if the timer already fired (or is firing)
+    bool cancelTimer(TimerId timer);
+
+    // runs a function on the loop thread (cross thread wakeup through an eventfd)
+    bool post(std::function<void()> function);
+
+    // applies to the loop thread, shared by all copies of this loop
+    bool setAffinity(const cpu_set_t& cpus);
+    bool setName(const char* name);
 };
 
-#endif /* EVENTLOOP_H_ */
\ No newline at end of file
+#endif /* EVENTLOOP_H_ */
@@ -0,0 +1,65 @@
+#include "EventLoopPool.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+
+EventLoopPool::EventLoopPool(size_t workers) : mLoops{}
+{
+    mLoops.reserve(workers ? workers : 1);
+    for (size_t i = 0; i < (workers ? workers : 1); i++) {
+        mLoops.emplace_back();
+
+        // thread names are limited to 15 characters
+        char name[32];
+        snprintf(name, sizeof name, "devices-%zu", i);
+        name[15] = '\0';
+        mLoops.back().setName(name);
+    }
+}
+
+bool EventLoopPool::setAffinity(const cpu_set_t& cpus)
+{
+    for (auto& loop : mLoops) {
+        if (!loop.setAffinity(cpus)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool EventLoopPool::parseCpuList(const char* list, cpu_set_t& cpus)
+{
+    CPU_ZERO(&cpus);
+    const char* p = list;
+    while (*p) {
+        char* end;
+        unsigned long first = strtoul(p, &end, 10);
+        if (end == p) {
+            return false;
+        }
+
+        unsigned long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtoul(p + 1, &end, 10);
+            if (end == p + 1 || last < first) {
+                return false;
+            }
+            p = end;
+        }
+
+        if (last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (unsigned long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, &cpus);
+        }
+
+        if (*p == ',') {
+            p++;
+        } else if (*p) {
+            return false;
+        }
+    }
+    return CPU_COUNT(&cpus) > 0;
+}
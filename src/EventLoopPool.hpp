@@ -0,0 +1,39 @@
+#ifndef EVENTLOOPPOOL_HPP_
+#define EVENTLOOPPOOL_HPP_
+
+#include "EventLoop.hpp"
+
+#include <vector>
+
+#include <sched.h>
+
+// a fixed set of event loop threads. devices are pinned to a worker by index, so the handlers of
+// one device always run on the same thread, and the workers can be kept off the vcpu's cpu.
+
+class EventLoopPool
+{
+    std::vector<EventLoop> mLoops;
+
+public:
+    EventLoopPool(size_t workers);
+    EventLoopPool(const EventLoopPool&) = delete;
+    EventLoopPool(EventLoopPool&&) = delete;
+
+    ~EventLoopPool() = default;
+
+    EventLoopPool& operator=(const EventLoopPool&) = delete;
+    EventLoopPool& operator=(EventLoopPool&&) = delete;
+
+    size_t size() const { return mLoops.size(); }
+
+    // worker for a device, wraps around the number of workers
+    const EventLoop& operator[](size_t device) const { return mLoops[device % mLoops.size()]; }
+
+    // restrict all workers to a set of cpus
+    bool setAffinity(const cpu_set_t& cpus);
+
+    // parse a cpu list like "1,3-5", returns false on a malformed string
+    static bool parseCpuList(const char* list, cpu_set_t& cpus);
+};
+
+#endif /* EVENTLOOPPOOL_HPP_ */
@@ -0,0 +1,112 @@
+#include "GuestMemory.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+
+#include <sys/ioctl.h>
+
+GuestMemory::GuestMemory(int vmFd)
+    : mVmFd(vmFd), mMutex{}, mSlots{}, mPages(AddressSpace / PageSize, Page{nullptr, 0, false}) {}
+
+bool GuestMemory::setRegion(const struct kvm_userspace_memory_region& region)
+{
+    std::unique_lock<std::shared_mutex> lock(mMutex);
+    if (ioctl(mVmFd, KVM_SET_USER_MEMORY_REGION, &region) == -1) {
+        return false;
+    }
+
+    auto slot = mSlots.find(region.slot);
+    if (slot != mSlots.end()) {
+        mapPages(slot->second, false);
+        mSlots.erase(slot);
+    }
+    if (region.memory_size) {
+        mSlots[region.slot] = region;
+        mapPages(region, true);
+    }
+    return true;
+}
+
+// kvm only takes page aligned slots. the part above the address space is left out
+void GuestMemory::mapPages(const struct kvm_userspace_memory_region& region, bool map)
+{
+    uint64_t end = std::min<uint64_t>(region.guest_phys_addr + region.memory_size, AddressSpace);
+    uint8_t* host = reinterpret_cast<uint8_t*>(region.userspace_addr);
+    bool writable = !(region.flags & KVM_MEM_READONLY);
+    for (uint64_t address = region.guest_phys_addr; address < end; address += PageSize) {
+        Page& page = mPages[address / PageSize];
+        if (map) {
+            page = Page{host + (address - region.guest_phys_addr), end, writable};
+        } else {
+            page = Page{nullptr, 0, false};
+        }
+    }
+}
+
+// requires mMutex
+const GuestMemory::Page* GuestMemory::lookup(uint64_t address) const
+{
+    if (address >= AddressSpace) {
+        return nullptr;
+    }
+    const Page& page = mPages[address / PageSize];
+    return page.host ? &page : nullptr;
+}
+
+uint8_t* GuestMemory::translate(uint64_t address, size_t* available, bool writable) const
+{
+    std::shared_lock<std::shared_mutex> lock(mMutex);
+    const Page* page = lookup(address);
+    if (!page || (writable && !page->writable)) {
+        return nullptr;
+    }
+    if (available) {
+        *available = page->end - address;
+    }
+    return page->host + (address % PageSize);
+}
+
+uint8_t* GuestMemory::span(uint64_t address, size_t length, bool writable) const
+{
+    size_t available;
+    uint8_t* host = translate(address, &available, writable);
+    return (host && length <= available) ? host : nullptr;
+}
+
+// slots are contiguous on the host, so a copy takes one memcpy per slot it touches
+size_t GuestMemory::read(uint64_t address, void* data, size_t length) const
+{
+    std::shared_lock<std::shared_mutex> lock(mMutex);
+    uint8_t* out = static_cast<uint8_t*>(data);
+    size_t copied = 0;
+    while (copied < length) {
+        const Page* page = lookup(address);
+        if (!page) {
+            break;
+        }
+        size_t count = std::min<uint64_t>(length - copied, page->end - address);
+        memcpy(out + copied, page->host + (address % PageSize), count);
+        copied += count;
+        address += count;
+    }
+    return copied;
+}
+
+size_t GuestMemory::write(uint64_t address, const void* data, size_t length)
+{
+    std::shared_lock<std::shared_mutex> lock(mMutex);
+    const uint8_t* in = static_cast<const uint8_t*>(data);
+    size_t copied = 0;
+    while (copied < length) {
+        const Page* page = lookup(address);
+        if (!page || !page->writable) {
+            break;
+        }
+        size_t count = std::min<uint64_t>(length - copied, page->end - address);
+        memcpy(page->host + (address % PageSize), in + copied, count);
+        copied += count;
+        address += count;
+    }
+    return copied;
+}
@@ -0,0 +1,68 @@
+#ifndef GUESTMEMORY_HPP_
+#define GUESTMEMORY_HPP_
+
+#include <cinttypes>
+#include <cstddef>
+#include <map>
+#include <shared_mutex>
+#include <vector>
+
+#include <linux/kvm.h>
+
+// guest physical memory as the vcpu sees it. every memslot goes through setRegion(), which keeps
+// a flat table of the 4 KiB pages of the 26 bit address space in step with kvm, so translating
+// a guest address is a single lookup. the table is only touched when a slot changes (a20, the
+// virtual disk window, the flash identification mode), never on an access.
+//
+// read() and write() copy under the table lock and may be used from any thread. they stop at
+// the first byte that isn't mapped, write() also at read only slots, like the guest would see
+// it. translate() and span() hand out host pointers, which stay valid until the slot changes:
+// only use them on the vcpu thread (which changes the slots) or while it is stopped.
+
+class GuestMemory
+{
+public:
+    static constexpr uint64_t PageSize = 0x1000;
+    static constexpr uint64_t AddressSpace = 0x4000000;
+
+private:
+    struct Page {
+        // host address of the page, nullptr if not mapped
+        uint8_t* host;
+        // guest address the slot ends at
+        uint64_t end;
+        bool writable;
+    };
+
+    int mVmFd;
+    mutable std::shared_mutex mMutex;
+    std::map<uint32_t, struct kvm_userspace_memory_region> mSlots;
+    std::vector<Page> mPages;
+
+    void mapPages(const struct kvm_userspace_memory_region& region, bool map);
+    const Page* lookup(uint64_t address) const;
+
+public:
+    GuestMemory(int vmFd);
+    GuestMemory(const GuestMemory&) = delete;
+    GuestMemory(GuestMemory&&) = delete;
+
+    GuestMemory& operator=(const GuestMemory&) = delete;
+    GuestMemory& operator=(GuestMemory&&) = delete;
+
+    // KVM_SET_USER_MEMORY_REGION. a memory_size of 0 deletes the slot. false with errno set if
+    // kvm refused the change, the table is left as it was then
+    bool setRegion(const struct kvm_userspace_memory_region& region);
+
+    // host address of a guest address and the bytes up to the end of its slot, nullptr if it
+    // isn't mapped (or read only, if writable is requested)
+    uint8_t* translate(uint64_t address, size_t* available = nullptr, bool writable = false) const;
+    // host address of a range that lies in a single slot, nullptr if it doesn't
+    uint8_t* span(uint64_t address, size_t length, bool writable = false) const;
+
+    // return the bytes copied
+    size_t read(uint64_t address, void* data, size_t length) const;
+    size_t write(uint64_t address, const void* data, size_t length);
+};
+
+#endif /* GUESTMEMORY_HPP_ */
@@ -0,0 +1,76 @@
+#ifndef MPSCQUEUE_HPP_
+#define MPSCQUEUE_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// bounded lock free queue, any thread may push, one thread pops. every cell carries a sequence
+// number telling producers and the consumer whose turn it is (after Vyukov's bounded queue).
+// entries are numbered from 1 in push order, so a producer can tell when the consumer has
+// processed a particular entry.
+
+template <typename T, size_t Capacity>
+class MpscQueue
+{
+    static_assert(Capacity && !(Capacity & (Capacity - 1)), "capacity must be a power of two");
+
+    struct Cell {
+        std::atomic<uint64_t> sequence;
+        T value;
+    };
+
+    alignas(64) std::atomic<uint64_t> mTail;
+    alignas(64) uint64_t mHead;
+    Cell mCells[Capacity];
+
+public:
+    MpscQueue() : mTail(0), mHead(0), mCells{} {
+        for (size_t i = 0; i < Capacity; i++) {
+            mCells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue(MpscQueue&&) = delete;
+
+    ~MpscQueue() = default;
+
+    MpscQueue& operator=(const MpscQueue&) = delete;
+    MpscQueue& operator=(MpscQueue&&) = delete;
+
+    // returns false if the queue is full
+    bool push(const T& value, uint64_t& position) {
+        uint64_t tail = mTail.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = mCells[tail & (Capacity - 1)];
+            int64_t difference = (int64_t) (cell.sequence.load(std::memory_order_acquire) - tail);
+            if (difference == 0) {
+                if (mTail.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.sequence.store(tail + 1, std::memory_order_release);
+                    position = tail + 1;
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                tail = mTail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // consumer only
+    bool pop(T& value, uint64_t& position) {
+        Cell& cell = mCells[mHead & (Capacity - 1)];
+        if (cell.sequence.load(std::memory_order_acquire) != mHead + 1) {
+            return false;
+        }
+        value = cell.value;
+        cell.sequence.store(mHead + Capacity, std::memory_order_release);
+        position = ++mHead;
+        return true;
+    }
+};
+
+#endif /* MPSCQUEUE_HPP_ */
@@ -0,0 +1,37 @@
+#include "PollDetector.hpp"
+#include "DeviceActivity.hpp"
+
+#include <cstring>
+
+PollDetector::PollDetector(uint64_t maximumWait)
+    : mMaximumWait(maximumWait), mPort(0), mSize(0), mValue(0), mCount(0) {}
+
+void PollDetector::read(DevicePio& device, uint16_t port, const void* data, size_t size,
+        uint32_t generation)
+{
+    if (!mMaximumWait || size > sizeof mValue) {
+        return;
+    }
+
+    uint64_t value = 0;
+    memcpy(&value, data, size);
+    if (!mCount || port != mPort || size != mSize || value != mValue) {
+        mPort = port;
+        mSize = size;
+        mValue = value;
+        mCount = 1;
+        return;
+    }
+    if (++mCount < Threshold) {
+        return;
+    }
+
+    uint64_t timeout = device.pollTimeout(port);
+    if (timeout <= WakeupMargin) {
+        return;
+    }
+    if (timeout != UINT64_MAX) {
+        timeout -= WakeupMargin;
+    }
+    DeviceActivity::wait(generation, (timeout < mMaximumWait) ? timeout : mMaximumWait);
+}
@@ -0,0 +1,47 @@
+#ifndef POLLDETECTOR_HPP_
+#define POLLDETECTOR_HPP_
+
+#include "hardware/DevicePio.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+// spots a guest spinning on a device register (the uart line status, rtc register A) and parks
+// the vcpu thread instead of re-entering the guest for another exit. once a port read returned
+// the same value enough times in a row, every further identical read sleeps until a device
+// signals DeviceActivity, the time the device says the value could change on its own, or the
+// wait limit, whichever comes first. anything but a port read starts over.
+
+class PollDetector
+{
+    // consecutive identical reads before the vcpu parks
+    static constexpr unsigned Threshold = 64;
+    // a sleeping thread wakes late by the timer slack and scheduling latency. a vcpu waiting
+    // for a change due sooner than this keeps spinning, otherwise it wakes this much early
+    static constexpr uint64_t WakeupMargin = 500000;
+
+    uint64_t mMaximumWait;
+    uint16_t mPort;
+    size_t mSize;
+    uint64_t mValue;
+    unsigned mCount;
+
+public:
+    // maximumWait in ns, 0 disables parking
+    PollDetector(uint64_t maximumWait);
+    PollDetector(const PollDetector&) = delete;
+    PollDetector(PollDetector&&) = delete;
+
+    ~PollDetector() = default;
+
+    PollDetector& operator=(const PollDetector&) = delete;
+    PollDetector& operator=(PollDetector&&) = delete;
+
+    // generation is DeviceActivity::generation() from before the device performed the read, so
+    // a change that raced with it isn't slept through
+    void read(DevicePio& device, uint16_t port, const void* data, size_t size,
+            uint32_t generation);
+    void reset() { mCount = 0; }
+};
+
+#endif /* POLLDETECTOR_HPP_ */
@@ -0,0 +1,71 @@
+#ifndef SEQLOCK_HPP_
+#define SEQLOCK_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// single writer snapshot of a small trivially copyable value. readers retry while a store is in
+// progress and never block the writer. the value is kept as relaxed atomic words, so a read
+// racing a store is well defined and simply discarded.
+
+template <typename T>
+class SeqLock
+{
+    static_assert(std::is_trivially_copyable<T>::value, "seqlock values are copied bytewise");
+    static constexpr size_t Words = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    std::atomic<uint32_t> mSequence;
+    std::atomic<uint64_t> mWords[Words];
+
+public:
+    SeqLock() : mSequence(0) {
+        for (auto& word : mWords) {
+            word.store(0, std::memory_order_relaxed);
+        }
+        store(T{});
+    }
+
+    SeqLock(const SeqLock&) = delete;
+    SeqLock(SeqLock&&) = delete;
+
+    ~SeqLock() = default;
+
+    SeqLock& operator=(const SeqLock&) = delete;
+    SeqLock& operator=(SeqLock&&) = delete;
+
+    // only one thread may store
+    void store(const T& value) {
+        uint64_t words[Words] = {};
+        memcpy(words, &value, sizeof(T));
+
+        uint32_t sequence = mSequence.load(std::memory_order_relaxed);
+        mSequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < Words; i++) {
+            mWords[i].store(words[i], std::memory_order_relaxed);
+        }
+        mSequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    T load() const {
+        uint64_t words[Words];
+        uint32_t before, after;
+        do {
+            before = mSequence.load(std::memory_order_acquire);
+            for (size_t i = 0; i < Words; i++) {
+                words[i] = mWords[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = mSequence.load(std::memory_order_relaxed);
+        } while ((before & 1) || before != after);
+
+        T value;
+        memcpy(&value, words, sizeof(T));
+        return value;
+    }
+};
+
+#endif /* SEQLOCK_HPP_ */
@@ -0,0 +1,73 @@
+#include "VirtualClock.hpp"
+
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+namespace
+{
+    // the TSC must tick at a constant rate through frequency changes and idle states
+    bool hasInvariantTSC()
+    {
+        std::ifstream cpuinfo("/proc/cpuinfo");
+        std::string line;
+        while (std::getline(cpuinfo, line)) {
+            if (line.compare(0, 5, "flags")) {
+                continue;
+            }
+
+            bool constant = false, nonstop = false;
+            std::istringstream flags(line.substr(line.find(':') + 1));
+            std::string flag;
+            while (flags >> flag) {
+                constant |= (flag == "constant_tsc");
+                nonstop |= (flag == "nonstop_tsc");
+            }
+            return constant && nonstop;
+        }
+        return false;
+    }
+} /* anonymous */
+
+VirtualClock::VirtualClock() : mUseTSC(false), mBaseTSC(0), mBaseTime(0), mScale(0) {
+    if (hasInvariantTSC()) {
+        calibrate();
+    } else {
+        fprintf(stderr, "warning: no invariant TSC, devices use clock_gettime().\n");
+    }
+}
+
+uint64_t VirtualClock::monotonicTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// measure the TSC against CLOCK_MONOTONIC over 20 ms, each sample bracketed by two TSC reads
+void VirtualClock::calibrate() {
+    auto sample = [] (uint64_t& tsc, uint64_t& time) {
+        uint64_t before = __rdtsc();
+        time = monotonicTime();
+        uint64_t after = __rdtsc();
+        tsc = before + (after - before) / 2;
+    };
+
+    uint64_t startTSC, startTime;
+    sample(startTSC, startTime);
+    struct timespec delay { .tv_sec = 0, .tv_nsec = 20000000 };
+    nanosleep(&delay, nullptr);
+    uint64_t endTSC, endTime;
+    sample(endTSC, endTime);
+
+    if (endTSC <= startTSC) {
+        fprintf(stderr, "warning: TSC calibration failed, devices use clock_gettime().\n");
+        return;
+    }
+
+    mScale = ((endTime - startTime) << 32) / (endTSC - startTSC);
+    mBaseTSC = endTSC;
+    mBaseTime = endTime;
+    mUseTSC = true;
+}
@@ -0,0 +1,68 @@
+#ifndef VIRTUALCLOCK_HPP_
+#define VIRTUALCLOCK_HPP_
+
+#include <cinttypes>
+
+#include <x86intrin.h>
+
+// division by a run time constant as a multiply with its reciprocal. exact as long as
+// value * divisor stays below 2^64 (years worth of nanoseconds for the device clocks)
+class Reciprocal
+{
+    uint64_t mDivisor;
+    uint64_t mMultiplier;
+
+public:
+    Reciprocal(uint64_t divisor = 1)
+            : mDivisor(divisor), mMultiplier((divisor > 1) ? (UINT64_MAX / divisor) + 1 : 0) {}
+
+    uint64_t divisor() const { return mDivisor; }
+
+    uint64_t divide(uint64_t value) const {
+        if (!mMultiplier) {
+            return value;
+        }
+        return (uint64_t) (((unsigned __int128) value * mMultiplier) >> 64);
+    }
+
+    uint64_t modulo(uint64_t value) const {
+        return value - divide(value) * mDivisor;
+    }
+};
+
+// time source shared by the devices. monotonic time comes from the (invariant) TSC scaled by a
+// factor calibrated against CLOCK_MONOTONIC at startup, falling back to the vdso clock if the
+// TSC isn't usable.
+
+class VirtualClock
+{
+    bool mUseTSC;
+    uint64_t mBaseTSC;
+    uint64_t mBaseTime;
+    // nanoseconds per TSC tick in 32.32 fixed point
+    uint64_t mScale;
+
+    static uint64_t monotonicTime();
+    void calibrate();
+
+public:
+    VirtualClock();
+    VirtualClock(const VirtualClock&) = delete;
+    VirtualClock(VirtualClock&&) = delete;
+
+    ~VirtualClock() = default;
+
+    VirtualClock& operator=(const VirtualClock&) = delete;
+    VirtualClock& operator=(VirtualClock&&) = delete;
+
+    // monotonic time in ns
+    uint64_t now() const {
+        if (!mUseTSC) {
+            return monotonicTime();
+        }
+        uint64_t elapsed = __rdtsc() - mBaseTSC;
+        return mBaseTime + (uint64_t) (((unsigned __int128) elapsed * mScale) >> 32);
+    }
+};
+
+#endif /* VIRTUALCLOCK_HPP_ */
@@ -0,0 +1,819 @@
+#include "GdbStub.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define LOG_ERROR(fmt) { \
+    std::cerr << "[ERROR] [GDB \"" << mSocketName << "\"]: "<< fmt << std::endl; \
+};
+
+#ifndef NDEBUG
+#define LOG_INFO(fmt) { \
+    std::cerr << "[INFO] [GDB \"" << mSocketName << "\"]: "<< fmt << std::endl; \
+};
+#else
+#define LOG_INFO(fmt)
+#endif
+
+namespace
+{
+    constexpr size_t MaximumPacketSize = 0x4000;
+    constexpr size_t MaximumBreakpoints = 4;
+    constexpr unsigned RegisterCount = 16;
+    constexpr int SignalInterrupt = 2;
+    constexpr int SignalTrap = 5;
+
+    struct kvm_run* volatile kickedRun = nullptr;
+    volatile sig_atomic_t kickDelivered = 0;
+
+    // kicks the vcpu out of KVM_RUN (or prevents the next entry)
+    void kickSignalHandler(int signo)
+    {
+        if (kickedRun) {
+            kickedRun->immediate_exit = 1;
+            kickDelivered = 1;
+        }
+    }
+
+    const char hexDigits[] = "0123456789abcdef";
+
+    inline void appendHexByte(std::string& out, uint8_t value)
+    {
+        out.push_back(hexDigits[value >> 4]);
+        out.push_back(hexDigits[value & 0x0f]);
+    }
+
+    inline void appendHex32(std::string& out, uint32_t value)
+    {
+        // target byte order (little endian)
+        for (int i = 0; i < 4; i++) {
+            appendHexByte(out, (value >> (i * 8)) & 0xff);
+        }
+    }
+
+    inline int hexValue(char c)
+    {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return -1;
+    }
+
+    bool parseHexByte(const char* in, uint8_t& value)
+    {
+        int high = hexValue(in[0]);
+        int low = (high >= 0) ? hexValue(in[1]) : -1;
+        if (low < 0) {
+            return false;
+        }
+        value = (high << 4) | low;
+        return true;
+    }
+
+    bool parseHex32(const char* in, uint32_t& value)
+    {
+        value = 0;
+        for (int i = 0; i < 4; i++) {
+            uint8_t byte;
+            if (!parseHexByte(in + i * 2, byte)) {
+                return false;
+            }
+            value |= (uint32_t) byte << (i * 8);
+        }
+        return true;
+    }
+
+    // parses a big endian hex number (addresses, lengths), advances the pointer
+    bool parseHexNumber(const char*& in, uint64_t& value)
+    {
+        const char* start = in;
+        value = 0;
+        int digit;
+        while ((digit = hexValue(*in)) >= 0) {
+            value = (value << 4) | digit;
+            in++;
+        }
+        return in != start;
+    }
+
+    void setSegment(struct kvm_segment& segment, uint32_t selector, bool realMode)
+    {
+        segment.selector = selector & 0xffff;
+        if (realMode) {
+            segment.base = (uint64_t) segment.selector << 4;
+        }
+    }
+} /* anonymous */
+
+GdbStub::GdbStub(const EventLoop& eventLoop, GuestMemory& memory)
+    : mEventLoop(eventLoop), mMemory(memory), mSocketName{}, mMutex{}, mResume{}, mVcpuFd(-1), mRun(nullptr),
+    mVcpuThread{}, mStopRequested(false), mStopped(false), mStepping(false),
+    mStopSignal(SignalTrap), mBreakpoints{}, fds{-1, -1, -1}, mInput{}, mOutput{},
+    mNoAckMode(false), mStopReplyPending(false) {}
+
+GdbStub::~GdbStub()
+{
+    stop();
+}
+
+bool GdbStub::start(const std::string& socketName, int vcpuFd, struct kvm_run* run,
+        bool waitForClient)
+{
+    stop();
+
+    mVcpuFd = vcpuFd;
+    mRun = run;
+    mVcpuThread = pthread_self();
+    kickedRun = run;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = kickSignalHandler;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGUSR1, &action, nullptr) == -1) {
+        LOG_ERROR("unable to install vcpu kick handler.");
+        return false;
+    }
+
+    // create unix socket for the debugger
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    mSocketName = socketName;
+    strcpy(addr.sun_path, socketName.c_str());
+    unlink(addr.sun_path);
+
+    fds.server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fds.server == -1) {
+        LOG_ERROR("failed to create unix socket.");
+        return false;
+    }
+
+    if (bind(fds.server, (struct sockaddr*) &addr, sizeof addr) == -1) {
+        LOG_ERROR("unable to bind unix socket server.");
+        return false;
+    }
+
+    if (listen(fds.server, 1) == -1) {
+        LOG_ERROR("unable to listen on unix server socket");
+        return false;
+    }
+
+    fds.stopEvent = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fds.stopEvent == -1) {
+        LOG_ERROR("unable to create stop event.");
+        return false;
+    }
+
+    mStopRequested = waitForClient;
+
+    // the vcpu thread notifies us whenever it parks
+    mEventLoop.addEvent(fds.stopEvent, EPOLLIN, [this] (uint32_t events) {
+        handleStopEvent(events);
+    });
+
+    // only a single debugger may be attached at a time
+    mEventLoop.addEvent(fds.server, EPOLLIN, [this] (uint32_t events) {
+        if (events & EPOLLERR) {
+            LOG_ERROR("error occurred with server socket.");
+            return;
+        }
+
+        int fd = accept(fds.server, nullptr, nullptr);
+        if (fd == -1) {
+            LOG_ERROR("failed to accept client connection.");
+            return;
+        }
+
+        if (fds.client != -1) {
+            LOG_ERROR("rejecting connection, a debugger is already attached.");
+            close(fd);
+            return;
+        }
+
+        LOG_INFO("debugger attached.");
+        fds.client = fd;
+        mInput.clear();
+        mOutput.clear();
+        mNoAckMode = false;
+        mEventLoop.addEvent(fd, EPOLLIN, [this] (uint32_t events) {
+            handleClientEvent(events);
+        });
+
+        // the target is expected to be stopped when a debugger attaches
+        std::unique_lock<std::mutex> lock(mMutex);
+        mStopReplyPending = false;
+        requestStop();
+    });
+
+    return true;
+}
+
+void GdbStub::stop()
+{
+    closeClient();
+
+    if (fds.server != -1) {
+        mEventLoop.removeEvent(fds.server);
+        close(fds.server);
+        fds.server = -1;
+        unlink(mSocketName.c_str());
+    }
+
+    if (fds.stopEvent != -1) {
+        mEventLoop.removeEvent(fds.stopEvent);
+        close(fds.stopEvent);
+        fds.stopEvent = -1;
+    }
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    mStopped = false;
+    mResume.notify_all();
+    kickedRun = nullptr;
+}
+
+void GdbStub::closeClient()
+{
+    if (fds.client == -1) {
+        return;
+    }
+
+    mEventLoop.removeEvent(fds.client);
+    close(fds.client);
+    fds.client = -1;
+    LOG_INFO("debugger detached.");
+
+    // release the target
+    std::unique_lock<std::mutex> lock(mMutex);
+    mBreakpoints.clear();
+    mStepping = false;
+    mStopRequested = false;
+    if (mStopped) {
+        resume(false);
+    }
+}
+
+void GdbStub::requestStop()
+{
+    if (mStopped) {
+        return;
+    }
+    mStopRequested = true;
+    pthread_kill(mVcpuThread, SIGUSR1);
+}
+
+void GdbStub::parkVcpu(std::unique_lock<std::mutex>& lock, int signal,
+        const volatile sig_atomic_t& abort)
+{
+    mStopRequested = false;
+    mStopped = true;
+    mStopSignal = signal;
+    mRun->immediate_exit = 0;
+    kickDelivered = 0;
+
+    uint64_t data = 1;
+    write(fds.stopEvent, &data, sizeof data);
+
+    while (mStopped && !abort) {
+        mResume.wait_for(lock, std::chrono::milliseconds(100));
+    }
+    mStopped = false;
+}
+
+void GdbStub::poll(const volatile sig_atomic_t& abort)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (mStopRequested) {
+        parkVcpu(lock, SignalInterrupt, abort);
+    } else if (kickDelivered) {
+        // the stop was called off (the debugger detached) after the kick, KVM_RUN would keep
+        // returning EINTR
+        kickDelivered = 0;
+        mRun->immediate_exit = 0;
+    }
+}
+
+bool GdbStub::handleDebugExit(const struct kvm_debug_exit_arch& debug,
+        const volatile sig_atomic_t& abort)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (!mStepping && mBreakpoints.empty()) {
+        return false;
+    }
+
+    parkVcpu(lock, SignalTrap, abort);
+    return true;
+}
+
+bool GdbStub::applyGuestDebug()
+{
+    struct kvm_guest_debug debug;
+    memset(&debug, 0, sizeof debug);
+
+    if (mStepping || !mBreakpoints.empty()) {
+        debug.control = KVM_GUESTDBG_ENABLE;
+        if (mStepping) {
+            debug.control |= KVM_GUESTDBG_SINGLESTEP;
+        }
+        if (!mBreakpoints.empty()) {
+            debug.control |= KVM_GUESTDBG_USE_HW_BP;
+        }
+    }
+
+    uint64_t dr7 = 0;
+    for (size_t i = 0; i < mBreakpoints.size(); i++) {
+        const Breakpoint& breakpoint = mBreakpoints[i];
+
+        // Z0/Z1 execute, Z2 write, Z4 access
+        uint64_t type = (breakpoint.type == 2) ? 1 : (breakpoint.type == 4) ? 3 : 0;
+        uint64_t length = (breakpoint.length == 2) ? 1 : (breakpoint.length == 4) ? 3 : 0;
+        debug.arch.debugreg[i] = breakpoint.address;
+        dr7 |= 1ULL << (i * 2);
+        dr7 |= type << (16 + i * 4);
+        dr7 |= length << (18 + i * 4);
+    }
+    debug.arch.debugreg[7] = dr7;
+
+    if (ioctl(mVcpuFd, KVM_SET_GUEST_DEBUG, &debug) == -1) {
+        LOG_ERROR("KVM_SET_GUEST_DEBUG failed: " << strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void GdbStub::resume(bool step)
+{
+    mStepping = step;
+    applyGuestDebug();
+    mStopped = false;
+    mResume.notify_all();
+}
+
+void GdbStub::handleStopEvent(uint32_t events)
+{
+    uint64_t data = 0;
+    read(fds.stopEvent, &data, sizeof data);
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (mStopped && mStopReplyPending && fds.client != -1) {
+        char reply[4];
+        snprintf(reply, sizeof reply, "S%02x", mStopSignal);
+        mStopReplyPending = false;
+        sendPacket(reply);
+    }
+}
+
+void GdbStub::handleClientEvent(uint32_t events)
+{
+    if (events & EPOLLOUT) {
+        flushOutput();
+    }
+
+    if (events & EPOLLIN) {
+        char buffer[4096];
+        ssize_t n;
+        while ((n = read(fds.client, buffer, sizeof buffer)) > 0) {
+            mInput.append(buffer, n);
+        }
+        if (n == 0) {
+            closeClient();
+            return;
+        }
+        processInput();
+    }
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        closeClient();
+    }
+}
+
+void GdbStub::processInput()
+{
+    size_t position = 0;
+    while (position < mInput.size() && fds.client != -1) {
+        char c = mInput[position];
+        if (c == 0x03) {
+            // interrupt request
+            std::unique_lock<std::mutex> lock(mMutex);
+            mStopReplyPending = true;
+            if (mStopped) {
+                lock.unlock();
+                handleStopEvent(0);
+            } else {
+                requestStop();
+            }
+            position++;
+        } else if (c == '$') {
+            size_t end = mInput.find('#', position);
+            if (end == std::string::npos || end + 2 >= mInput.size()) {
+                // incomplete packet
+                break;
+            }
+
+            std::string packet = mInput.substr(position + 1, end - position - 1);
+            uint8_t checksum = 0, expected = 0;
+            for (char p : packet) {
+                checksum += (uint8_t) p;
+            }
+            position = end + 3;
+
+            if (!parseHexByte(&mInput[end + 1], expected) || checksum != expected) {
+                if (!mNoAckMode) {
+                    mOutput.push_back('-');
+                    flushOutput();
+                }
+                continue;
+            }
+
+            if (!mNoAckMode) {
+                mOutput.push_back('+');
+            }
+            handlePacket(packet);
+        } else {
+            // acks and line noise
+            position++;
+        }
+    }
+    mInput.erase(0, position);
+}
+
+void GdbStub::sendPacket(const std::string& payload)
+{
+    uint8_t checksum = 0;
+    for (char c : payload) {
+        checksum += (uint8_t) c;
+    }
+
+    mOutput.reserve(mOutput.size() + payload.size() + 4);
+    mOutput.push_back('$');
+    mOutput.append(payload);
+    mOutput.push_back('#');
+    appendHexByte(mOutput, checksum);
+    flushOutput();
+}
+
+void GdbStub::flushOutput()
+{
+    if (fds.client == -1) {
+        mOutput.clear();
+        return;
+    }
+
+    size_t written = 0;
+    while (written < mOutput.size()) {
+        ssize_t n = write(fds.client, mOutput.data() + written, mOutput.size() - written);
+        if (n <= 0) {
+            break;
+        }
+        written += n;
+    }
+    mOutput.erase(0, written);
+
+    // wait for the socket to drain if the reply didn't fit
+    mEventLoop.modifyEvent(fds.client, mOutput.empty() ? EPOLLIN : (EPOLLIN | EPOLLOUT));
+}
+
+void GdbStub::handlePacket(const std::string& packet)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    const char* arguments = packet.c_str() + 1;
+
+    // queries are answered at any time, everything else requires a stopped target
+    switch (packet.empty() ? '\0' : packet[0]) {
+        case 'q':
+            if (packet.compare(0, 10, "qSupported") == 0) {
+                char reply[64];
+                snprintf(reply, sizeof reply, "PacketSize=%zx;QStartNoAckMode+;binary-upload+",
+                        MaximumPacketSize);
+                sendPacket(reply);
+            } else if (packet == "qAttached") {
+                sendPacket("1");
+            } else if (packet == "qC") {
+                sendPacket("QC1");
+            } else if (packet == "qfThreadInfo") {
+                sendPacket("m1");
+            } else if (packet == "qsThreadInfo") {
+                sendPacket("l");
+            } else {
+                sendPacket("");
+            }
+            return;
+        case 'Q':
+            if (packet == "QStartNoAckMode") {
+                sendPacket("OK");
+                mNoAckMode = true;
+            } else {
+                sendPacket("");
+            }
+            return;
+        case '?':
+            if (mStopped) {
+                char reply[4];
+                snprintf(reply, sizeof reply, "S%02x", mStopSignal);
+                sendPacket(reply);
+            } else {
+                mStopReplyPending = true;
+                requestStop();
+            }
+            return;
+        case 'H':
+        case 'T':
+            sendPacket("OK");
+            return;
+        case 'D':
+            sendPacket("OK");
+            lock.unlock();
+            closeClient();
+            return;
+        case 'k':
+            lock.unlock();
+            closeClient();
+            return;
+        case 'v':
+            // no vCont support, gdb falls back to c/s
+            sendPacket("");
+            return;
+        default:
+            break;
+    }
+
+    if (!mStopped) {
+        sendPacket("E01");
+        return;
+    }
+
+    switch (packet[0]) {
+        case 'g':
+            sendPacket(readRegisters());
+            break;
+        case 'G':
+            sendPacket(writeRegisters(packet.substr(1)) ? "OK" : "E01");
+            break;
+        case 'p':
+        {
+            uint64_t index;
+            uint32_t value;
+            if (!parseHexNumber(arguments, index) || !readRegister(index, value)) {
+                sendPacket("E01");
+                break;
+            }
+            std::string reply;
+            appendHex32(reply, value);
+            sendPacket(reply);
+            break;
+        }
+        case 'P':
+        {
+            uint64_t index;
+            uint32_t value;
+            if (!parseHexNumber(arguments, index) || *arguments++ != '='
+                    || !parseHex32(arguments, value) || !writeRegister(index, value)) {
+                sendPacket("E01");
+                break;
+            }
+            sendPacket("OK");
+            break;
+        }
+        case 'm':
+        case 'x':
+        {
+            uint64_t address, length;
+            if (!parseHexNumber(arguments, address) || *arguments++ != ','
+                    || !parseHexNumber(arguments, length)) {
+                sendPacket("E01");
+                break;
+            }
+            if (length > MaximumPacketSize / 2 - 8) {
+                length = MaximumPacketSize / 2 - 8;
+            }
+
+            // 'x' is the binary upload variant of 'm'
+            std::string reply;
+            if (packet[0] == 'x') {
+                reply.push_back('b');
+            }
+            if (!readMemory(address, length, reply, packet[0] == 'x')) {
+                sendPacket("E14");
+                break;
+            }
+            sendPacket(reply);
+            break;
+        }
+        case 'M':
+        {
+            uint64_t address, length;
+            if (!parseHexNumber(arguments, address) || *arguments++ != ','
+                    || !parseHexNumber(arguments, length) || *arguments++ != ':'
+                    || strlen(arguments) != length * 2) {
+                sendPacket("E01");
+                break;
+            }
+            sendPacket(writeMemory(address, arguments) ? "OK" : "E14");
+            break;
+        }
+        case 'c':
+        case 's':
+        {
+            // optional resume address
+            uint64_t address;
+            if (parseHexNumber(arguments, address)) {
+                struct kvm_regs regs;
+                if (ioctl(mVcpuFd, KVM_GET_REGS, &regs) != -1) {
+                    regs.rip = address;
+                    ioctl(mVcpuFd, KVM_SET_REGS, &regs);
+                }
+            }
+            mStopReplyPending = true;
+            resume(packet[0] == 's');
+            break;
+        }
+        case 'Z':
+        case 'z':
+        {
+            uint64_t type, address, length;
+            if (!parseHexNumber(arguments, type) || *arguments++ != ','
+                    || !parseHexNumber(arguments, address) || *arguments++ != ','
+                    || !parseHexNumber(arguments, length)) {
+                sendPacket("E01");
+                break;
+            }
+
+            // everything is a debug register breakpoint, read watchpoints aren't supported by x86
+            if (type > 4 || type == 3) {
+                sendPacket("");
+                break;
+            }
+            if (type < 2) {
+                length = 1;
+            } else if (length != 1 && length != 2 && length != 4) {
+                sendPacket("E01");
+                break;
+            }
+
+            auto it = mBreakpoints.begin();
+            for (; it != mBreakpoints.end(); it++) {
+                if (it->address == address && it->type == (type ? type : 1)
+                        && it->length == length) {
+                    break;
+                }
+            }
+
+            if (packet[0] == 'Z') {
+                if (it == mBreakpoints.end()) {
+                    if (mBreakpoints.size() == MaximumBreakpoints) {
+                        sendPacket("E0c");
+                        break;
+                    }
+                    mBreakpoints.push_back(Breakpoint{address, (uint8_t) (type ? type : 1),
+                            (uint8_t) length});
+                }
+            } else if (it != mBreakpoints.end()) {
+                mBreakpoints.erase(it);
+            }
+            sendPacket(applyGuestDebug() ? "OK" : "E01");
+            break;
+        }
+        default:
+            sendPacket("");
+            break;
+    }
+}
+
+std::string GdbStub::readRegisters()
+{
+    std::string reply;
+    reply.reserve(RegisterCount * 8);
+    for (unsigned i = 0; i < RegisterCount; i++) {
+        uint32_t value;
+        if (!readRegister(i, value)) {
+            return "E01";
+        }
+        appendHex32(reply, value);
+    }
+    return reply;
+}
+
+bool GdbStub::writeRegisters(const std::string& data)
+{
+    if (data.size() < RegisterCount * 8) {
+        return false;
+    }
+
+    for (unsigned i = 0; i < RegisterCount; i++) {
+        uint32_t value;
+        if (!parseHex32(&data[i * 8], value) || !writeRegister(i, value)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// gdb i386 register order: eax ecx edx ebx esp ebp esi edi eip eflags cs ss ds es fs gs
+bool GdbStub::readRegister(unsigned index, uint32_t& value)
+{
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    if (index >= RegisterCount || ioctl(mVcpuFd, KVM_GET_REGS, &regs) == -1
+            || ioctl(mVcpuFd, KVM_GET_SREGS, &sregs) == -1) {
+        return false;
+    }
+
+    const uint64_t values[RegisterCount] = {
+        regs.rax, regs.rcx, regs.rdx, regs.rbx, regs.rsp, regs.rbp, regs.rsi, regs.rdi,
+        regs.rip, regs.rflags, sregs.cs.selector, sregs.ss.selector, sregs.ds.selector,
+        sregs.es.selector, sregs.fs.selector, sregs.gs.selector
+    };
+    value = values[index];
+    return true;
+}
+
+bool GdbStub::writeRegister(unsigned index, uint32_t value)
+{
+    if (index >= RegisterCount) {
+        return false;
+    }
+
+    if (index < 10) {
+        struct kvm_regs regs;
+        if (ioctl(mVcpuFd, KVM_GET_REGS, &regs) == -1) {
+            return false;
+        }
+        __u64* targets[10] = {
+            &regs.rax, &regs.rcx, &regs.rdx, &regs.rbx, &regs.rsp, &regs.rbp, &regs.rsi,
+            &regs.rdi, &regs.rip, &regs.rflags
+        };
+        *targets[index] = value;
+        return ioctl(mVcpuFd, KVM_SET_REGS, &regs) != -1;
+    }
+
+    // segment registers, descriptors are only reloaded in real mode
+    struct kvm_sregs sregs;
+    if (ioctl(mVcpuFd, KVM_GET_SREGS, &sregs) == -1) {
+        return false;
+    }
+    struct kvm_segment* segments[6] = {
+        &sregs.cs, &sregs.ss, &sregs.ds, &sregs.es, &sregs.fs, &sregs.gs
+    };
+    setSegment(*segments[index - 10], value, !(sregs.cr0 & 1));
+    return ioctl(mVcpuFd, KVM_SET_SREGS, &sregs) != -1;
+}
+
+// the vcpu is parked, so the host mappings stay put while the reply is encoded
+bool GdbStub::readMemory(uint64_t address, uint64_t length, std::string& out, bool binary)
+{
+    size_t initialSize = out.size();
+    out.reserve(initialSize + length * 2);
+    while (length) {
+        // partial reads are fine as long as we got something
+        size_t available;
+        const uint8_t* data = mMemory.translate(address, &available);
+        if (!data) {
+            return out.size() != initialSize;
+        }
+
+        // encode straight out of the host mapping, a slot at a time
+        uint64_t count = std::min<uint64_t>(length, available);
+        if (binary) {
+            for (uint64_t i = 0; i < count; i++) {
+                uint8_t value = data[i];
+                if (value == '#' || value == '$' || value == '}' || value == '*') {
+                    out.push_back('}');
+                    value ^= 0x20;
+                }
+                out.push_back(value);
+            }
+        } else {
+            for (uint64_t i = 0; i < count; i++) {
+                appendHexByte(out, data[i]);
+            }
+        }
+        address += count;
+        length -= count;
+    }
+    return true;
+}
+
+bool GdbStub::writeMemory(uint64_t address, const std::string& hex)
+{
+    std::vector<uint8_t> data(hex.size() / 2);
+    const char* in = hex.c_str();
+    for (size_t i = 0; i < data.size(); i++, in += 2) {
+        if (!parseHexByte(in, data[i])) {
+            return false;
+        }
+    }
+    return mMemory.write(address, data.data(), data.size()) == data.size();
+}
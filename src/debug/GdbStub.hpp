@@ -0,0 +1,99 @@
+#ifndef GDBSTUB_HPP_
+#define GDBSTUB_HPP_
+
+#include "../EventLoop.hpp"
+#include "../GuestMemory.hpp"
+
+#include <condition_variable>
+#include <csignal>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <linux/kvm.h>
+
+// gdb remote serial protocol server on a unix socket. packets are handled on the event loop
+// thread. the vcpu thread parks itself in poll()/handleDebugExit() while the target is stopped,
+// which leaves the vcpu free for register access from the event loop thread. memory is accessed
+// through GuestMemory, as the guest sees it with its current memslots.
+
+class GdbStub
+{
+    struct Breakpoint {
+        uint64_t address;
+        uint8_t type;   // gdb Z packet type
+        uint8_t length;
+    };
+
+    EventLoop mEventLoop;
+    GuestMemory& mMemory;
+    std::string mSocketName;
+    std::mutex mMutex;
+    std::condition_variable mResume;
+
+    // vcpu state
+    int mVcpuFd;
+    struct kvm_run* mRun;
+    pthread_t mVcpuThread;
+    bool mStopRequested;
+    bool mStopped;
+    bool mStepping;
+    int mStopSignal;
+    std::vector<Breakpoint> mBreakpoints;
+
+    // connection state (event loop thread only)
+    struct {
+        int server;
+        int client;
+        int stopEvent;
+    } fds;
+    std::string mInput;
+    std::string mOutput;
+    bool mNoAckMode;
+    bool mStopReplyPending;
+
+    void handleClientEvent(uint32_t events);
+    void handleStopEvent(uint32_t events);
+    void closeClient();
+
+    void processInput();
+    void handlePacket(const std::string& packet);
+    void sendPacket(const std::string& payload);
+    void flushOutput();
+
+    std::string readRegisters();
+    bool writeRegisters(const std::string& data);
+    bool readRegister(unsigned index, uint32_t& value);
+    bool writeRegister(unsigned index, uint32_t value);
+    bool readMemory(uint64_t address, uint64_t length, std::string& out, bool binary);
+    bool writeMemory(uint64_t address, const std::string& hex);
+    bool applyGuestDebug();
+    void resume(bool step);
+    void requestStop();
+    void parkVcpu(std::unique_lock<std::mutex>& lock, int signal,
+            const volatile sig_atomic_t& abort);
+
+public:
+    GdbStub(const EventLoop& eventLoop, GuestMemory& memory);
+    GdbStub(const GdbStub&) = delete;
+    GdbStub(GdbStub&&) = delete;
+
+    ~GdbStub();
+
+    GdbStub& operator=(const GdbStub&) = delete;
+    GdbStub& operator=(GdbStub&&) = delete;
+
+    // must be called from the vcpu thread. waitForClient keeps the vcpu stopped at the reset
+    // vector until a debugger continues it
+    bool start(const std::string& socketName, int vcpuFd, struct kvm_run* run, bool waitForClient);
+    void stop();
+
+    // called by the vcpu thread before entering KVM_RUN, parks if a stop was requested
+    void poll(const volatile sig_atomic_t& abort);
+
+    // called by the vcpu thread on KVM_EXIT_DEBUG, returns false if the debugger isn't attached
+    bool handleDebugExit(const struct kvm_debug_exit_arch& debug, const volatile sig_atomic_t& abort);
+};
+
+#endif /* GDBSTUB_HPP_ */
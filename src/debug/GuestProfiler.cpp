@@ -0,0 +1,198 @@
+#include "GuestProfiler.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <map>
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+namespace
+{
+    volatile sig_atomic_t samplePending = 0;
+    struct kvm_run* volatile profiledRun = nullptr;
+
+    // only async-signal-safe operations in here
+    void profilerSignalHandler(int signo)
+    {
+        samplePending = 1;
+        if (profiledRun) {
+            profiledRun->immediate_exit = 1;
+        }
+    }
+
+    const char* modeName(GuestProfiler::Mode mode)
+    {
+        switch (mode) {
+            case GuestProfiler::Mode::Real:
+                return "real";
+            case GuestProfiler::Mode::Protected16:
+                return "pm16";
+            case GuestProfiler::Mode::Protected32:
+                return "pm32";
+        }
+        return "????";
+    }
+} /* anonymous */
+
+GuestProfiler::GuestProfiler(unsigned frequency)
+    : mFrequency(frequency), mRun(nullptr), mVcpuFd(-1), mTimer{}, mTimerCreated(false),
+    mSamples(0), mFailedSamples(0), mHistogram{}, mRegions{} {}
+
+GuestProfiler::~GuestProfiler()
+{
+    stop();
+}
+
+void GuestProfiler::addRegion(uint64_t start, uint64_t length, const std::string& name)
+{
+    mRegions.push_back(Region{start, length, name});
+}
+
+const GuestProfiler::Region* GuestProfiler::findRegion(uint64_t address) const
+{
+    for (const auto& region : mRegions) {
+        if (address >= region.start && address - region.start < region.length) {
+            return &region;
+        }
+    }
+    return nullptr;
+}
+
+bool GuestProfiler::start(int vcpuFd, struct kvm_run* run)
+{
+    stop();
+    if (!mFrequency) {
+        return false;
+    }
+
+    mVcpuFd = vcpuFd;
+    mRun = run;
+    profiledRun = run;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = profilerSignalHandler;
+    // other blocking calls on the vcpu thread shouldn't see EINTR for every sample
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, nullptr) == -1) {
+        perror("sigaction(SIGPROF)");
+        return false;
+    }
+
+    // deliver the timer signal to the vcpu thread (the caller) only
+    struct sigevent event;
+    memset(&event, 0, sizeof event);
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event._sigev_un._tid = gettid();
+    if (timer_create(CLOCK_MONOTONIC, &event, &mTimer) == -1) {
+        perror("timer_create");
+        return false;
+    }
+    mTimerCreated = true;
+
+    long period = 1000000000L / mFrequency;
+    struct itimerspec interval {
+        .it_interval = { .tv_sec = period / 1000000000L, .tv_nsec = period % 1000000000L },
+        .it_value = { .tv_sec = period / 1000000000L, .tv_nsec = period % 1000000000L }
+    };
+    if (timer_settime(mTimer, 0, &interval, nullptr) == -1) {
+        perror("timer_settime");
+        return false;
+    }
+    return true;
+}
+
+void GuestProfiler::stop()
+{
+    if (mTimerCreated) {
+        timer_delete(mTimer);
+        mTimerCreated = false;
+    }
+    if (mRun) {
+        profiledRun = nullptr;
+        mRun->immediate_exit = 0;
+        mRun = nullptr;
+    }
+}
+
+void GuestProfiler::poll()
+{
+    if (!samplePending || !mRun) {
+        return;
+    }
+    samplePending = 0;
+    mRun->immediate_exit = 0;
+
+    // preserve errno for the run loop
+    int savedErrno = errno;
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    if (ioctl(mVcpuFd, KVM_GET_REGS, &regs) == -1 || ioctl(mVcpuFd, KVM_GET_SREGS, &sregs) == -1) {
+        mFailedSamples++;
+        errno = savedErrno;
+        return;
+    }
+    errno = savedErrno;
+
+    Mode mode = Mode::Real;
+    if (sregs.cr0 & 1) {
+        mode = sregs.cs.db ? Mode::Protected32 : Mode::Protected16;
+    }
+
+    uint64_t address = (sregs.cs.base + regs.rip) & 0xFFFFFFFF;
+    mHistogram[(static_cast<uint64_t>(mode) << 32) | address]++;
+    mSamples++;
+}
+
+void GuestProfiler::report(FILE* stream, size_t count) const
+{
+    fprintf(stream, "--- guest profile: %" PRIu64 " samples at %u Hz", mSamples, mFrequency);
+    if (mFailedSamples) {
+        fprintf(stream, " (%" PRIu64 " failed)", mFailedSamples);
+    }
+    fprintf(stream, " ---\n");
+    if (!mSamples) {
+        return;
+    }
+
+    // per region totals
+    std::map<std::string, uint64_t> regionTotals;
+    for (const auto& entry : mHistogram) {
+        const Region* region = findRegion(entry.first & 0xFFFFFFFF);
+        regionTotals[region ? region->name : "unknown"] += entry.second;
+    }
+    for (const auto& total : regionTotals) {
+        fprintf(stream, "%7.2f%%  %-12s\n", 100.0 * total.second / mSamples, total.first.c_str());
+    }
+    fprintf(stream, "--- ------------- ---\n");
+
+    // hottest addresses
+    std::vector<std::pair<uint64_t, uint64_t>> entries(mHistogram.begin(), mHistogram.end());
+    std::sort(entries.begin(), entries.end(), [] (const auto& a, const auto& b) {
+        return a.second > b.second || (a.second == b.second && a.first < b.first);
+    });
+    if (entries.size() > count) {
+        entries.resize(count);
+    }
+
+    for (const auto& entry : entries) {
+        uint64_t address = entry.first & 0xFFFFFFFF;
+        Mode mode = static_cast<Mode>(entry.first >> 32);
+        const Region* region = findRegion(address);
+        char symbol[64];
+        if (region) {
+            snprintf(symbol, sizeof symbol, "%s+0x%" PRIx64, region->name.c_str(),
+                    address - region->start);
+        } else {
+            snprintf(symbol, sizeof symbol, "0x%08" PRIx64, address);
+        }
+        fprintf(stream, "%7.2f%%  %8" PRIu64 "  [%08" PRIx64 "] %s  %s\n",
+                100.0 * entry.second / mSamples, entry.second, address, modeName(mode), symbol);
+    }
+    fprintf(stream, "--- ------------- ---\n");
+}
@@ -0,0 +1,70 @@
+#ifndef GUESTPROFILER_HPP_
+#define GUESTPROFILER_HPP_
+
+#include <cinttypes>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <time.h>
+#include <linux/kvm.h>
+
+// statistical profiler for guest code. a posix timer signals the vcpu thread at a fixed rate,
+// which kicks it out of KVM_RUN (immediate_exit covers the window where the signal arrives while
+// we are in userspace). the linear instruction pointer at each kick is recorded in a histogram.
+
+class GuestProfiler
+{
+public:
+    enum class Mode : uint8_t {
+        Real = 0,
+        Protected16 = 1,
+        Protected32 = 2
+    };
+
+    struct Region {
+        uint64_t start;
+        uint64_t length;
+        std::string name;
+    };
+
+private:
+    unsigned mFrequency;
+    struct kvm_run* mRun;
+    int mVcpuFd;
+    timer_t mTimer;
+    bool mTimerCreated;
+    uint64_t mSamples;
+    uint64_t mFailedSamples;
+
+    // key is (mode << 32) | (cs.base + rip)
+    std::unordered_map<uint64_t, uint64_t> mHistogram;
+    std::vector<Region> mRegions;
+
+    const Region* findRegion(uint64_t address) const;
+
+public:
+    GuestProfiler(unsigned frequency);
+    GuestProfiler(const GuestProfiler&) = delete;
+    GuestProfiler(GuestProfiler&&) = delete;
+
+    ~GuestProfiler();
+
+    GuestProfiler& operator=(const GuestProfiler&) = delete;
+    GuestProfiler& operator=(GuestProfiler&&) = delete;
+
+    // named address ranges used to symbolize the report
+    void addRegion(uint64_t start, uint64_t length, const std::string& name);
+
+    // must be called from the vcpu thread
+    bool start(int vcpuFd, struct kvm_run* run);
+    void stop();
+
+    // called by the vcpu thread after KVM_RUN returns, records a sample if the timer fired
+    void poll();
+
+    void report(FILE* stream, size_t count) const;
+};
+
+#endif /* GUESTPROFILER_HPP_ */
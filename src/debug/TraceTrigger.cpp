@@ -0,0 +1,173 @@
+#include "TraceTrigger.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/ioctl.h>
+
+namespace
+{
+    // DR6 status bits
+    constexpr uint64_t DR6_BREAKPOINT_MASK = 0x0F;
+    constexpr uint64_t DR6_SINGLE_STEP = 1 << 14;
+
+    constexpr unsigned DefaultTraceCount = 64;
+
+    // DR7 LEN field encoding
+    uint64_t encodeLength(uint8_t length)
+    {
+        switch (length) {
+            case 2:
+                return 1;
+            case 4:
+                return 3;
+            case 8:
+                return 2;
+            default:
+                return 0;
+        }
+    }
+
+    const char* typeName(TraceTrigger::Type type)
+    {
+        switch (type) {
+            case TraceTrigger::Type::Execute:
+                return "execute";
+            case TraceTrigger::Type::Write:
+                return "write";
+            case TraceTrigger::Type::Access:
+                return "access";
+        }
+        return "unknown";
+    }
+} /* anonymous */
+
+TraceTrigger::TraceTrigger()
+    : mTriggers{}, mVcpuFd(-1), mAlwaysStep(false), mStepping(false), mRemaining(0),
+    mDisarmed(0) {}
+
+bool TraceTrigger::parse(const char* spec, Type type, Trigger& trigger)
+{
+    char* end = nullptr;
+    trigger.address = strtoull(spec, &end, 0);
+    if (end == spec || (*end != '\0' && *end != ':')) {
+        return false;
+    }
+
+    trigger.count = DefaultTraceCount;
+    if (*end == ':') {
+        const char* countSpec = end + 1;
+        trigger.count = strtoul(countSpec, &end, 0);
+        if (end == countSpec || *end != '\0' || !trigger.count) {
+            return false;
+        }
+    }
+
+    // execution breakpoints must use a length of 1
+    trigger.type = type;
+    trigger.length = 1;
+    return true;
+}
+
+bool TraceTrigger::addTrigger(const Trigger& trigger)
+{
+    if (mTriggers.size() == MaximumTriggers) {
+        fprintf(stderr, "only %zu trace triggers are supported.\n", MaximumTriggers);
+        return false;
+    }
+    mTriggers.push_back(trigger);
+    return true;
+}
+
+bool TraceTrigger::start(int vcpuFd, bool alwaysStep)
+{
+    mVcpuFd = vcpuFd;
+    mAlwaysStep = alwaysStep;
+    mStepping = false;
+    mRemaining = 0;
+    mDisarmed = 0;
+
+    // leave guest debugging disabled if we aren't using it
+    if (!mAlwaysStep && mTriggers.empty()) {
+        return true;
+    }
+    return apply();
+}
+
+bool TraceTrigger::apply()
+{
+    struct kvm_guest_debug debug;
+    memset(&debug, 0, sizeof debug);
+    debug.control = KVM_GUESTDBG_ENABLE;
+    if (!mTriggers.empty()) {
+        debug.control |= KVM_GUESTDBG_USE_HW_BP;
+    }
+    if (mAlwaysStep || mStepping) {
+        debug.control |= KVM_GUESTDBG_SINGLESTEP;
+    }
+
+    // triggers that fired are disarmed while we step, otherwise an execution breakpoint would
+    // fire again when the vcpu resumes on the same instruction
+    uint64_t dr7 = 0;
+    for (size_t i = 0; i < mTriggers.size(); i++) {
+        if (mDisarmed & (1 << i)) {
+            continue;
+        }
+
+        const Trigger& trigger = mTriggers[i];
+        debug.arch.debugreg[i] = trigger.address & ~(uint64_t) (trigger.length - 1);
+        dr7 |= 1ULL << (i * 2);
+        dr7 |= static_cast<uint64_t>(trigger.type) << (16 + i * 4);
+        dr7 |= encodeLength(trigger.length) << (18 + i * 4);
+    }
+    debug.arch.debugreg[7] = dr7;
+
+    if (ioctl(mVcpuFd, KVM_SET_GUEST_DEBUG, &debug) == -1) {
+        perror("KVM_SET_GUEST_DEBUG");
+        return false;
+    }
+    return true;
+}
+
+bool TraceTrigger::handleDebugExit(const struct kvm_debug_exit_arch& debug)
+{
+    uint8_t hits = (debug.dr6 & DR6_BREAKPOINT_MASK) & ~mDisarmed;
+    hits &= (1 << mTriggers.size()) - 1;
+
+    if (hits) {
+        for (size_t i = 0; i < mTriggers.size(); i++) {
+            if (hits & (1 << i)) {
+                const Trigger& trigger = mTriggers[i];
+                fprintf(stderr, "--- trace trigger %zu (%s at %08" PRIx64 ") fired at %08llx ---\n",
+                        i, typeName(trigger.type), trigger.address, debug.pc);
+                if (trigger.count > mRemaining) {
+                    mRemaining = trigger.count;
+                }
+            }
+        }
+        mDisarmed |= hits;
+        mStepping = true;
+    } else if (!mStepping || !(debug.dr6 & DR6_SINGLE_STEP)) {
+        // not one of ours (or single stepping for DISASSEMBLE)
+        return false;
+    }
+
+    // only single steps count against the window. a breakpoint exit stops before the
+    // instruction runs, so the window has to step past it before the triggers are re-armed
+    if (!(debug.dr6 & DR6_SINGLE_STEP)) {
+        apply();
+        return true;
+    }
+
+    // trace window is over, return to full speed and re-arm the triggers
+    if (--mRemaining == 0) {
+        fprintf(stderr, "--- trace window ended ---\n");
+        mStepping = false;
+        mDisarmed = 0;
+        apply();
+    } else if (hits) {
+        apply();
+    }
+    return true;
+}
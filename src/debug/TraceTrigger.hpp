@@ -0,0 +1,68 @@
+#ifndef TRACETRIGGER_HPP_
+#define TRACETRIGGER_HPP_
+
+#include <cinttypes>
+#include <cstddef>
+#include <vector>
+
+#include <linux/kvm.h>
+
+// runtime trace triggers built on the x86 debug registers. the guest runs at full speed until
+// one of (at most 4) hardware breakpoints or watchpoints is hit, then it is single stepped for a
+// fixed number of instructions before the trigger is re-armed.
+
+class TraceTrigger
+{
+public:
+    static constexpr size_t MaximumTriggers = 4;
+
+    // matches the R/W field encoding of DR7
+    enum class Type : uint8_t {
+        Execute = 0,
+        Write = 1,
+        Access = 3
+    };
+
+    struct Trigger {
+        uint64_t address;
+        Type type;
+        uint8_t length;
+        unsigned count;
+    };
+
+private:
+    std::vector<Trigger> mTriggers;
+    int mVcpuFd;
+    bool mAlwaysStep;
+    bool mStepping;
+    unsigned mRemaining;
+    uint8_t mDisarmed;
+
+    bool apply();
+
+public:
+    TraceTrigger();
+    TraceTrigger(const TraceTrigger&) = delete;
+    TraceTrigger(TraceTrigger&&) = delete;
+
+    ~TraceTrigger() = default;
+
+    TraceTrigger& operator=(const TraceTrigger&) = delete;
+    TraceTrigger& operator=(TraceTrigger&&) = delete;
+
+    // parse "ADDRESS[:COUNT]", returns false on a malformed string
+    static bool parse(const char* spec, Type type, Trigger& trigger);
+
+    bool addTrigger(const Trigger& trigger);
+    bool empty() const { return mTriggers.empty(); }
+
+    // program the debug registers. alwaysStep single steps the entire run (DISASSEMBLE)
+    bool start(int vcpuFd, bool alwaysStep);
+
+    // handle a KVM_EXIT_DEBUG, returns true if the current instruction should be traced
+    bool handleDebugExit(const struct kvm_debug_exit_arch& debug);
+
+    bool stepping() const { return mStepping; }
+};
+
+#endif /* TRACETRIGGER_HPP_ */
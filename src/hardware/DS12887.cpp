@@ -1,99 +1,487 @@
 #include "DS12887.hpp"
+#include "../DeviceActivity.hpp"
 
-#include <fstream>
-#include <ctime>
+#include <cstdio>
+#include <cstring>
 
-DS12887::DS12887() : registers{}, selectedRegister{}, ram{}
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/kvm.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+namespace
 {
-    registers.D.validRamAndTime = true;
+    constexpr uint64_t NanosecondsPerSecond = 1000000000ULL;
+
+    // UIP is set this long before the registers are updated
+    constexpr uint64_t UpdateInProgressTime = 244000;
+
+    // alarm registers with the two upper bits set match any value
+    constexpr uint8_t AlarmDontCare = 0xFF;
+
+    inline bool isAlarmDontCare(uint8_t value)
+    {
+        return (value & 0xC0) == 0xC0;
+    }
 
-    std::ifstream nvram("roms/cmos.bin", std::ios_base::binary);
-    if (nvram.is_open()) {
-        nvram.read((char *) ram.data(), ram.size());
+    inline int fromBCD(uint8_t value)
+    {
+        return ((value >> 4) * 10) + (value & 0x0f);
     }
+} /* anonymous */
+
+DS12887::DS12887(const EventLoop& eventLoop, const VirtualClock& clock) : registers{},
+        mEventLoop(eventLoop), mClock(clock), mMutex{}, mGSI{}, fds{}, periodicPeriod(0),
+        periodicDivider{}, periodicStart(0), periodicIndex(0), timeSeconds(0), timeBase(0), secondDivider(NanosecondsPerSecond),
+        updateSecond(0), weekdayAdjust(0), cachedSecond(-1), cachedTime{}, selectedRegister{}, ram(nullptr),
+        ramDirty(false), volatileRam{}
+{
+    registers.D.validRamAndTime = true;
+    ram = volatileRam.data();
+
+    // the rtc has no notion of time zones, count local time as if it were utc
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct tm local;
+    localtime_r(&now.tv_sec, &local);
+    timeSeconds = now.tv_sec + local.tm_gmtoff;
+    timeBase = mClock.now() - now.tv_nsec;
+}
+
+void DS12887::resetTime(int64_t seconds)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    timeSeconds = seconds;
+    timeBase = mClock.now();
+    weekdayAdjust = 0;
+    cachedSecond = -1;
+    armUpdate();
 }
 
 DS12887::~DS12887()
 {
-    std::ofstream nvram("roms/cmos.bin", std::ios_base::binary);
-    nvram.write((const char *) ram.data(), ram.size());
+    stop();
+}
+
+// the mapping lives in the page cache, so guest writes survive the emulator crashing even
+// before they are written back
+bool DS12887::mapRam(const std::string& nvramPath)
+{
+    fds.nvram = open(nvramPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fds.nvram == -1) {
+        perror("rtc: unable to open nvram file");
+        return false;
+    }
+
+    struct stat nvramStat;
+    if (fstat(fds.nvram, &nvramStat) == -1
+            || ((size_t) nvramStat.st_size < RamSize && ftruncate(fds.nvram, RamSize) == -1)) {
+        perror("rtc: unable to size nvram file");
+        return false;
+    }
+
+    void* mapping = mmap(nullptr, RamSize, PROT_READ | PROT_WRITE, MAP_SHARED, fds.nvram, 0);
+    if (mapping == MAP_FAILED) {
+        perror("rtc: unable to map nvram file");
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    ram = static_cast<uint8_t*>(mapping);
+    ramDirty = false;
+    return true;
+}
+
+void DS12887::unmapRam()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (ram != volatileRam.data()) {
+        msync(ram, RamSize, MS_SYNC);
+        memcpy(volatileRam.data(), ram, RamSize);
+        munmap(ram, RamSize);
+        ram = volatileRam.data();
+    }
+    ramDirty = false;
+
+    if (fds.nvram != -1) {
+        close(fds.nvram);
+        fds.nvram = -1;
+    }
+}
+
+bool DS12887::start(const std::string& nvramPath, int vmFd, uint32_t gsi)
+{
+    stop();
+
+    if (!mapRam(nvramPath)) {
+        return false;
+    }
+
+    fds.vm = vmFd;
+    fds.irq = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fds.irq == -1) {
+        perror("rtc: unable to create irq event");
+        return false;
+    }
+
+    mGSI = gsi;
+    struct kvm_irqfd irqfd {
+        .fd = (__u32) fds.irq,
+        .gsi = mGSI
+    };
+    if (ioctl(fds.vm, KVM_IRQFD, &irqfd) == -1) {
+        perror("rtc: failed to add irq event");
+        return false;
+    }
+
+    fds.periodic = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    fds.update = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (fds.periodic == -1 || fds.update == -1) {
+        perror("rtc: unable to create timer descriptors");
+        return false;
+    }
+
+    mEventLoop.addEvent(fds.periodic, EPOLLIN, [this] (uint32_t events) {
+        handlePeriodicEvent(events);
+    });
+    mEventLoop.addEvent(fds.update, EPOLLIN, [this] (uint32_t events) {
+        handleUpdateEvent(events);
+    });
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    configurePeriodic();
+    armUpdate();
+    return true;
+}
+
+void DS12887::stop()
+{
+    if (fds.periodic != -1) {
+        mEventLoop.removeEvent(fds.periodic);
+        close(fds.periodic);
+        fds.periodic = -1;
+    }
+
+    if (fds.update != -1) {
+        mEventLoop.removeEvent(fds.update);
+        close(fds.update);
+        fds.update = -1;
+    }
+
+    if (fds.vm != -1 && fds.irq != -1) {
+        struct kvm_irqfd irqfd {
+            .fd = (__u32) fds.irq,
+            .gsi = mGSI,
+            .flags = KVM_IRQFD_FLAG_DEASSIGN
+        };
+        ioctl(fds.vm, KVM_IRQFD, &irqfd);
+        close(fds.irq);
+        fds.irq = -1;
+    }
+
+    unmapRam();
+}
+
+int64_t DS12887::currentSecond(uint64_t time)
+{
+    return timeSeconds + (int64_t) secondDivider.divide(time - timeBase);
+}
+
+// the registers as the guest sees them, only broken down once per second
+const struct tm& DS12887::currentTime()
+{
+    if (registers.B.updateInhibit) {
+        return cachedTime;
+    }
+
+    int64_t second = currentSecond(mClock.now());
+    if (second != cachedSecond) {
+        time_t t = second;
+        gmtime_r(&t, &cachedTime);
+        cachedSecond = second;
+    }
+    return cachedTime;
+}
+
+// while SET is held the guest edits a frozen copy, otherwise the clock is moved keeping its phase
+void DS12887::setTime(struct tm& tm)
+{
+    int64_t second = timegm(&tm);
+    if (registers.B.updateInhibit) {
+        cachedTime = tm;
+        return;
+    }
+
+    timeSeconds += second - currentSecond(mClock.now());
+    cachedSecond = -1;
+    armUpdate();
+}
+
+void DS12887::writeTimeRegister(Register selected, uint8_t value)
+{
+    bool binary = registers.B.DataMode;
+    struct tm tm = currentTime();
+    int weekday = tm.tm_wday;
+
+    switch (selected) {
+        case Register::Seconds:
+            tm.tm_sec = binary ? (value & 0x3f) : fromBCD(value & 0x7f);
+            break;
+        case Register::Minutes:
+            tm.tm_min = binary ? (value & 0x3f) : fromBCD(value & 0x7f);
+            break;
+        case Register::Hours:
+            tm.tm_hour = binary ? (value & 0x1f) : fromBCD(value & 0x3f);
+            if (!registers.B.twentyFourHourTime) {
+                tm.tm_hour = (tm.tm_hour % 12) + ((value & 0x80) ? 12 : 0);
+            }
+            break;
+        case Register::Weekday:
+            weekdayAdjust = ((value & 0x07) - 1 - weekday + 7) % 7;
+            return;
+        case Register::Day:
+            tm.tm_mday = binary ? (value & 0x1f) : fromBCD(value & 0x3f);
+            break;
+        case Register::Month:
+            tm.tm_mon = (binary ? (value & 0x0f) : fromBCD(value & 0x1f)) - 1;
+            break;
+        case Register::Year:
+            tm.tm_year = ((tm.tm_year + 1900) / 100) * 100 - 1900
+                    + (binary ? (value % 100) : fromBCD(value));
+            break;
+        case Register::Century:
+            tm.tm_year = fromBCD(value) * 100 + ((tm.tm_year + 1900) % 100) - 1900;
+            break;
+        default:
+            return;
+    }
+
+    // keep the weekday register where the guest put it
+    setTime(tm);
+    weekdayAdjust = (weekdayAdjust + weekday - tm.tm_wday + 7) % 7;
+}
+
+// the update timer fires just after every second boundary of the rtc, it is rearmed each time
+// so it follows the virtual clock and writes to the time
+void DS12887::armUpdate()
+{
+    uint64_t time = mClock.now();
+    updateSecond = currentSecond(time);
+    if (fds.update == -1) {
+        return;
+    }
+
+    uint64_t delay = NanosecondsPerSecond - secondDivider.modulo(time - timeBase) + 1000;
+    struct itimerspec timeout {};
+    timeout.it_value.tv_sec = delay / NanosecondsPerSecond;
+    timeout.it_value.tv_nsec = delay % NanosecondsPerSecond;
+    timerfd_settime(fds.update, 0, &timeout, nullptr);
+}
+
+// derive the periodic rate from register A, the timerfd only runs while the interrupt is enabled
+void DS12887::configurePeriodic()
+{
+    // rate select 1 and 2 are the 256 and 128 Hz taps, 3 to 15 are 8192 Hz down to 2 Hz. the
+    // oscillator has to be running (divider 010)
+    uint8_t rate = registers.A.RateSelect;
+    if (rate == 0 || registers.A.Divider != 2) {
+        periodicPeriod = 0;
+    } else {
+        periodicPeriod = (1000000000ULL << ((rate < 3) ? rate + 7 : rate)) / 65536;
+    }
+    periodicDivider = Reciprocal(periodicPeriod ? periodicPeriod : 1);
+    periodicStart = mClock.now();
+    periodicIndex = 0;
+
+    if (fds.periodic == -1) {
+        return;
+    }
+
+    struct itimerspec timeout {};
+    if (periodicPeriod && registers.B.periodicInterruptEnable) {
+        timeout.it_value.tv_sec = periodicPeriod / 1000000000ULL;
+        timeout.it_value.tv_nsec = periodicPeriod % 1000000000ULL;
+        timeout.it_interval = timeout.it_value;
+    }
+    timerfd_settime(fds.periodic, 0, &timeout, nullptr);
+}
+
+// without the timer running, PF is set if a period elapsed since it was last observed
+void DS12887::pollPeriodicFlag()
+{
+    if (!periodicPeriod || registers.B.periodicInterruptEnable) {
+        return;
+    }
+
+    uint64_t index = periodicDivider.divide(mClock.now() - periodicStart);
+    if (index != periodicIndex) {
+        registers.C.periodicInterruptFlag = true;
+        periodicIndex = index;
+    }
+}
+
+bool DS12887::alarmMatches(const struct tm& tm) const
+{
+    return (registers.secondsAlarm == AlarmDontCare || registers.secondsAlarm == tm.tm_sec)
+            && (registers.minutesAlarm == AlarmDontCare || registers.minutesAlarm == tm.tm_min)
+            && (registers.hoursAlarm == AlarmDontCare || registers.hoursAlarm == tm.tm_hour);
+}
+
+// IRQF follows the flags and enables, an interrupt is only sent when it rises
+void DS12887::updateInterruptFlag()
+{
+    bool interrupt = (registers.C.periodicInterruptFlag && registers.B.periodicInterruptEnable)
+            || (registers.C.alarmInterruptFlag && registers.B.alarmInterruptEnable)
+            || (registers.C.updateEndedInterruptFlag && registers.B.updateEndedInterruptEnable);
+
+    if (interrupt && !registers.C.interruptFlag && fds.irq != -1) {
+        uint64_t data = 1;
+        write(fds.irq, &data, sizeof data);
+    }
+    registers.C.interruptFlag = interrupt;
+    DeviceActivity::notify();
+}
+
+void DS12887::handlePeriodicEvent(uint32_t events)
+{
+    // missed periods are coalesced into a single flag
+    uint64_t expirations = 0;
+    if (read(fds.periodic, &expirations, sizeof expirations) != sizeof expirations
+            || !expirations) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    registers.C.periodicInterruptFlag = true;
+    updateInterruptFlag();
+}
+
+void DS12887::handleUpdateEvent(uint32_t events)
+{
+    uint64_t expirations = 0;
+    if (read(fds.update, &expirations, sizeof expirations) != sizeof expirations
+            || !expirations) {
+        return;
+    }
+
+    // the timerfd runs on CLOCK_MONOTONIC and the rtc on the virtual clock, a timer that fires
+    // before the second rolled over is only rearmed. no update cycles while SET is held
+    std::unique_lock<std::mutex> lock(mMutex);
+    bool rolledOver = (currentSecond(mClock.now()) != updateSecond);
+    armUpdate();
+    if (rolledOver && !registers.B.updateInhibit) {
+        registers.C.updateEndedInterruptFlag = true;
+        if (alarmMatches(currentTime())) {
+            registers.C.alarmInterruptFlag = true;
+        }
+        updateInterruptFlag();
+    }
+
+    // write back the ram changed during the last second
+    if (ramDirty) {
+        ramDirty = false;
+        lock.unlock();
+        msync(ram, RamSize, MS_SYNC);
+    }
 }
 
 // DevicePio implementation
 void DS12887::iowrite8(uint16_t address, uint8_t value)
 {
     bool isRegisterSelect = !(address & 1);
+    std::unique_lock<std::mutex> lock(mMutex);
     if (isRegisterSelect) {
         selectedRegister = static_cast<Register>(value & 0x7F);
         return;
     }
 
     switch (selectedRegister) {
-        case Register::Seconds:
-            fprintf(stderr, "seconds write: %02x\n", value);
-            break;
         case Register::SecondsAlarm:
-            if (!registers.B.DataMode) {
+            if (isAlarmDontCare(value)) {
+                registers.secondsAlarm = AlarmDontCare;
+            } else if (!registers.B.DataMode) {
                 registers.secondsAlarm = (value & 0x0f)
                         + 10 * ((value >> 4) & 0x07);
             } else {
                 registers.secondsAlarm = value & 0x3f;
             }
             break;
-        case Register::Minutes:
-            fprintf(stderr, "minutes write: %02x\n", value);
-            break;
         case Register::MinutesAlarm:
-            if (!registers.B.DataMode) {
+            if (isAlarmDontCare(value)) {
+                registers.minutesAlarm = AlarmDontCare;
+            } else if (!registers.B.DataMode) {
                 registers.minutesAlarm = (value & 0x0f)
                         + 10 * ((value >> 4) & 0x07);
             } else {
                 registers.minutesAlarm = value & 0x3f;
             }
             break;
-        case Register::Hours:
-            fprintf(stderr, "hours write: %02x\n", value);
-            break;
         case Register::HoursAlarm:
+            if (isAlarmDontCare(value)) {
+                registers.hoursAlarm = AlarmDontCare;
+                break;
+            }
             if (!registers.B.DataMode) {
                 registers.hoursAlarm = (value & 0x0f)
                         + 10 * ((value >> 4) & 0x03);
             } else {
                 registers.hoursAlarm = value & 0x1f;
             }
+            // kept as 0 to 23 like tm_hour, 12 AM is 0 and 12 PM is 12
             if (!registers.B.twentyFourHourTime) {
-                registers.hoursAlarm += (value & 0x80) ? 12 : 0;
+                registers.hoursAlarm = (registers.hoursAlarm % 12) + ((value & 0x80) ? 12 : 0);
             }
             break;
-        case Register::Weekday:
-            fprintf(stderr, "weekday write: %02x\n", value);
-            break;
-        case Register::Day:
-            fprintf(stderr, "day write: %02x\n", value);
-            break;
-        case Register::Month:
-            fprintf(stderr, "month write: %02x\n", value);
-            break;
-        case Register::Year:
-            fprintf(stderr, "year write: %02x\n", value);
-            break;
         case Register::A:
             *reinterpret_cast<uint8_t*>(&registers.A) = value & 0x7f;
+            configurePeriodic();
             break;
         case Register::B:
+        {
+            bool periodicEnabled = registers.B.periodicInterruptEnable;
+            bool setting = registers.B.updateInhibit;
+            if (!setting && (value & 0x80)) {
+                // SET freezes the time registers for the guest to write
+                currentTime();
+            }
             *reinterpret_cast<uint8_t*>(&registers.B) = value;
+            if (setting && !registers.B.updateInhibit) {
+                // releasing SET starts the written time on a new second
+                timeSeconds = timegm(&cachedTime);
+                timeBase = mClock.now();
+                cachedSecond = -1;
+                armUpdate();
+            }
+            if (periodicEnabled != registers.B.periodicInterruptEnable) {
+                configurePeriodic();
+            }
+            // enabling an interrupt with its flag already set raises IRQF
+            updateInterruptFlag();
             break;
+        }
         case Register::C:
             // this register is not writable
             break;
         case Register::D:
             // this register is not writable
             break;
+        case Register::Seconds:
+        case Register::Minutes:
+        case Register::Hours:
+        case Register::Weekday:
+        case Register::Day:
+        case Register::Month:
+        case Register::Year:
         case Register::Century:
-            fprintf(stderr, "century write: %02x\n", value);
+            writeTimeRegister(selectedRegister, value);
             break;
         default:
             ram[static_cast<uint8_t>(selectedRegister) - 14] = value;
+            ramDirty = true;
     };
 }
 
@@ -102,6 +490,46 @@ uint8_t mapToBCD(uint8_t value)
     return ((value / 10) << 4) + ((value % 10) & 0x0f);
 }
 
+// the time changes at the end of every second and UIP just before. the timers signal the flags
+// in C, except PF while the periodic interrupt is off, which is computed when C is read
+uint64_t DS12887::pollTimeout(uint16_t address)
+{
+    if (!(address & 1)) {
+        return 0;
+    }
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    uint64_t time = mClock.now();
+    uint64_t position = secondDivider.modulo(time - timeBase);
+    switch (selectedRegister) {
+        case Register::Seconds:
+        case Register::Minutes:
+        case Register::Hours:
+        case Register::Weekday:
+        case Register::Day:
+        case Register::Month:
+        case Register::Year:
+        case Register::Century:
+            return NanosecondsPerSecond - position;
+        case Register::A:
+            if (registers.B.updateInhibit) {
+                return UINT64_MAX;
+            }
+            if (position < NanosecondsPerSecond - UpdateInProgressTime) {
+                return NanosecondsPerSecond - UpdateInProgressTime - position;
+            }
+            return NanosecondsPerSecond - position;
+        case Register::C:
+            if (periodicPeriod && !registers.B.periodicInterruptEnable) {
+                return periodicPeriod - periodicDivider.modulo(time - periodicStart);
+            }
+            return UINT64_MAX;
+        default:
+            // only written by the guest
+            return UINT64_MAX;
+    }
+}
+
 uint8_t DS12887::ioread8(uint16_t address)
 {
     bool isRegisterSelect = !(address & 1);
@@ -110,8 +538,8 @@ uint8_t DS12887::ioread8(uint16_t address)
         return 0;
     }
 
-    time_t t = time(NULL);
-    struct tm tm = *localtime(&t);
+    std::unique_lock<std::mutex> lock(mMutex);
+    const struct tm& tm = currentTime();
 
     switch (selectedRegister) {
         case Register::Seconds:
@@ -121,6 +549,9 @@ uint8_t DS12887::ioread8(uint16_t address)
                 return tm.tm_sec;
             }
         case Register::SecondsAlarm:
+            if (registers.secondsAlarm == AlarmDontCare) {
+                return AlarmDontCare;
+            }
             if (!registers.B.DataMode) {
                 return mapToBCD(registers.secondsAlarm);
             } else {
@@ -133,6 +564,9 @@ uint8_t DS12887::ioread8(uint16_t address)
                 return tm.tm_min;
             }
         case Register::MinutesAlarm:
+            if (registers.minutesAlarm == AlarmDontCare) {
+                return AlarmDontCare;
+            }
             if (!registers.B.DataMode) {
                 return mapToBCD(registers.minutesAlarm);
             } else {
@@ -143,35 +577,38 @@ uint8_t DS12887::ioread8(uint16_t address)
                 if (registers.B.twentyFourHourTime) {
                     return mapToBCD(tm.tm_hour);
                 } else {
-                    return mapToBCD(tm.tm_hour % 12)
+                    return mapToBCD((tm.tm_hour % 12) ? (tm.tm_hour % 12) : 12)
                             + ((tm.tm_hour / 12) ? 0x80 : 0x00);
                 }
             } else {
                 if (registers.B.twentyFourHourTime) {
                     return tm.tm_hour;
                 } else {
-                    return (tm.tm_hour % 12)
+                    return ((tm.tm_hour % 12) ? (tm.tm_hour % 12) : 12)
                             + ((tm.tm_hour / 12) ? 0x80 : 0x00);
                 }
             }
         case Register::HoursAlarm:
+            if (registers.hoursAlarm == AlarmDontCare) {
+                return AlarmDontCare;
+            }
             if (!registers.B.DataMode) {
                 if (registers.B.twentyFourHourTime) {
                     return mapToBCD(registers.hoursAlarm);
                 } else {
-                    return mapToBCD(registers.hoursAlarm % 12)
+                    return mapToBCD((registers.hoursAlarm % 12) ? (registers.hoursAlarm % 12) : 12)
                             + ((registers.hoursAlarm / 12) ? 0x80 : 0x00);
                 }
             } else {
                 if (registers.B.twentyFourHourTime) {
                     return registers.hoursAlarm;
                 } else {
-                    return (registers.hoursAlarm % 12)
+                    return ((registers.hoursAlarm % 12) ? (registers.hoursAlarm % 12) : 12)
                             + ((registers.hoursAlarm / 12) ? 0x80 : 0x00);
                 }
             }
         case Register::Weekday:
-            return tm.tm_wday + 1;
+            return ((tm.tm_wday + weekdayAdjust) % 7) + 1;
         case Register::Day:
             if (!registers.B.DataMode) {
                 return mapToBCD(tm.tm_mday);
@@ -193,11 +630,22 @@ uint8_t DS12887::ioread8(uint16_t address)
         case Register::Century:
             return mapToBCD((tm.tm_year + 1900) / 100);
         case Register::A:
-            return *reinterpret_cast<uint8_t*>(&registers.A);
+        {
+            // UIP is set just before the end of every second unless SET is held
+            bool updating = !registers.B.updateInhibit && secondDivider.modulo(mClock.now()
+                    - timeBase) >= NanosecondsPerSecond - UpdateInProgressTime;
+            return *reinterpret_cast<uint8_t*>(&registers.A) | (updating ? 0x80 : 0x00);
+        }
         case Register::B:
             return *reinterpret_cast<uint8_t*>(&registers.B);
         case Register::C:
-            return *reinterpret_cast<uint8_t*>(&registers.C);
+        {
+            // reading clears all flags (and releases IRQF)
+            pollPeriodicFlag();
+            uint8_t value = *reinterpret_cast<uint8_t*>(&registers.C);
+            *reinterpret_cast<uint8_t*>(&registers.C) = 0;
+            return value;
+        }
         case Register::D:
             return *reinterpret_cast<uint8_t*>(&registers.D);
     };
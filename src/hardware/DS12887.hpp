@@ -2,8 +2,21 @@
 #define DS12887_HPP_
 
 #include "DevicePio.hpp"
+#include "../EventLoop.hpp"
+#include "../VirtualClock.hpp"
 
 #include <array>
+#include <ctime>
+#include <mutex>
+#include <string>
+
+// DS12887 real time clock. time is kept as seconds since 1970 (in local time) at a point on the
+// virtual clock, so guest writes just rebase it. it starts at the host's local time, or at a
+// fixed time for repeatable runs. the periodic interrupt is driven by a
+// timerfd while it is enabled (the flag is computed on demand otherwise), update-ended and alarm
+// by a timerfd aligned to the rtc second. IRQF is delivered through an irqfd on its
+// rising edge, so interrupts the guest hasn't acknowledged by reading C are coalesced. the
+// battery backed ram is a shared mapping of a file, written back once a second while dirty.
 
 class DS12887 : public DevicePio
 {
@@ -57,11 +70,63 @@ class DS12887 : public DevicePio
         } D;
     } registers;
 
+    EventLoop mEventLoop;
+    const VirtualClock& mClock;
+    std::mutex mMutex;
+    uint32_t mGSI;
+
+    struct __descriptors {
+        int vm;
+        int irq;
+        int periodic;
+        int update;
+        int nvram;
+        __descriptors() : vm(-1), irq(-1), periodic(-1), update(-1), nvram(-1) {}
+    } fds;
+
+    // periodic interrupt state, period is 0 if disabled
+    uint64_t periodicPeriod;
+    Reciprocal periodicDivider;
+    uint64_t periodicStart;
+    uint64_t periodicIndex;
+
+    // the rtc was at the start of second "timeSeconds" at "timeBase" on the virtual clock
+    int64_t timeSeconds;
+    uint64_t timeBase;
+    Reciprocal secondDivider;
+    // the rtc second the update timer was armed in, its update cycle ends when the second does
+    int64_t updateSecond;
+    // the weekday register counts independently of the date
+    int weekdayAdjust;
+    // broken down time of cachedSecond, or the time being set while SET is held
+    int64_t cachedSecond;
+    struct tm cachedTime;
+
     Register selectedRegister;
-    std::array<uint8_t, 114> ram;
+
+    // points at volatileRam until the nvram file is mapped
+    static constexpr size_t RamSize = 114;
+    uint8_t* ram;
+    bool ramDirty;
+    std::array<uint8_t, RamSize> volatileRam;
+
+    bool mapRam(const std::string& nvramPath);
+    void unmapRam();
+
+    int64_t currentSecond(uint64_t time);
+    const struct tm& currentTime();
+    void setTime(struct tm& tm);
+    void writeTimeRegister(Register selected, uint8_t value);
+    void armUpdate();
+    void configurePeriodic();
+    void pollPeriodicFlag();
+    bool alarmMatches(const struct tm& tm) const;
+    void updateInterruptFlag();
+    void handlePeriodicEvent(uint32_t events);
+    void handleUpdateEvent(uint32_t events);
 
 public:
-    DS12887();
+    DS12887(const EventLoop& eventLoop, const VirtualClock& clock);
     DS12887(const DS12887&) = delete;
     DS12887(DS12887&&) = delete;
 
@@ -70,9 +135,16 @@ public:
     DS12887& operator=(const DS12887&) = delete;
     DS12887& operator=(DS12887&&) = delete;
 
+    // start counting at a fixed time (seconds since 1970, local time) instead of the host's
+    void resetTime(int64_t seconds);
+
+    bool start(const std::string& nvramPath, int vmFd, uint32_t gsi);
+    void stop();
+
     // DevicePio implementation
     void iowrite8(uint16_t address, uint8_t value) override;
     uint8_t ioread8(uint16_t address) override;
+    uint64_t pollTimeout(uint16_t address) override;
 };
 
 #endif /* DS12887_HPP_ */
\ No newline at end of file
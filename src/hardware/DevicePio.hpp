@@ -1,6 +1,7 @@
 #ifndef PIOOPERATIONS_HPP_
 #define PIOOPERATIONS_HPP_
 
+#include <cstdint>
 #include <stdexcept>
 
 struct DevicePio {
@@ -84,6 +85,13 @@ struct DevicePio {
         throw std::runtime_error("ioread64 is unimplemented for this device");
         return 0;
     }
+
+    // for the poll detector: how long (ns) reading address keeps returning the same value, unless
+    // the device signals DeviceActivity. UINT64_MAX if only signalled changes affect it, 0 (the
+    // default) if it may change at any time
+    virtual uint64_t pollTimeout(uint16_t address) {
+        return 0;
+    }
 };
 
 #endif /* PIOOPERATIONS_HPP_ */
\ No newline at end of file
@@ -0,0 +1,395 @@
+#include "ExternalDevice.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+#include <sched.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <linux/kvm.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#define LOG_ERROR(fmt) { \
+    std::cerr << "[ERROR] [pc104 \"" << mName << "\"]: "<< fmt << std::endl; \
+};
+
+namespace
+{
+    // a device answering from a busy loop takes a few microseconds, longer than that and the vcpu
+    // sleeps instead of spinning
+    constexpr uint64_t SpinTime = 20000;
+    // the vcpu checks the connection that often while it waits
+    constexpr uint64_t SleepTime = 10000000;
+    // a read unanswered for that long reads as all ones
+    constexpr uint64_t ResponseTimeout = 1000000000;
+
+    // tag bits of the reply
+    constexpr char InterruptDescriptors = 0x01;
+    constexpr char DoorbellDescriptor = 0x02;
+
+    uint32_t allOnes(uint8_t size)
+    {
+        return (size >= 4) ? 0xFFFFFFFF : (1u << (size * 8)) - 1;
+    }
+
+    // writes of any size ring the doorbell, only byte writes without KVM_CAP_IOEVENTFD_ANY_LENGTH
+    uint32_t doorbellLength(int vmFd)
+    {
+        return (ioctl(vmFd, KVM_CHECK_EXTENSION, KVM_CAP_IOEVENTFD_ANY_LENGTH) > 0) ? 0 : 1;
+    }
+} /* anonymous */
+
+static_assert(sizeof(ExternalDevice::Claim) == 32, "devices expect a 32 byte claim");
+static_assert(sizeof(ExternalDevice::Access) == 16, "devices expect 16 byte accesses");
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "the page is shared with the device");
+
+ExternalDevice::ExternalDevice(const EventLoop& eventLoop)
+    : mEventLoop(eventLoop), mName{}, mClaim{}, fds{}, mPage(nullptr), mConnected(false) {}
+
+ExternalDevice::~ExternalDevice()
+{
+    stop();
+}
+
+bool ExternalDevice::start(const std::string& socketPath, int vmFd)
+{
+    stop();
+    mName = "unix:" + socketPath;
+    fds.vm = vmFd;
+
+    struct sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof address.sun_path) {
+        LOG_ERROR("socket path too long.");
+        return false;
+    }
+    strcpy(address.sun_path, socketPath.c_str());
+    fds.device = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fds.device == -1 || connect(fds.device, (struct sockaddr*) &address, sizeof address) == -1) {
+        LOG_ERROR("unable to connect to the device: " << strerror(errno));
+        return false;
+    }
+
+    // the device is a local process that answers right away
+    struct timeval timeout = { 1, 0 };
+    setsockopt(fds.device, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    if (recv(fds.device, &mClaim, sizeof mClaim, MSG_WAITALL) != sizeof mClaim) {
+        LOG_ERROR("no claim received from the device.");
+        return false;
+    }
+
+    // the 8 bit PC/104 bus only decodes the first MiB
+    uint64_t limit = (mClaim.space == Space::IO) ? 0x10000 : 0x100000;
+    if ((mClaim.space != Space::IO && mClaim.space != Space::Memory) || !mClaim.length
+            || mClaim.base >= limit || mClaim.length > limit - mClaim.base) {
+        LOG_ERROR("invalid claim: space " << (int) mClaim.space << " base " << std::hex
+                << mClaim.base << " length " << mClaim.length);
+        return false;
+    }
+    if (mClaim.doorbell && (mClaim.space != Space::IO || mClaim.doorbell < mClaim.base
+            || mClaim.doorbell >= mClaim.base + mClaim.length)) {
+        LOG_ERROR("the doorbell " << std::hex << mClaim.doorbell
+                << " is not a port of the claimed range.");
+        return false;
+    }
+
+    if (!createPage() || !assignInterrupt() || !assignDoorbell() || !sendDescriptors()) {
+        return false;
+    }
+
+    mConnected = true;
+    SerialBackend::watchHangup(mEventLoop, fds.device, [this] { disconnect(); });
+    return true;
+}
+
+void ExternalDevice::stop()
+{
+    if (mConnected) {
+        mEventLoop.removeEvent(fds.device);
+        mConnected = false;
+    }
+
+    if (fds.irq != -1) {
+        struct kvm_irqfd irqfd {
+            .fd = (__u32) fds.irq,
+            .gsi = mClaim.interrupt,
+            .flags = KVM_IRQFD_FLAG_DEASSIGN,
+            .resamplefd = (__u32) fds.resample
+        };
+        ioctl(fds.vm, KVM_IRQFD, &irqfd);
+    }
+    if (fds.doorbell != -1) {
+        struct kvm_ioeventfd ioeventfd {};
+        ioeventfd.addr = mClaim.doorbell;
+        ioeventfd.len = doorbellLength(fds.vm);
+        ioeventfd.fd = fds.doorbell;
+        ioeventfd.flags = KVM_IOEVENTFD_FLAG_PIO | KVM_IOEVENTFD_FLAG_DEASSIGN;
+        ioctl(fds.vm, KVM_IOEVENTFD, &ioeventfd);
+    }
+
+    if (mPage) {
+        mPage->~Page();
+        munmap(mPage, sizeof(Page));
+        mPage = nullptr;
+    }
+    for (int* fd : { &fds.device, &fds.memory, &fds.event, &fds.irq, &fds.resample,
+            &fds.doorbell }) {
+        if (*fd != -1) {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+bool ExternalDevice::createPage()
+{
+    fds.memory = memfd_create("pc104-device", MFD_CLOEXEC);
+    if (fds.memory == -1 || ftruncate(fds.memory, sizeof(Page)) == -1) {
+        LOG_ERROR("unable to create the shared page: " << strerror(errno));
+        return false;
+    }
+    void* memory = mmap(nullptr, sizeof(Page), PROT_READ | PROT_WRITE, MAP_SHARED, fds.memory,
+            0);
+    if (memory == MAP_FAILED) {
+        LOG_ERROR("unable to map the shared page: " << strerror(errno));
+        return false;
+    }
+    mPage = new (memory) Page();
+
+    fds.event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fds.event == -1) {
+        LOG_ERROR("unable to create the device event.");
+        return false;
+    }
+    return true;
+}
+
+// the device owns the level, the emulator only registers the irqfd
+bool ExternalDevice::assignInterrupt()
+{
+    if (mClaim.interrupt == NoInterrupt) {
+        return true;
+    }
+
+    fds.irq = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    fds.resample = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fds.irq == -1 || fds.resample == -1) {
+        LOG_ERROR("unable to create irq events.");
+        return false;
+    }
+    struct kvm_irqfd irqfd {
+        .fd = (__u32) fds.irq,
+        .gsi = mClaim.interrupt,
+        .flags = KVM_IRQFD_FLAG_RESAMPLE,
+        .resamplefd = (__u32) fds.resample
+    };
+    if (ioctl(fds.vm, KVM_IRQFD, &irqfd) == -1) {
+        LOG_ERROR("unable to add irq " << mClaim.interrupt << ": " << strerror(errno));
+        close(fds.irq);
+        fds.irq = -1;
+        return false;
+    }
+    return true;
+}
+
+bool ExternalDevice::assignDoorbell()
+{
+    if (!mClaim.doorbell) {
+        return true;
+    }
+
+    fds.doorbell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fds.doorbell == -1) {
+        LOG_ERROR("unable to create the doorbell event.");
+        return false;
+    }
+    struct kvm_ioeventfd ioeventfd {};
+    ioeventfd.addr = mClaim.doorbell;
+    ioeventfd.len = doorbellLength(fds.vm);
+    ioeventfd.fd = fds.doorbell;
+    ioeventfd.flags = KVM_IOEVENTFD_FLAG_PIO;
+    if (ioctl(fds.vm, KVM_IOEVENTFD, &ioeventfd) == -1) {
+        LOG_ERROR("unable to add the doorbell: " << strerror(errno));
+        close(fds.doorbell);
+        fds.doorbell = -1;
+        return false;
+    }
+    return true;
+}
+
+bool ExternalDevice::sendDescriptors()
+{
+    int descriptors[5] = { fds.memory, fds.event };
+    size_t count = 2;
+    char tag = 0;
+    if (fds.irq != -1) {
+        descriptors[count++] = fds.irq;
+        descriptors[count++] = fds.resample;
+        tag |= InterruptDescriptors;
+    }
+    if (fds.doorbell != -1) {
+        descriptors[count++] = fds.doorbell;
+        tag |= DoorbellDescriptor;
+    }
+    if (!SerialBackend::sendDescriptors(fds.device, tag, descriptors, count)) {
+        LOG_ERROR("unable to pass the page to the device: " << strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// the irqfd stays registered, the device's last level holds until the guest acknowledges it
+void ExternalDevice::disconnect()
+{
+    LOG_ERROR("the device hung up.");
+    mEventLoop.removeEvent(fds.device);
+    mConnected = false;
+}
+
+void ExternalDevice::wakeDevice()
+{
+    // the device sets waiting before it checks the page a last time. the access was published
+    // with a release store, reading waiting after it is a store to load handshake that needs the
+    // full fence
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (mPage->waiting.exchange(0, std::memory_order_seq_cst)) {
+        uint64_t one = 1;
+        ::write(fds.event, &one, sizeof one);
+    }
+}
+
+// spins briefly, then sleeps on the response futex
+bool ExternalDevice::waitForResponse(uint32_t request)
+{
+    // spinning only keeps a device sharing the cpu from answering
+    static const bool spin = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+
+    uint64_t start = EventLoop::now();
+    uint64_t now = start;
+    while (spin && now - start < SpinTime) {
+        if (mPage->response.load(std::memory_order_acquire) == request) {
+            return true;
+        }
+        now = EventLoop::now();
+    }
+
+    uint32_t* response = reinterpret_cast<uint32_t*>(&mPage->response);
+    while (mConnected && now - start < ResponseTimeout) {
+        mPage->readerWaiting.store(1, std::memory_order_seq_cst);
+        uint32_t observed = mPage->response.load(std::memory_order_seq_cst);
+        if (observed == request) {
+            mPage->readerWaiting.store(0, std::memory_order_relaxed);
+            return true;
+        }
+
+        struct timespec timeout = { 0, (long) SleepTime };
+        syscall(SYS_futex, response, FUTEX_WAIT, observed, &timeout, nullptr, 0);
+        now = EventLoop::now();
+    }
+    mPage->readerWaiting.store(0, std::memory_order_relaxed);
+    return mPage->response.load(std::memory_order_acquire) == request;
+}
+
+// waits for room if the device fell behind
+void ExternalDevice::write(uint64_t address, uint32_t value, uint8_t size)
+{
+    uint32_t tail = mPage->tail.load(std::memory_order_relaxed);
+    while (tail - mPage->head.load(std::memory_order_acquire) >= RingSize) {
+        if (!mConnected) {
+            return;
+        }
+        wakeDevice();
+        sched_yield();
+    }
+    if (!mConnected) {
+        return;
+    }
+
+    Access& access = mPage->writes[tail % RingSize];
+    access.address = address;
+    access.value = value;
+    access.size = size;
+    mPage->tail.store(tail + 1, std::memory_order_release);
+    wakeDevice();
+}
+
+uint32_t ExternalDevice::read(uint64_t address, uint8_t size)
+{
+    if (!mConnected) {
+        return allOnes(size);
+    }
+
+    uint32_t request = mPage->request.load(std::memory_order_relaxed) + 1;
+    mPage->read.address = address;
+    mPage->read.value = 0;
+    mPage->read.size = size;
+    mPage->request.store(request, std::memory_order_release);
+    wakeDevice();
+
+    if (!waitForResponse(request)) {
+        if (mConnected) {
+            LOG_ERROR("no answer to a read of " << std::hex << address);
+        }
+        return allOnes(size);
+    }
+    return mPage->read.value & allOnes(size);
+}
+
+void ExternalDevice::performMmioOperation(bool is_write, uint64_t address, void* data,
+        size_t length)
+{
+    uint32_t value = 0;
+    if (length != 1 && length != 2 && length != 4) {
+        LOG_ERROR("unsupported access size " << length);
+        if (!is_write) {
+            memset(data, 0xFF, length);
+        }
+        return;
+    }
+
+    if (is_write) {
+        memcpy(&value, data, length);
+        write(address, value, length);
+    } else {
+        value = read(address, length);
+        memcpy(data, &value, length);
+    }
+}
+
+void ExternalDevice::iowrite8(uint16_t address, uint8_t value)
+{
+    write(address, value, 1);
+}
+
+void ExternalDevice::iowrite16(uint16_t address, uint16_t value)
+{
+    write(address, value, 2);
+}
+
+void ExternalDevice::iowrite32(uint16_t address, uint32_t value)
+{
+    write(address, value, 4);
+}
+
+uint8_t ExternalDevice::ioread8(uint16_t address)
+{
+    return read(address, 1);
+}
+
+uint16_t ExternalDevice::ioread16(uint16_t address)
+{
+    return read(address, 2);
+}
+
+uint32_t ExternalDevice::ioread32(uint16_t address)
+{
+    return read(address, 4);
+}
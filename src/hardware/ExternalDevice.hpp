@@ -0,0 +1,144 @@
+#ifndef EXTERNALDEVICE_HPP_
+#define EXTERNALDEVICE_HPP_
+
+#include "DevicePio.hpp"
+#include "SerialBackend.hpp"
+#include "../EventLoop.hpp"
+
+#include <atomic>
+#include <string>
+
+// a PC/104 device implemented by another process. the emulator connects to the unix socket the
+// device listens on and the device answers with a Claim: an i/o or memory range and optionally an
+// interrupt line and a doorbell port. the emulator replies with a tag byte (bit 0 set if the irq
+// descriptors follow, bit 1 for the doorbell) and, with SCM_RIGHTS, the memfd of a Page, the
+// device's eventfd, the irqfd and its resample eventfd, and the doorbell eventfd.
+//
+// guest writes are posted: the vcpu appends them to the ring in the page and continues, it only
+// waits for room when the ring is full. a guest read fills in the page's read slot and bumps the
+// request sequence, then waits until the device stores the value and copies the sequence to
+// response. the device must apply the posted writes ahead of a read. the vcpu spins for a while
+// before it sleeps on response (a futex), having set readerWaiting, which the device checks after
+// storing response to wake it up.
+//
+// the device sets waiting before it sleeps on its eventfd (after checking the ring and the read
+// slot once more), the eventfd is only written then.
+//
+// interrupts don't pass the emulator at all: the device writes the irqfd to assert the line (a
+// resampling irqfd, see InterruptLine) and after the guest's EOI reads the resample eventfd and
+// asserts it again if its condition still holds. writes to the doorbell port only signal the
+// doorbell eventfd (an ioeventfd), without an exit to the emulator.
+//
+// accesses come from the vcpu thread, the connection is watched on the event loop thread. once
+// the device hangs up reads return all ones and writes are dropped.
+
+class ExternalDevice : public DevicePio
+{
+public:
+    enum class Space : uint8_t {
+        IO = 0,
+        Memory = 1
+    };
+
+    struct Claim {
+        Space space;
+        uint8_t reserved[3];
+        // interrupt line (gsi), NoInterrupt if none
+        uint32_t interrupt;
+        uint64_t base;
+        uint64_t length;
+        // i/o port only signalling the doorbell eventfd, 0 if none
+        uint16_t doorbell;
+        uint8_t reserved2[6];
+    };
+
+    static constexpr uint32_t NoInterrupt = 0xFFFFFFFF;
+
+    struct Access {
+        uint64_t address;
+        uint32_t value;
+        // 1, 2 or 4 bytes
+        uint8_t size;
+        uint8_t reserved[3];
+    };
+
+    static constexpr uint32_t RingSize = 256;
+
+    struct Page {
+        // the device sleeps on its eventfd
+        std::atomic<uint32_t> waiting;
+        // the vcpu sleeps on response
+        std::atomic<uint32_t> readerWaiting;
+        // a read is outstanding while request differs from response
+        std::atomic<uint32_t> request;
+        std::atomic<uint32_t> response;
+        Access read;
+        // free running ring positions of the posted writes, head advanced by the device, tail by
+        // the emulator
+        std::atomic<uint32_t> head;
+        std::atomic<uint32_t> tail;
+        Access writes[RingSize];
+    };
+
+private:
+    EventLoop mEventLoop;
+    std::string mName;
+    Claim mClaim;
+
+    struct __descriptors {
+        int vm;
+        int device;
+        int memory;
+        int event;
+        int irq;
+        int resample;
+        int doorbell;
+        __descriptors() : vm(-1), device(-1), memory(-1), event(-1), irq(-1), resample(-1),
+            doorbell(-1) {}
+    } fds;
+
+    Page* mPage;
+    std::atomic<bool> mConnected;
+
+    bool createPage();
+    bool assignInterrupt();
+    bool assignDoorbell();
+    bool sendDescriptors();
+    void disconnect();
+    void wakeDevice();
+    bool waitForResponse(uint32_t request);
+
+    void write(uint64_t address, uint32_t value, uint8_t size);
+    uint32_t read(uint64_t address, uint8_t size);
+
+public:
+    ExternalDevice(const EventLoop& eventLoop);
+    ExternalDevice(const ExternalDevice&) = delete;
+    ExternalDevice(ExternalDevice&&) = delete;
+
+    virtual ~ExternalDevice();
+
+    ExternalDevice& operator=(const ExternalDevice&) = delete;
+    ExternalDevice& operator=(ExternalDevice&&) = delete;
+
+    // connects to the device listening on the unix socket at socketPath and sets it up for the
+    // range it claims
+    bool start(const std::string& socketPath, int vmFd);
+    void stop();
+
+    const std::string& name() const { return mName; }
+    const Claim& claim() const { return mClaim; }
+
+    // a KVM_EXIT_MMIO in the claimed memory range
+    void performMmioOperation(bool is_write, uint64_t address, void* data, size_t length);
+
+    // DevicePio implementation
+    void iowrite8(uint16_t address, uint8_t value) override;
+    void iowrite16(uint16_t address, uint16_t value) override;
+    void iowrite32(uint16_t address, uint32_t value) override;
+    uint8_t ioread8(uint16_t address) override;
+    uint16_t ioread16(uint16_t address) override;
+    uint32_t ioread32(uint16_t address) override;
+};
+
+#endif /* EXTERNALDEVICE_HPP_ */
@@ -0,0 +1,311 @@
+#include "HD44780.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#define LOG_ERROR(fmt) { \
+    std::cerr << "[ERROR] [hd44780 \"" << mName << "\"]: "<< fmt << std::endl; \
+};
+
+namespace
+{
+    // execution times at 270 kHz, writing or reading RAM takes another 4 us to update AC
+    constexpr uint64_t InstructionTime = 37000;
+    constexpr uint64_t ClearTime = 1520000;
+    constexpr uint64_t DataTime = InstructionTime + 4000;
+
+    constexpr uint8_t TwoLines = 0x08;
+    constexpr uint8_t EntryIncrement = 0x02;
+    constexpr uint8_t EntryShift = 0x01;
+
+    // characters on a line of DDRAM
+    constexpr uint8_t LineLength = 40;
+} /* anonymous */
+
+static_assert(sizeof(SeqLock<HD44780::Screen>) == 8 + ((sizeof(HD44780::Screen) + 7) & ~7),
+        "viewers expect the screen at offset 8");
+
+HD44780::HD44780(const EventLoop& eventLoop)
+    : mEventLoop(eventLoop), mName{}, mBackend{}, fds{}, mPublished(nullptr),
+    mNotifyPending(false), mScreen{}, mCharacterGenerator(false), mCharacterGeneratorAddress(0),
+    mEntryMode(EntryIncrement), mFourBit(false), mNibble(false), mLatch(0), mBusyUntil(0)
+{
+    memset(mScreen.ddram, ' ', sizeof mScreen.ddram);
+}
+
+HD44780::~HD44780()
+{
+    stop();
+}
+
+bool HD44780::start(const std::string& socketPath)
+{
+    stop();
+    mName = "unix:" + socketPath;
+
+    fds.memory = memfd_create("hd44780", MFD_CLOEXEC);
+    if (fds.memory == -1 || ftruncate(fds.memory, sizeof(SeqLock<Screen>)) == -1) {
+        LOG_ERROR("unable to create the screen memory: " << strerror(errno));
+        return false;
+    }
+    void* memory = mmap(nullptr, sizeof(SeqLock<Screen>), PROT_READ | PROT_WRITE, MAP_SHARED,
+            fds.memory, 0);
+    if (memory == MAP_FAILED) {
+        LOG_ERROR("unable to map the screen memory: " << strerror(errno));
+        return false;
+    }
+    mPublished = new (memory) SeqLock<Screen>();
+    mPublished->store(mScreen);
+
+    mBackend = SerialBackend::create(mName);
+    if (!mBackend || !mBackend->open(mEventLoop, [this] (int fd, bool input) { addViewer(fd); })) {
+        return false;
+    }
+    return true;
+}
+
+void HD44780::stop()
+{
+    for (auto& viewer : fds.viewers) {
+        mEventLoop.removeEvent(viewer.first);
+        close(viewer.first);
+        close(viewer.second);
+    }
+    fds.viewers.clear();
+
+    if (mBackend) {
+        mBackend->close();
+        mBackend.reset();
+    }
+
+    if (mPublished) {
+        mPublished->~SeqLock<Screen>();
+        munmap(mPublished, sizeof(SeqLock<Screen>));
+        mPublished = nullptr;
+    }
+    if (fds.memory != -1) {
+        close(fds.memory);
+        fds.memory = -1;
+    }
+}
+
+// every viewer gets the screen memory and an eventfd of its own
+void HD44780::addViewer(int fd)
+{
+    int event = eventfd(1, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (event == -1) {
+        LOG_ERROR("unable to create viewer event.");
+        close(fd);
+        return;
+    }
+
+    int descriptors[2] = { fds.memory, event };
+    if (!SerialBackend::sendDescriptors(fd, 'L', descriptors, 2)) {
+        LOG_ERROR("unable to pass the screen to a viewer: " << strerror(errno));
+        close(event);
+        close(fd);
+        return;
+    }
+
+    fds.viewers.emplace(fd, event);
+    SerialBackend::watchHangup(mEventLoop, fd, [this, fd] { removeViewer(fd); });
+}
+
+void HD44780::removeViewer(int fd)
+{
+    auto viewer = fds.viewers.find(fd);
+    if (viewer == fds.viewers.end()) {
+        return;
+    }
+    mEventLoop.removeEvent(fd);
+    close(viewer->first);
+    close(viewer->second);
+    fds.viewers.erase(viewer);
+}
+
+// clears the pending flag first, a change published after that posts again
+void HD44780::notifyViewers()
+{
+    mNotifyPending.store(false, std::memory_order_release);
+    uint64_t one = 1;
+    for (auto& viewer : fds.viewers) {
+        write(viewer.second, &one, sizeof one);
+    }
+}
+
+void HD44780::publish()
+{
+    if (!mPublished) {
+        return;
+    }
+    mPublished->store(mScreen);
+    if (!mNotifyPending.exchange(true, std::memory_order_acq_rel)) {
+        mEventLoop.post([this] { notifyViewers(); });
+    }
+}
+
+uint8_t HD44780::ddramIndex(uint8_t address) const
+{
+    if (mScreen.functionSet & TwoLines) {
+        return ((address & 0x40) ? LineLength : 0) + (address & 0x3f) % LineLength;
+    }
+    return address % (2 * LineLength);
+}
+
+// the DDRAM address skips from the end of the first line to the second and back
+void HD44780::moveAddressCounter(bool increment)
+{
+    if (mCharacterGenerator) {
+        mCharacterGeneratorAddress = (mCharacterGeneratorAddress + (increment ? 1 : -1)) & 0x3f;
+        return;
+    }
+
+    uint8_t index = ddramIndex(mScreen.addressCounter);
+    index = (index + (increment ? 1 : 2 * LineLength - 1)) % (2 * LineLength);
+    if (mScreen.functionSet & TwoLines) {
+        mScreen.addressCounter = (index >= LineLength) ? 0x40 + index - LineLength : index;
+    } else {
+        mScreen.addressCounter = index;
+    }
+}
+
+void HD44780::instruction(uint8_t value)
+{
+    uint64_t executionTime = InstructionTime;
+    uint8_t lineLength = (mScreen.functionSet & TwoLines) ? LineLength : 2 * LineLength;
+
+    if (value & 0x80) {
+        // set DDRAM address
+        mScreen.addressCounter = value & 0x7f;
+        mCharacterGenerator = false;
+    } else if (value & 0x40) {
+        // set CGRAM address
+        mCharacterGeneratorAddress = value & 0x3f;
+        mCharacterGenerator = true;
+    } else if (value & 0x20) {
+        // function set
+        mFourBit = !(value & 0x10);
+        mScreen.functionSet = value & 0x0c;
+    } else if (value & 0x10) {
+        // cursor or display shift, right if R/L is set
+        bool right = value & 0x04;
+        if (value & 0x08) {
+            mScreen.shift = (mScreen.shift + (right ? lineLength - 1 : 1)) % lineLength;
+        } else {
+            moveAddressCounter(right);
+        }
+    } else if (value & 0x08) {
+        mScreen.displayControl = value & 0x07;
+    } else if (value & 0x04) {
+        mEntryMode = value & 0x03;
+    } else if (value & 0x02) {
+        // return home
+        mScreen.addressCounter = 0;
+        mScreen.shift = 0;
+        mCharacterGenerator = false;
+        executionTime = ClearTime;
+    } else if (value & 0x01) {
+        // clear display
+        memset(mScreen.ddram, ' ', sizeof mScreen.ddram);
+        mScreen.addressCounter = 0;
+        mScreen.shift = 0;
+        mCharacterGenerator = false;
+        mEntryMode |= EntryIncrement;
+        executionTime = ClearTime;
+    }
+
+    mBusyUntil = EventLoop::now() + executionTime;
+    publish();
+}
+
+void HD44780::writeData(uint8_t value)
+{
+    bool increment = mEntryMode & EntryIncrement;
+    if (mCharacterGenerator) {
+        mScreen.cgram[mCharacterGeneratorAddress] = value & 0x1f;
+    } else {
+        mScreen.ddram[ddramIndex(mScreen.addressCounter)] = value;
+        if (mEntryMode & EntryShift) {
+            uint8_t lineLength = (mScreen.functionSet & TwoLines) ? LineLength : 2 * LineLength;
+            mScreen.shift = (mScreen.shift + (increment ? 1 : lineLength - 1)) % lineLength;
+        }
+    }
+    moveAddressCounter(increment);
+
+    mBusyUntil = EventLoop::now() + DataTime;
+    publish();
+}
+
+uint8_t HD44780::readData()
+{
+    uint8_t value = mCharacterGenerator ? mScreen.cgram[mCharacterGeneratorAddress]
+            : mScreen.ddram[ddramIndex(mScreen.addressCounter)];
+    moveAddressCounter(mEntryMode & EntryIncrement);
+    // only the cursor moved, viewers show it from the screen's address counter
+    if (!mCharacterGenerator) {
+        publish();
+    }
+    return value;
+}
+
+// busy flag and address counter
+uint8_t HD44780::status()
+{
+    uint8_t address = mCharacterGenerator ? mCharacterGeneratorAddress : mScreen.addressCounter;
+    return ((EventLoop::now() < mBusyUntil) ? 0x80 : 0x00) | address;
+}
+
+void HD44780::iowrite8(uint16_t address, uint8_t value)
+{
+    // the upper nibble is latched until the lower one completes the byte
+    if (mFourBit) {
+        mNibble = !mNibble;
+        if (mNibble) {
+            mLatch = value & 0xf0;
+            return;
+        }
+        value = mLatch | (value >> 4);
+    }
+
+    if (static_cast<Port>(address & 0x01) == Port::Instruction) {
+        instruction(value);
+    } else {
+        writeData(value);
+    }
+}
+
+uint8_t HD44780::ioread8(uint16_t address)
+{
+    // the byte is read on the upper nibble transfer, the lower one hands over the rest
+    if (mFourBit) {
+        mNibble = !mNibble;
+        if (!mNibble) {
+            return mLatch;
+        }
+    }
+
+    uint8_t value = (static_cast<Port>(address & 0x01) == Port::Instruction) ? status()
+            : readData();
+    if (mFourBit) {
+        mLatch = value << 4;
+        return value & 0xf0;
+    }
+    return value;
+}
+
+// the busy flag drops when the instruction finished, nothing else changes by itself
+uint64_t HD44780::pollTimeout(uint16_t address)
+{
+    if (static_cast<Port>(address & 0x01) != Port::Instruction) {
+        return 0;
+    }
+    uint64_t now = EventLoop::now();
+    return (now < mBusyUntil) ? mBusyUntil - now : UINT64_MAX;
+}
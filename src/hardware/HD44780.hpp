@@ -0,0 +1,113 @@
+#ifndef HD44780_HPP_
+#define HD44780_HPP_
+
+#include "DevicePio.hpp"
+#include "SerialBackend.hpp"
+#include "../EventLoop.hpp"
+#include "../SeqLock.hpp"
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+
+// HD44780 character lcd controller on the TS-3100 lcd port, the instruction register (RS low) at
+// the even port and the data register (RS high) at the odd one. the 4 bit interface transfers the
+// upper nibble first on D7-D4.
+//
+// the screen is published in a memfd for viewers outside the emulator. a viewer connects to a
+// unix socket and receives the memfd and an eventfd of its own with SCM_RIGHTS, the eventfd
+// counts up whenever the screen changed since the viewer was last notified. the memfd holds a
+// SeqLock<Screen>: a 32 bit sequence that is odd while the screen is updated, then the screen at
+// offset 8. a viewer copies the screen and retries if the sequence was odd or changed meanwhile.
+//
+// registers are accessed on the vcpu thread only, viewers are served by the event loop thread.
+
+class HD44780 : public DevicePio
+{
+public:
+    struct Screen {
+        // display data, line 2 (addresses 40h-67h) starts at index 40 with two lines
+        uint8_t ddram[80];
+        // character generator, 8 rows of 5 pixels for each of the characters 0-7
+        uint8_t cgram[64];
+        // cursor, as a DDRAM address
+        uint8_t addressCounter;
+        // characters the display is shifted left by
+        uint8_t shift;
+        // bit 2 display on, bit 1 cursor, bit 0 blinking cursor
+        uint8_t displayControl;
+        // bit 3 two lines, bit 2 5x10 dots
+        uint8_t functionSet;
+    };
+
+private:
+    enum class Port : uint16_t {
+        Instruction = 0,
+        Data = 1
+    };
+
+    EventLoop mEventLoop;
+    std::string mName;
+    std::unique_ptr<SerialBackend> mBackend;
+
+    struct __descriptors {
+        int memory;
+        // the eventfd of every viewer connection
+        std::map<int, int> viewers;
+        __descriptors() : memory(-1), viewers{} {}
+    } fds;
+
+    SeqLock<Screen>* mPublished;
+    // the eventfds are written once the event loop gets to it, not for every change
+    std::atomic<bool> mNotifyPending;
+
+    // vcpu side
+    Screen mScreen;
+    // AC points into CGRAM after a CGRAM address was set
+    bool mCharacterGenerator;
+    uint8_t mCharacterGeneratorAddress;
+    // entry mode: bit 1 increment, bit 0 shift the display on writes
+    uint8_t mEntryMode;
+    bool mFourBit;
+    // the upper nibble of a 4 bit transfer was transferred
+    bool mNibble;
+    uint8_t mLatch;
+    // busy flag, set until the last instruction finished
+    uint64_t mBusyUntil;
+
+    void instruction(uint8_t value);
+    void writeData(uint8_t value);
+    uint8_t readData();
+    uint8_t status();
+    uint8_t ddramIndex(uint8_t address) const;
+    void moveAddressCounter(bool increment);
+    void publish();
+
+    void addViewer(int fd);
+    void removeViewer(int fd);
+    void notifyViewers();
+
+public:
+    HD44780(const EventLoop& eventLoop);
+    HD44780(const HD44780&) = delete;
+    HD44780(HD44780&&) = delete;
+
+    virtual ~HD44780();
+
+    HD44780& operator=(const HD44780&) = delete;
+    HD44780& operator=(HD44780&&) = delete;
+
+    // viewers connect to the unix socket at socketPath
+    bool start(const std::string& socketPath);
+    void stop();
+
+    const std::string& name() const { return mName; }
+
+    // DevicePio implementation
+    void iowrite8(uint16_t address, uint8_t value) override;
+    uint8_t ioread8(uint16_t address) override;
+    uint64_t pollTimeout(uint16_t address) override;
+};
+
+#endif /* HD44780_HPP_ */
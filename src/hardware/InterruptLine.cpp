@@ -0,0 +1,101 @@
+#include "InterruptLine.hpp"
+#include "../DeviceActivity.hpp"
+
+#include <cstdio>
+
+#include <unistd.h>
+#include <linux/kvm.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+
+InterruptLine::InterruptLine()
+    : mEventLoop{}, mResample{}, mGSI{}, mLevel(false), mAsserted(false), fds{} {}
+
+InterruptLine::~InterruptLine()
+{
+    stop();
+}
+
+bool InterruptLine::start(const EventLoop& eventLoop, int vmFd, uint32_t gsi,
+        ResampleHandler resample)
+{
+    stop();
+
+    fds.vm = vmFd;
+    fds.irq = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    fds.resample = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fds.irq == -1 || fds.resample == -1) {
+        perror("irq: unable to create irq events");
+        return false;
+    }
+
+    mGSI = gsi;
+    struct kvm_irqfd irqfd {
+        .fd = (__u32) fds.irq,
+        .gsi = mGSI,
+        .flags = KVM_IRQFD_FLAG_RESAMPLE,
+        .resamplefd = (__u32) fds.resample
+    };
+    if (ioctl(fds.vm, KVM_IRQFD, &irqfd) == -1) {
+        perror("irq: failed to add irq event");
+        close(fds.irq);
+        close(fds.resample);
+        fds.irq = -1;
+        fds.resample = -1;
+        return false;
+    }
+
+    // the guest acknowledged the line, whichever source raised it
+    mResample = std::move(resample);
+    mEventLoop.reset(new EventLoop(eventLoop));
+    mEventLoop->addEvent(fds.resample, EPOLLIN, [this] (uint32_t events) {
+        uint64_t data = 0;
+        read(fds.resample, &data, sizeof data);
+        mAsserted = false;
+        if (mResample) {
+            mResample();
+        }
+        set(mLevel);
+    });
+    return true;
+}
+
+void InterruptLine::stop()
+{
+    mEventLoop.reset();
+    if (fds.vm != -1 && fds.irq != -1) {
+        struct kvm_irqfd irqfd {
+            .fd = (__u32) fds.irq,
+            .gsi = mGSI,
+            .flags = KVM_IRQFD_FLAG_DEASSIGN,
+            .resamplefd = (__u32) fds.resample
+        };
+        ioctl(fds.vm, KVM_IRQFD, &irqfd);
+        close(fds.irq);
+        close(fds.resample);
+        fds.irq = -1;
+        fds.resample = -1;
+    }
+    mLevel = false;
+    mAsserted = false;
+}
+
+void InterruptLine::set(bool level)
+{
+    mLevel = level;
+    if (mLevel && !mAsserted) {
+        raise();
+    }
+}
+
+void InterruptLine::raise()
+{
+    if (fds.irq == -1) {
+        return;
+    }
+    mAsserted = true;
+    uint64_t data = 1;
+    write(fds.irq, &data, sizeof data);
+    DeviceActivity::notify();
+}
@@ -0,0 +1,63 @@
+#ifndef INTERRUPTLINE_HPP_
+#define INTERRUPTLINE_HPP_
+
+#include "../EventLoop.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+// one source of a level triggered interrupt line of the in-kernel 8259, which may be shared
+// (COM1 and COM3 both drive IRQ4).
+//
+// every source registers its own resampling irqfd. kvm keeps a single level for all resampling
+// irqfds of a gsi, so while asserted the line is the or of its sources. it stays high until the
+// guest's EOI, then kvm lowers it and signals every source's resample event, and each source whose
+// condition still holds asserts it again, a new edge for the 8259. a source therefore only tracks
+// its own condition and whether it asserted since the last EOI, never the line itself.
+//
+// set() and the resample handler run on the event loop thread the line was started on.
+
+class InterruptLine
+{
+public:
+    // called on an EOI before the line is reasserted, to bring the level up to date
+    using ResampleHandler = std::function<void()>;
+
+private:
+    // a copy of the owner's loop, dropping it removes the resample handler
+    std::unique_ptr<EventLoop> mEventLoop;
+    ResampleHandler mResample;
+    uint32_t mGSI;
+    bool mLevel;
+    bool mAsserted;
+
+    struct __descriptors {
+        int vm;
+        int irq;
+        int resample;
+        __descriptors() : vm(-1), irq(-1), resample(-1) {}
+    } fds;
+
+    void raise();
+
+public:
+    InterruptLine();
+    InterruptLine(const InterruptLine&) = delete;
+    InterruptLine(InterruptLine&&) = delete;
+
+    ~InterruptLine();
+
+    InterruptLine& operator=(const InterruptLine&) = delete;
+    InterruptLine& operator=(InterruptLine&&) = delete;
+
+    bool start(const EventLoop& eventLoop, int vmFd, uint32_t gsi,
+            ResampleHandler resample = nullptr);
+    void stop();
+
+    // the source's condition. a rising level asserts the line, unless this source did already
+    // and the guest hasn't acknowledged it yet
+    void set(bool level);
+};
+
+#endif /* INTERRUPTLINE_HPP_ */
@@ -0,0 +1,386 @@
+#include "Keyboard8042.hpp"
+#include "../DeviceActivity.hpp"
+
+#include <cerrno>
+#include <iostream>
+
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#define LOG_ERROR(fmt) { \
+    std::cerr << "[ERROR] [8042 \"" << mName << "\"]: "<< fmt << std::endl; \
+};
+
+#ifndef NDEBUG
+#define LOG_INFO(fmt) { \
+    std::cerr << "[INFO] [8042 \"" << mName << "\"]: "<< fmt << std::endl; \
+};
+#else
+#define LOG_INFO(fmt)
+#endif
+
+namespace
+{
+    // status register
+    constexpr uint8_t OutputBufferFull = 0x01;
+    constexpr uint8_t SystemFlag = 0x04;
+    constexpr uint8_t CommandWritten = 0x08;
+    constexpr uint8_t KeyboardUnlocked = 0x10;
+
+    // command byte
+    constexpr uint8_t KeyboardInterrupt = 0x01;
+    constexpr uint8_t KeyboardDisabled = 0x10;
+    constexpr uint8_t AuxiliaryDisabled = 0x20;
+    constexpr uint8_t Translate = 0x40;
+
+    // keyboard replies
+    constexpr uint8_t Acknowledge = 0xFA;
+    constexpr uint8_t Resend = 0xFE;
+    constexpr uint8_t SelfTestPassed = 0xAA;
+} /* anonymous */
+
+Keyboard8042::Keyboard8042(const EventLoop& eventLoop)
+    : mEventLoop(eventLoop), mName{}, mBackend{}, mMutex{}, mInterrupt{}, fds{}, registers{},
+    pending{}, mScanning(true), mReceiving(true), mReplies{}, mKeystrokes{}
+{
+    registers.status = KeyboardUnlocked;
+    registers.commandByte = KeyboardInterrupt | Translate;
+    // A20 enabled, reset not asserted
+    registers.outputPort = 0x03;
+}
+
+Keyboard8042::~Keyboard8042()
+{
+    stop();
+}
+
+bool Keyboard8042::start(std::unique_ptr<SerialBackend> backend, int vmFd, uint32_t gsi)
+{
+    stop();
+    if (!backend) {
+        return false;
+    }
+    mBackend = std::move(backend);
+    mName = mBackend->name();
+
+    if (!mInterrupt.start(mEventLoop, vmFd, gsi, [this] {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mInterrupt.set(interruptPending());
+    })) {
+        LOG_ERROR("unable to set up irq " << gsi);
+        return false;
+    }
+
+    if (!mBackend->open(mEventLoop, [this] (int fd, bool input) { addClient(fd, input); })) {
+        return false;
+    }
+    mName = mBackend->name();
+    return true;
+}
+
+void Keyboard8042::stop()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    for (auto& client : fds.clients) {
+        if (client.second) {
+            mEventLoop.removeEvent(client.first);
+        }
+        close(client.first);
+    }
+    fds.clients.clear();
+
+    if (mBackend) {
+        mBackend->close();
+    }
+
+    mInterrupt.stop();
+}
+
+void Keyboard8042::addClient(int fd, bool input)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    fds.clients.emplace(fd, input);
+    if (input) {
+        mEventLoop.addEvent(fd, mReceiving ? (uint32_t) EPOLLIN : 0, [this, fd] (uint32_t events) {
+            handleClientEvent(fd, events);
+        });
+    }
+}
+
+void Keyboard8042::handleClientEvent(int fd, uint32_t events)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (events & EPOLLIN) {
+        // no more than the keyboard buffer takes, the rest waits in the socket. the event may
+        // have been harvested before the buffer filled up, a zero length read would look like eof
+        size_t room = KeyboardBuffer - mKeystrokes.size();
+        if (!room) {
+            return;
+        }
+        uint8_t buffer[KeyboardBuffer];
+        struct iovec iov[1] = { { buffer, room } };
+        ssize_t n = mBackend->receive(fd, iov, 1);
+        if (n == 0 || (n == -1 && errno != EAGAIN)) {
+            removeClient(fd);
+            return;
+        }
+        if (n > 0) {
+            mKeystrokes.insert(mKeystrokes.end(), buffer, buffer + n);
+        }
+
+        fillOutputBuffer();
+        updateReceiving();
+        mInterrupt.set(interruptPending());
+    } else if (events & (EPOLLHUP | EPOLLERR)) {
+        removeClient(fd);
+    }
+}
+
+// requires mMutex
+void Keyboard8042::removeClient(int fd)
+{
+    auto client = fds.clients.find(fd);
+    if (client == fds.clients.end()) {
+        return;
+    }
+    if (client->second) {
+        mEventLoop.removeEvent(fd);
+    }
+    close(fd);
+    fds.clients.erase(client);
+}
+
+// reads keystrokes while the keyboard is enabled and its buffer has room. requires mMutex, on
+// the event loop thread
+void Keyboard8042::updateReceiving()
+{
+    bool receiving = mScanning && !(registers.commandByte & KeyboardDisabled)
+            && mKeystrokes.size() < KeyboardBuffer;
+    if (receiving == mReceiving) {
+        return;
+    }
+
+    mReceiving = receiving;
+    for (auto& client : fds.clients) {
+        if (client.second) {
+            mEventLoop.modifyEvent(client.first, mReceiving ? (uint32_t) EPOLLIN : 0);
+        }
+    }
+}
+
+// replies go ahead of keystrokes still waiting. requires mMutex
+void Keyboard8042::queueReply(uint8_t value)
+{
+    mReplies.push_back(value);
+    fillOutputBuffer();
+}
+
+// moves the next byte into an empty output buffer. requires mMutex
+void Keyboard8042::fillOutputBuffer()
+{
+    if (registers.status & OutputBufferFull) {
+        return;
+    }
+
+    if (!mReplies.empty()) {
+        registers.outputBuffer = mReplies.front();
+        mReplies.pop_front();
+    } else if (!mKeystrokes.empty() && mScanning
+            && !(registers.commandByte & KeyboardDisabled)) {
+        registers.outputBuffer = mKeystrokes.front();
+        mKeystrokes.pop_front();
+    } else {
+        return;
+    }
+    registers.status |= OutputBufferFull;
+    DeviceActivity::notify();
+}
+
+// requires mMutex
+void Keyboard8042::controllerCommand(uint8_t command)
+{
+    switch (command) {
+        case 0x20:
+            // read command byte
+            queueReply(registers.commandByte);
+            break;
+        case 0x60:
+        case 0xD1:
+        case 0xD2:
+            // write command byte, output port, keyboard output buffer
+            pending.controller = command;
+            break;
+        case 0xA7:
+            registers.commandByte |= AuxiliaryDisabled;
+            break;
+        case 0xA8:
+            registers.commandByte &= ~AuxiliaryDisabled;
+            break;
+        case 0xAA:
+            // self test
+            queueReply(0x55);
+            break;
+        case 0xAB:
+            // keyboard interface test
+            queueReply(0x00);
+            break;
+        case 0xAD:
+            registers.commandByte |= KeyboardDisabled;
+            break;
+        case 0xAE:
+            registers.commandByte &= ~KeyboardDisabled;
+            fillOutputBuffer();
+            break;
+        case 0xC0:
+            // input port, keyboard not inhibited
+            queueReply(0x80);
+            break;
+        case 0xD0:
+            queueReply(registers.outputPort);
+            break;
+        case 0xE0:
+            // test inputs
+            queueReply(0x00);
+            break;
+        default:
+            // F0h-FFh pulse output port lines, resetting the cpu isn't supported
+            LOG_INFO("unsupported controller command: " << std::hex << (int) command);
+            break;
+    }
+}
+
+// requires mMutex
+void Keyboard8042::controllerData(uint8_t value)
+{
+    switch (pending.controller) {
+        case 0x60:
+            registers.commandByte = value;
+            registers.status = (registers.status & ~SystemFlag) | (value & SystemFlag);
+            fillOutputBuffer();
+            break;
+        case 0xD1:
+            // the reset line stays high
+            registers.outputPort = value | 0x01;
+            break;
+        case 0xD2:
+            queueReply(value);
+            break;
+    }
+    pending.controller = 0;
+}
+
+// requires mMutex
+void Keyboard8042::keyboardData(uint8_t value)
+{
+    // sending the keyboard anything enables its interface again
+    registers.commandByte &= ~KeyboardDisabled;
+
+    if (pending.keyboard) {
+        queueReply(Acknowledge);
+        // a zero argument to F0h queries the scan code set, 2 (41h once translated)
+        if (pending.keyboard == 0xF0 && !value) {
+            queueReply((registers.commandByte & Translate) ? 0x41 : 0x02);
+        }
+        pending.keyboard = 0;
+        return;
+    }
+
+    switch (value) {
+        case 0xED:
+        case 0xF0:
+        case 0xF3:
+            // leds, scan code set, typematic rate
+            pending.keyboard = value;
+            queueReply(Acknowledge);
+            break;
+        case 0xEE:
+            // echo
+            queueReply(0xEE);
+            break;
+        case 0xF2:
+            // identify, an MF2 keyboard
+            queueReply(Acknowledge);
+            queueReply(0xAB);
+            queueReply((registers.commandByte & Translate) ? 0x41 : 0x83);
+            break;
+        case 0xF4:
+            mScanning = true;
+            queueReply(Acknowledge);
+            break;
+        case 0xF5:
+            // disable, back to defaults
+            mScanning = false;
+            mKeystrokes.clear();
+            queueReply(Acknowledge);
+            break;
+        case 0xF6:
+            queueReply(Acknowledge);
+            break;
+        case 0xFF:
+            mScanning = true;
+            mKeystrokes.clear();
+            queueReply(Acknowledge);
+            queueReply(SelfTestPassed);
+            break;
+        default:
+            queueReply((value >= 0xF7 && value <= 0xFE) ? Acknowledge : Resend);
+            break;
+    }
+}
+
+// requires mMutex
+bool Keyboard8042::interruptPending() const
+{
+    return (registers.status & OutputBufferFull) && (registers.commandByte & KeyboardInterrupt);
+}
+
+// the line and the connections belong to the event loop thread
+void Keyboard8042::postUpdate()
+{
+    mEventLoop.post([this] {
+        std::unique_lock<std::mutex> lock(mMutex);
+        updateReceiving();
+        mInterrupt.set(interruptPending());
+    });
+}
+
+void Keyboard8042::iowrite8(uint16_t address, uint8_t value)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (static_cast<Port>(address) == Port::Status_Command) {
+        registers.status |= CommandWritten;
+        controllerCommand(value);
+    } else {
+        registers.status &= ~CommandWritten;
+        if (pending.controller) {
+            controllerData(value);
+        } else {
+            keyboardData(value);
+        }
+    }
+    postUpdate();
+}
+
+uint8_t Keyboard8042::ioread8(uint16_t address)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (static_cast<Port>(address) == Port::Status_Command) {
+        return registers.status;
+    }
+
+    // an empty buffer reads as the last byte again
+    uint8_t value = registers.outputBuffer;
+    if (registers.status & OutputBufferFull) {
+        registers.status &= ~OutputBufferFull;
+        fillOutputBuffer();
+        postUpdate();
+    }
+    return value;
+}
+
+// both registers only change on guest accesses and on bytes arriving, which signal activity
+uint64_t Keyboard8042::pollTimeout(uint16_t address)
+{
+    return UINT64_MAX;
+}
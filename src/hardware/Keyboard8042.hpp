@@ -0,0 +1,98 @@
+#ifndef KEYBOARD8042_HPP_
+#define KEYBOARD8042_HPP_
+
+#include "DevicePio.hpp"
+#include "InterruptLine.hpp"
+#include "SerialBackend.hpp"
+#include "../EventLoop.hpp"
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// 8042 keyboard controller with a keyboard behind it. keystrokes come from the connections of a
+// serial backend as set 1 scan codes, the codes the guest sees with translation on, and are
+// passed through unchanged. the controller answers commands right away, so the input buffer is
+// never full.
+//
+// the guest side runs on the vcpu thread under mMutex, connections and IRQ1 on the event loop
+// thread. a byte in the output buffer holds the line high while the command byte enables the
+// interrupt, reading it moves the next one in.
+
+class Keyboard8042 : public DevicePio
+{
+    enum class Port : uint16_t {
+        Data = 0x60,
+        Status_Command = 0x64
+    };
+
+    EventLoop mEventLoop;
+    std::string mName;
+    std::unique_ptr<SerialBackend> mBackend;
+    std::mutex mMutex;
+    InterruptLine mInterrupt;
+
+    struct __descriptors {
+        // connections of the backend, true if they also deliver input
+        std::map<int, bool> clients;
+        __descriptors() : clients{} {}
+    } fds;
+
+    struct {
+        uint8_t status;
+        uint8_t commandByte;
+        uint8_t outputPort;
+        uint8_t outputBuffer;
+    } registers;
+
+    // controller and keyboard commands waiting for their data byte, 0 if none
+    struct {
+        uint8_t controller;
+        uint8_t keyboard;
+    } pending;
+
+    // keyboard enabled by the guest (F4h/F5h), it holds keystrokes otherwise
+    bool mScanning;
+    bool mReceiving;
+    // bytes for the output buffer, replies to commands ahead of keystrokes
+    std::deque<uint8_t> mReplies;
+    std::deque<uint8_t> mKeystrokes;
+    // the keyboard's own buffer, no more keystrokes are read from the connections while full
+    static constexpr size_t KeyboardBuffer = 16;
+
+    void addClient(int fd, bool input);
+    void handleClientEvent(int fd, uint32_t events);
+    void removeClient(int fd);
+    void updateReceiving();
+    void queueReply(uint8_t value);
+    void fillOutputBuffer();
+    void controllerCommand(uint8_t command);
+    void controllerData(uint8_t value);
+    void keyboardData(uint8_t value);
+    bool interruptPending() const;
+    void postUpdate();
+
+public:
+    Keyboard8042(const EventLoop& eventLoop);
+    Keyboard8042(const Keyboard8042&) = delete;
+    Keyboard8042(Keyboard8042&&) = delete;
+
+    virtual ~Keyboard8042();
+
+    Keyboard8042& operator=(const Keyboard8042&) = delete;
+    Keyboard8042& operator=(Keyboard8042&&) = delete;
+
+    bool start(std::unique_ptr<SerialBackend> backend, int vmFd, uint32_t gsi);
+    void stop();
+
+    const std::string& name() const { return mName; }
+
+    // DevicePio implementation
+    void iowrite8(uint16_t address, uint8_t value) override;
+    uint8_t ioread8(uint16_t address) override;
+    uint64_t pollTimeout(uint16_t address) override;
+};
+
+#endif /* KEYBOARD8042_HPP_ */
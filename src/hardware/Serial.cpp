@@ -1,320 +1,667 @@
 #include "Serial.hpp"
+#include "../DeviceActivity.hpp"
 
+#include <algorithm>
 #include <array>
-#include <functional>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <string_view>
 
 #include <unistd.h>
-#include <linux/kvm.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
-#include <sys/ioctl.h>
 #include <sys/fcntl.h>
-#include <sys/socket.h>
-#include <sys/timerfd.h>
-#include <sys/un.h>
 
 #define THROW_RUNTIME_ERROR(fmt) { \
     std::ostringstream ss; \
-    ss << "[FATAL] [16450 \"" << mSocketName << "\"]: "<< fmt; \
+    ss << "[FATAL] [16450 \"" << mName << "\"]: "<< fmt; \
     throw std::runtime_error(ss.str()); \
 };
 
 #define LOG_ERROR(fmt) { \
-    std::cerr << "[ERROR] [16450 \"" << mSocketName << "\"]: "<< fmt << std::endl; \
+    std::cerr << "[ERROR] [16450 \"" << mName << "\"]: "<< fmt << std::endl; \
 };
 
 #ifndef NDEBUG
 #define LOG_INFO(fmt) { \
-    std::cerr << "[INFO] [16450 \"" << mSocketName << "\"]: "<< fmt << std::endl; \
+    std::cerr << "[INFO] [16450 \"" << mName << "\"]: "<< fmt << std::endl; \
 };
 #else
 #define LOG_INFO(fmt)
 #endif
 
+// modem status lines the modem control outputs drive in loopback: DTR to DSR, RTS to CTS,
+// OUT1 to RI and OUT2 to DCD
+static uint8_t loopbackModemStatus(uint8_t modemControl)
+{
+    return ((modemControl & 0x01) << 5) | ((modemControl & 0x02) << 3)
+            | ((modemControl & 0x0c) << 4);
+}
 
 Serial16450::Serial16450(const EventLoop& eventLoop)
-    : mEventLoop(eventLoop), mSocketName{}, mMutex{}, mGSI{},
-    mEventFlags{EPOLLIN | EPOLLOUT | EPOLLERR}, fds{}, registers{} {}
+    : mEventLoop(eventLoop), mName{}, mBackend{}, mMutex{}, mInterrupt{},
+    mPacing(Pacing::Accurate), mPacingScale(1), mRs485(false),
+    mEventFlags{EPOLLIN}, fds{}, mDma{}, mDmaReceive{}, mDmaTransmit{},
+    mReadTimer(EventLoop::NoTimer),
+    mWriteTimer(EventLoop::NoTimer), device{}, mReceiveRing{}, mTransmitRing{}, mCommands{},
+    mCommandsPending(false), mStatus{}, registers{}, tickets{} {}
 
 Serial16450::~Serial16450()
 {
     stop();
 }
 
-bool Serial16450::start(const std::string& socketName, int vmFd, uint32_t gsi)
+bool Serial16450::start(std::unique_ptr<SerialBackend> backend, int vmFd, uint32_t gsi)
 {
     stop();
-
-    // create unix socket to read content
-    struct sockaddr_un addr;
-    memset(&addr, 0, sizeof addr);
-    addr.sun_family = AF_UNIX;
-    mSocketName = socketName;
-    strcpy(addr.sun_path, socketName.c_str());
-    unlink(addr.sun_path);
-
-    fds.server = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (fds.server == -1) {
-        LOG_ERROR("failed to create unix socket.");
+    if (!backend) {
         return false;
     }
+    mBackend = std::move(backend);
+    mName = mBackend->name();
 
-    if (bind(fds.server, (struct sockaddr*) &addr, sizeof addr) == -1) {
-        LOG_ERROR("unable to bind unix socket server.");
+    fds.command = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fds.command == -1) {
+        LOG_ERROR("unable to create command event.");
         return false;
     }
 
-    if (listen(fds.server, 1) == -1) {
-        LOG_ERROR("unable to listen on unix server socket");
+    // the guest acknowledged the line (maybe for the port sharing it). accesses its handler
+    // queued are applied first, so a condition it already serviced doesn't fire again
+    if (!mInterrupt.start(mEventLoop, vmFd, gsi, [this] {
+        std::unique_lock<std::mutex> lock(mMutex);
+        applyCommands();
+    })) {
+        LOG_ERROR("unable to set up irq " << gsi);
         return false;
     }
 
-    // create timer for "rx ready"
-    fds.readTimer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
-    if (fds.readTimer == -1) {
-        LOG_ERROR("unable to create timer descriptor");
-        return false;
+    // apply the register accesses queued by the vcpu
+    mEventLoop.addEvent(fds.command, EPOLLIN, [this] (uint32_t events) {
+        uint64_t data = 0;
+        read(fds.command, &data, sizeof data);
+        mCommandsPending.exchange(false, std::memory_order_acq_rel);
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        applyCommands();
+    });
+
+    if (mDma) {
+        mDma->attach(mDmaReceive, [this] { dmaArmed(); });
+        mDma->attach(mDmaTransmit, [this] { dmaArmed(); });
     }
 
-    // create timer for "tx ready"
-    fds.writeTimer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
-    if (fds.writeTimer == -1) {
-        LOG_ERROR("unable to create timer descriptor");
-        return false;
+    // a sink takes output right away, the others once something is connected
+    if (mBackend->alwaysConnected()) {
+        std::unique_lock<std::mutex> lock(mMutex);
+        transmitterEmpty();
+        // the lines as they are at power on, not a change
+        updateModemStatus(false);
     }
 
-    // create interrupts
-    fds.vm = vmFd;
-    fds.irq = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
-    if (fds.irq == -1) {
-        LOG_ERROR("unable to create irq event");
+    if (!mBackend->open(mEventLoop, [this] (int fd, bool input) { addClient(fd, input); })) {
         return false;
     }
+    mName = mBackend->name();
+    return true;
+}
+
+void Serial16450::stop() {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    for (auto& client : fds.clients) {
+        if (client.second) {
+            mEventLoop.removeEvent(client.first);
+        }
+        close(client.first);
+    }
+    fds.clients.clear();
 
-    fds.refresh = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
-    if (fds.refresh == -1) {
-        LOG_ERROR("unable to create irq refresh event.");
-        return false;
+    if (mBackend) {
+        mBackend->close();
     }
 
-    mGSI = gsi;
-    struct kvm_irqfd irqfd {
-        .fd = (__u32) fds.irq,
-        .gsi = mGSI,
-        .flags = KVM_IRQFD_FLAG_RESAMPLE,
-        .resamplefd = (__u32) fds.refresh
-    };
-    if (ioctl(fds.vm, KVM_IRQFD, &irqfd) == -1) {
-        LOG_ERROR("failed to add irq event");
-        return false;
+    mInterrupt.stop();
+
+    if (mDma) {
+        mDma->attach(mDmaReceive, nullptr);
+        mDma->attach(mDmaTransmit, nullptr);
+    }
+
+    if (fds.command != -1) {
+        mEventLoop.removeEvent(fds.command);
+        close(fds.command);
+        fds.command = -1;
     }
 
-    // whenever a client connects, perform the accept
-    mEventLoop.addEvent(fds.server, EPOLLIN, [this] (uint32_t events) {
-        if (events & EPOLLERR) {
-            LOG_ERROR("error occurred with server socket.");
-            return;
+    mEventLoop.cancelTimer(mReadTimer);
+    mEventLoop.cancelTimer(mWriteTimer);
+    mReadTimer = EventLoop::NoTimer;
+    mWriteTimer = EventLoop::NoTimer;
+}
+
+void Serial16450::addClient(int fd, bool input)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    fds.clients.emplace(fd, input);
+    if (input) {
+        mEventLoop.addEvent(fd, mEventFlags, [this, fd] (uint32_t events) {
+            handleClientEvent(fd, events);
+        });
+    }
+
+    // output held back for a listener can go now
+    if (!device.status.writable && mWriteTimer == EventLoop::NoTimer) {
+        transmitterEmpty();
+    }
+    updateModemStatus();
+}
+
+void Serial16450::handleClientEvent(int fd, uint32_t events)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (events & EPOLLIN) {
+        struct iovec iov[2];
+        int count = mReceiveRing.writable(iov);
+        if (count) {
+            ssize_t n = mBackend->receive(fd, iov, count);
+            if (n == 0 || (n == -1 && errno != EAGAIN)) {
+                removeClient(fd);
+                return;
+            }
+            if (n > 0) {
+                mReceiveRing.commit(n);
+            }
         }
 
-        int fd = accept(fds.server, nullptr, nullptr);
-        if (fd == -1) {
-            LOG_ERROR("failed to accept client connection.");
-            return;
+        // stop reading once the ring is full, the guest drains it at the baud rate
+        if (!mReceiveRing.space()) {
+            mEventFlags &= ~EPOLLIN;
+            reloadEventLoop();
         }
+        deliverReceived();
+    } else if (events & (EPOLLHUP | EPOLLERR)) {
+        removeClient(fd);
+        return;
+    }
 
-        // add client to event loop with all events disabled. interrupt enable register handles
-        // what events we listen for
-        std::unique_lock<std::mutex> lock(mMutex);
-        mEventLoop.addEvent(fd, mEventFlags,
-                std::bind(&Serial16450::handleClientEvent, this, fd, std::placeholders::_1));
-        fds.clients.insert(fd);
-    });
+    // backed up output can go on
+    if (events & EPOLLOUT) {
+        flushTransmit();
+    }
+}
+
+// requires mMutex
+void Serial16450::removeClient(int fd)
+{
+    auto client = fds.clients.find(fd);
+    if (client == fds.clients.end()) {
+        return;
+    }
+    if (client->second) {
+        mEventLoop.removeEvent(fd);
+    }
+    close(fd);
+    fds.clients.erase(client);
+
+    // the backlog goes to the remaining connections, or nowhere
+    flushTransmit();
+    updateModemStatus();
+}
 
-#if 0
-    // whenever the refresh event occurs, retrigger the interrupt if needed
-    mEventLoop.addEvent(fds.refresh, EPOLLIN, [this] (uint32_t events) {
-        if (events & EPOLLERR) {
-            LOG_ERROR("error occurred with refresh event");
-            return;
+// requires mMutex
+void Serial16450::reloadEventLoop()
+{
+    for (auto& client : fds.clients) {
+        if (client.second) {
+            mEventLoop.modifyEvent(client.first, mEventFlags);
         }
+    }
+}
 
-        std::unique_lock<std::mutex> lock(mMutex);
-        uint64_t data = 0;
-        read(fds.refresh, &data, sizeof data);
-        if ((registers.readInterruptEnabled && registers.readInterruptFlag)
-                || (registers.writeInterruptEnabled && registers.writeInterruptFlag)) {
-            LOG_INFO("triggering interrupt (kvm irq refresh)")
-            triggerInterrupt();
+// moves the next received byte into the receive buffer register, once the guest took the
+// previous one and a character time has passed. requires mMutex
+void Serial16450::deliverReceived()
+{
+    // the MAX485 disables its receiver while it drives the line, input waits
+    if (mRs485 && (device.modemControl & 0x12) == 0x02 /* RTS, not in loopback */) {
+        return;
+    }
+    if (device.status.readable || mReadTimer != EventLoop::NoTimer || mReceiveRing.empty()) {
+        return;
+    }
+
+    if (!transferReceived() && !mReceiveRing.empty()) {
+        device.status.receive = mReceiveRing.pop();
+        device.status.readable = true;
+        device.status.readInterruptFlag = true;
+        updateInterrupt();
+    }
+
+    if (!(mEventFlags & EPOLLIN) && mReceiveRing.space()) {
+        mEventFlags |= EPOLLIN;
+        reloadEventLoop();
+    }
+}
+
+// a DMA channel serving the receiver takes the characters instead of the guest, one a character
+// time or, unpaced, as many as it will. true while a paced transfer occupies the receiver. what
+// is left after the terminal count goes to the receive buffer register. requires mMutex
+bool Serial16450::transferReceived()
+{
+    if (!mDma) {
+        return false;
+    }
+
+    size_t moved = 0;
+    size_t n;
+    do {
+        struct iovec iov[2];
+        if (!mReceiveRing.readable(iov)) {
+            break;
         }
+        size_t length = characterTime() ? 1 : iov[0].iov_len;
+        n = mDma->transfer(mDmaReceive, static_cast<uint8_t*>(iov[0].iov_base), length);
+        mReceiveRing.consume(n);
+        moved += n;
+    } while (n && !characterTime());
+
+    if (!moved || !characterTime()) {
+        return false;
+    }
+    mReadTimer = mEventLoop.addTimer(EventLoop::now() + characterTime(), [this] {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mReadTimer = EventLoop::NoTimer;
+        deliverReceived();
     });
-#endif
+    return true;
+}
+
+// the transmitter shifted out the last character. without a connection the port holds the
+// guest's output until one shows up. requires mMutex
+void Serial16450::transmitterEmpty()
+{
+    if (fds.clients.empty() && !mBackend->alwaysConnected()) {
+        return;
+    }
+    if (transferTransmit()) {
+        return;
+    }
+
+    device.status.writable = true;
+    device.status.writeInterruptFlag = true;
+    updateInterrupt();
+}
+
+// a DMA channel serving the transmitter feeds it from memory, a character at a time or, unpaced,
+// as much as the transmit ring takes. true while the transfer occupies the transmitter.
+// requires mMutex
+bool Serial16450::transferTransmit()
+{
+    if (!mDma || !mDma->armed(mDmaTransmit)) {
+        return false;
+    }
+
+    // unpaced output backed up, try again once some of it drained
+    uint8_t buffer[TransmitLowWater];
+    size_t length = characterTime() ? 1 : std::min(sizeof buffer, mTransmitRing.space());
+    uint64_t delay = 1000000;
+    size_t n = length ? mDma->transfer(mDmaTransmit, buffer, length) : 0;
+    if (length && !n) {
+        return false;
+    }
 
-    // whenever the timeout occurs for the read timer, re-enable the read interrupts
-    mEventLoop.addEvent(fds.readTimer, EPOLLIN, [this] (uint32_t events) {
-        if (events & EPOLLERR) {
-            LOG_ERROR("error occurred with timer event");
-            return;
+    for (size_t i = 0; i < n; i++) {
+        if (device.modemControl & 0x10 /* loopback */) {
+            mReceiveRing.push(buffer[i]);
+        } else if (!mRs485 || (device.modemControl & 0x02)) {
+            mTransmitRing.push(buffer[i]);
         }
+    }
+    if (n) {
+        deliverReceived();
+        flushTransmit();
+        delay = characterTime() * n;
+    }
 
-        uint64_t data = 0;
-        read(fds.readTimer, &data, sizeof data);
+    device.status.writable = false;
+    device.status.writeInterruptFlag = false;
+    updateInterrupt();
+    mWriteTimer = mEventLoop.addTimer(EventLoop::now() + delay, [this] {
         std::unique_lock<std::mutex> lock(mMutex);
-        mEventFlags |= EPOLLIN;
-        reloadEventLoop();
+        mWriteTimer = EventLoop::NoTimer;
+        transmitterEmpty();
+    });
+    return true;
+}
+
+// a channel serving one of the port's lines may have been armed, transfers start on the event
+// loop thread
+void Serial16450::dmaArmed()
+{
+    mEventLoop.post([this] {
+        std::unique_lock<std::mutex> lock(mMutex);
+        deliverReceived();
+        if (device.status.writable && mWriteTimer == EventLoop::NoTimer) {
+            transmitterEmpty();
+        }
     });
+}
 
-    // whenever the timeout occurs for the send timer, re-enable the write interrupts
-    mEventLoop.addEvent(fds.writeTimer, EPOLLIN, [this] (uint32_t events) {
-        if (events & EPOLLERR) {
-            LOG_ERROR("error occurred with timer event");
-            return;
+// hands everything the guest wrote since the last flush to every connection in one call each.
+// output waits for the fastest connection, the others lose what they can't take. while it backs
+// up CTS is dropped, so a guest doing hardware flow control stops sending. requires mMutex
+void Serial16450::flushTransmit()
+{
+    struct iovec iov[2];
+    int count = mTransmitRing.readable(iov);
+    size_t sent = 0;
+    bool pollable = false;
+    if (count) {
+        for (auto& client : fds.clients) {
+            ssize_t n = mBackend->transmit(client.first, iov, count);
+            if (n > 0 && (size_t) n > sent) {
+                sent = n;
+            }
+            pollable = pollable || client.second;
         }
+    }
 
-        uint64_t data = 0;
-        read(fds.writeTimer, &data, sizeof data);
-        std::unique_lock<std::mutex> lock(mMutex);
-        mEventFlags |= EPOLLOUT;
+    // nothing would report the output drained, drop it
+    if (!pollable) {
+        sent = mTransmitRing.size();
+    }
+    mTransmitRing.consume(sent);
+
+    bool backedUp = !mTransmitRing.empty();
+    if (backedUp != !!(mEventFlags & EPOLLOUT)) {
+        mEventFlags ^= EPOLLOUT;
         reloadEventLoop();
-    });
+    }
 
-    return true;
+    // with some hysteresis, so CTS doesn't follow every character
+    size_t backlog = mTransmitRing.size();
+    if (device.transmitBlocked ? backlog <= TransmitLowWater : backlog >= TransmitHighWater) {
+        device.transmitBlocked = !device.transmitBlocked;
+        LOG_INFO("transmit " << (device.transmitBlocked ? "blocked" : "unblocked"));
+        updateModemStatus();
+    }
 }
 
-void Serial16450::stop() {
-    std::unique_lock<std::mutex> lock(mMutex);
+// a connection raises DCD and DSR, CTS follows the transmit backlog. in loopback the modem
+// control outputs drive the lines instead. report sets the delta bits, which raise the modem
+// status interrupt. requires mMutex
+void Serial16450::updateModemStatus(bool report)
+{
+    uint8_t lines = 0;
+    if (device.modemControl & 0x10 /* loopback */) {
+        lines = loopbackModemStatus(device.modemControl);
+    } else if (!fds.clients.empty() || mBackend->alwaysConnected()) {
+        lines = 0xa0 /* DCD, DSR */ | (device.transmitBlocked ? 0x00 : 0x10 /* CTS */);
+    }
 
-    for (int fd : fds.clients) {
-        mEventLoop.removeEvent(fd);
-        close(fd);
+    uint8_t previous = device.status.modemStatus;
+    uint8_t changed = (previous ^ lines) & 0xf0;
+    if (!changed) {
+        return;
     }
-    fds.clients.clear();
 
-    if (fds.server != -1) {
-        mEventLoop.removeEvent(fds.server);
-        close(fds.server);
-        fds.server = -1;
+    // RI only reports its trailing edge
+    uint8_t deltas = 0;
+    if (report) {
+        deltas = (changed >> 4) & 0x0b;
+        if (changed & previous & 0x40) {
+            deltas |= 0x04;
+        }
+    }
+
+    device.status.modemStatus = lines | (previous & 0x0f) | deltas;
+    updateInterrupt();
+}
+
+// time to shift one character (10 bits) at the programmed baud rate, in ns. 0 if unpaced
+uint64_t Serial16450::characterTime() const
+{
+    switch (mPacing) {
+        case Pacing::Off:
+            return 0;
+        case Pacing::Scaled:
+            return (1600000000ULL * device.divisor) / (18432ULL * mPacingScale);
+        case Pacing::Accurate:
+            break;
     }
+    return (1600000000ULL * device.divisor) / 18432ULL;
+}
+
+// an enabled condition the interrupt identification register would report
+bool Serial16450::interruptPending() const
+{
+    return (device.readInterruptEnabled && device.status.readInterruptFlag)
+            || (device.writeInterruptEnabled && device.status.writeInterruptFlag)
+            || (device.modemInterruptEnabled && (device.status.modemStatus & 0x0f));
+}
 
-    if (fds.vm != -1 && fds.irq != -1) {
-        struct kvm_irqfd irqfd {
-            .fd = (__u32) fds.irq,
-            .gsi = mGSI,
-            .flags = KVM_IRQFD_FLAG_DEASSIGN,
-            .resamplefd = (__u32) fds.refresh
-        };
-        ioctl(fds.vm, KVM_IRQFD, &irqfd);
-        close(fds.irq);
-        close(fds.refresh);
+// publishes the status and drives the irq line from it, the guest's handler must see the
+// condition that raised the interrupt. requires mMutex
+void Serial16450::updateInterrupt()
+{
+    mStatus.store(device.status);
+    DeviceActivity::notify();
+    mInterrupt.set(interruptPending());
+}
+
+// vcpu thread. the event loop is only woken if it isn't already about to drain the queue. a full
+// queue drops the access, like the overrun of a real uart
+void Serial16450::postCommand(Command type, uint16_t value, uint64_t* ticket)
+{
+    uint64_t position;
+    if (!mCommands.push(DeviceCommand{type, value, EventLoop::now()}, position)) {
+        LOG_ERROR("command queue overrun");
+        return;
+    }
+    if (ticket) {
+        *ticket = position;
     }
 
-    close(fds.readTimer);
-    close(fds.writeTimer);
+    if (!mCommandsPending.exchange(true, std::memory_order_acq_rel)) {
+        uint64_t data = 1;
+        write(fds.command, &data, sizeof data);
+    }
 }
 
-void Serial16450::handleClientEvent(int fd, uint32_t events)
+// event loop thread, requires mMutex
+void Serial16450::applyCommands()
 {
-    std::unique_lock<std::mutex> lock(mMutex);
-    if (events & EPOLLIN) { 
-        registers.readable = true;
-        registers.readInterruptFlag = true;
-        mEventFlags &= ~EPOLLIN;
-        if (registers.readInterruptEnabled) {
-            // can't fire a new interrupt unless there aren't any pending
-            if (!registers.writeInterruptEnabled || !registers.writeInterruptFlag) {
-                LOG_INFO("triggering interrupt (read condition)");
-                triggerInterrupt();
-            }
+    DeviceCommand command;
+    uint64_t position;
+    while (mCommands.pop(command, position)) {
+        // a status published while applying the command (by raising an interrupt) includes it
+        device.status.applied = position;
+        switch (command.type) {
+            case Command::Transmit:
+                if (device.modemControl & 0x10 /* loopback */) {
+                    mReceiveRing.push(command.value);
+                    deliverReceived();
+                } else if (!mRs485 || (device.modemControl & 0x02)) {
+                    // a half duplex port only puts the character on the line with RTS set
+                    mTransmitRing.push(command.value);
+                }
+                device.status.writable = false;
+                device.status.writeInterruptFlag = false;
+
+                // the holding register is empty again once the character is out
+                mEventLoop.cancelTimer(mWriteTimer);
+                mWriteTimer = EventLoop::NoTimer;
+                if (!characterTime()) {
+                    transmitterEmpty();
+                    break;
+                }
+                mWriteTimer = mEventLoop.addTimer(command.time + characterTime(), [this] {
+                    std::unique_lock<std::mutex> lock(mMutex);
+                    mWriteTimer = EventLoop::NoTimer;
+                    transmitterEmpty();
+                });
+                break;
+            case Command::ReceiveTaken:
+                device.status.readable = false;
+                device.status.readInterruptFlag = false;
+
+                // the next character arrives a character time later
+                mEventLoop.cancelTimer(mReadTimer);
+                mReadTimer = EventLoop::NoTimer;
+                if (!characterTime()) {
+                    deliverReceived();
+                    break;
+                }
+                mReadTimer = mEventLoop.addTimer(command.time + characterTime(), [this] {
+                    std::unique_lock<std::mutex> lock(mMutex);
+                    mReadTimer = EventLoop::NoTimer;
+                    deliverReceived();
+                });
+                break;
+            case Command::TransmitInterruptTaken:
+                device.status.writeInterruptFlag = false;
+                break;
+            case Command::InterruptControl:
+                applyInterruptControl(command.value);
+                break;
+            case Command::Divisor:
+                device.divisor = command.value;
+                break;
+            case Command::ModemControl:
+                applyModemControl(command.value);
+                break;
+            case Command::ModemStatusTaken:
+                // only the changes the guest saw, later ones are still to be reported
+                device.status.modemStatus &= ~command.value;
+                break;
         }
     }
-    if (events & EPOLLOUT) {
-        registers.writable = true;
-        registers.writeInterruptFlag = true;
-        mEventFlags &= ~EPOLLOUT;
-        if (registers.writeInterruptEnabled) {
-            // can't fire a new interrupt unless there aren't any pending
-            if (!registers.readInterruptEnabled || !registers.readInterruptFlag) {
-                LOG_INFO("triggering interrupt (write ready condition)");
-                triggerInterrupt();
-            }
+    flushTransmit();
+    updateInterrupt();
+}
+
+void Serial16450::applyInterruptControl(uint8_t interruptControl)
+{
+    device.readInterruptEnabled = !!(interruptControl & 0x01);
+    device.writeInterruptEnabled = !!(interruptControl & 0x02);
+    device.modemInterruptEnabled = !!(interruptControl & 0x08);
+    LOG_INFO("interrupt control: read: " << device.readInterruptEnabled << ", write: " << device.writeInterruptEnabled << ", modem: " << device.modemInterruptEnabled);
+
+    // if a particular interrupt was re-enabled, set the flag if the condition is met
+    if (device.readInterruptEnabled) {
+        device.status.readInterruptFlag = device.status.readable;
+    }
+    if (device.writeInterruptEnabled) {
+        device.status.writeInterruptFlag = device.status.writable;
+    }
+}
+
+void Serial16450::applyModemControl(uint8_t modemControl)
+{
+    uint8_t previous = device.modemControl;
+    device.modemControl = modemControl;
+
+    // a half duplex port listens again once the driver is off
+    if (mRs485 && (previous & 0x02) && !(modemControl & 0x02)) {
+        deliverReceived();
+    }
+    updateModemStatus();
+}
+
+// the published status with the effects of the vcpu's own queued accesses applied
+Serial16450::Status Serial16450::guestStatus() const
+{
+    Status status = mStatus.load();
+    if (status.applied < tickets.transmit) {
+        // unpaced, the holding register is always empty unless the queue backs up
+        if (mPacing != Pacing::Off || tickets.transmit - status.applied >= CommandBacklog) {
+            status.writable = false;
         }
+        status.writeInterruptFlag = false;
+    }
+    if (status.applied < tickets.receive) {
+        status.readable = false;
+        status.readInterruptFlag = false;
+    }
+    if (status.applied < tickets.interruptStatus) {
+        status.writeInterruptFlag = false;
     }
+    if (status.applied < tickets.modemStatus) {
+        status.modemStatus &= 0xf0;
+    }
+    return status;
+}
 
-    // update our listen status
-    mEventLoop.modifyEvent(fd, mEventFlags);
+void Serial16450::setPacing(Pacing pacing, unsigned scale)
+{
+    mPacing = pacing;
+    mPacingScale = scale ? scale : 1;
 }
 
-void Serial16450::reloadEventLoop()
+bool Serial16450::parsePacing(const char* spec, Pacing& pacing, unsigned& scale)
 {
-    for (int fd : fds.clients) {
-        mEventLoop.modifyEvent(fd, mEventFlags);
+    if (!strcmp(spec, "off")) {
+        pacing = Pacing::Off;
+        scale = 1;
+        return true;
+    }
+    if (!strcmp(spec, "accurate")) {
+        pacing = Pacing::Accurate;
+        scale = 1;
+        return true;
     }
+
+    char* end;
+    unsigned long value = strtoul(spec, &end, 10);
+    if (*end || !value || value > 1000000) {
+        return false;
+    }
+    pacing = (value == 1) ? Pacing::Accurate : Pacing::Scaled;
+    scale = value;
+    return true;
 }
 
-void Serial16450::triggerInterrupt()
+void Serial16450::setRs485(bool enable)
 {
-    uint64_t data = 1;
-    write(fds.irq, &data, sizeof data);
+    mRs485 = enable;
 }
 
-void Serial16450::iowrite8(uint16_t address, uint8_t data)
+void Serial16450::setDma(std::shared_ptr<i386EXDMAController> dma,
+        i386EXDMAController::Request receive, i386EXDMAController::Request transmit)
 {
-    std::unique_lock<std::mutex> lock(mMutex);
+    mDma = std::move(dma);
+    mDmaReceive = receive;
+    mDmaTransmit = transmit;
+}
 
+void Serial16450::iowrite8(uint16_t address, uint8_t data)
+{
     // 16450 uart occupies 8 bytes of address space
     Register r = static_cast<Register>(address & 0x7);
     switch (r) {
         case Register::Data_DivisorLowByte:
             if (!(registers.lineControl & 0x80) /* DLAB bit */) {
-                for (int fd : fds.clients) {
-                    write(fd, &data, 1);
-                }
-                registers.writable = false;
-                registers.writeInterruptFlag = false;
-
-                // trigger reload timer
-                time_t delay = (1600000000ULL * registers.divisor) / 18432ULL;
-                struct itimerspec timeout {
-                    .it_interval = {},
-                    .it_value = { .tv_sec = 0, .tv_nsec = delay }
-                };
-                timerfd_settime(fds.writeTimer, 0, &timeout, nullptr);
+                postCommand(Command::Transmit, data, &tickets.transmit);
             } else {
                 reinterpret_cast<uint8_t*>(&registers.divisor)[0] = data;
+                postCommand(Command::Divisor, registers.divisor);
             }
             break;
         case Register::InterruptControl_DivisorHighByte:
             if (!(registers.lineControl & 0x80) /* DLAB bit */) {
-                bool pReadInterruptEnabled = registers.readInterruptEnabled;
-                bool pWriteInterruptEnabled = registers.writeInterruptEnabled;
                 registers.interruptControl = data & 0x0f;
                 registers.readInterruptEnabled = !!(registers.interruptControl & 0x01);
                 registers.writeInterruptEnabled = !!(registers.interruptControl & 0x02);
-                LOG_INFO("interrupt control: read: " << registers.readInterruptEnabled << ", write: " << registers.writeInterruptEnabled);
-
-                // if a particular interrupt was re-enabled, set the flag if the condition is met
-                if (registers.readInterruptEnabled) {
-                    registers.readInterruptFlag = registers.readable;
-                }
-                if (registers.writeInterruptEnabled) {
-                    registers.writeInterruptFlag = registers.writable;
-                }
-
-                // trigger interrupt is a new interrupt condition has occurred and we weren't in
-                // an interrupt cycle previously
-                if ((!pReadInterruptEnabled || !registers.readInterruptFlag)
-                        && (!pWriteInterruptEnabled || !registers.writeInterruptFlag)) {
-                    if ((registers.readInterruptEnabled && registers.readInterruptFlag)
-                            || (registers.writeInterruptEnabled && registers.writeInterruptFlag)) {
-                        LOG_INFO("triggering interrupt (pending before control register write condition)")
-                        triggerInterrupt();
-                    }
-                }
+                registers.modemInterruptEnabled = !!(registers.interruptControl & 0x08);
+                postCommand(Command::InterruptControl, registers.interruptControl);
             } else {
                 reinterpret_cast<uint8_t*>(&registers.divisor)[1] = data;
+                postCommand(Command::Divisor, registers.divisor);
             }
             break;
         case Register::InterruptStatus_FifoControl:
@@ -325,6 +672,7 @@ void Serial16450::iowrite8(uint16_t address, uint8_t data)
             break;
         case Register::ModemControl:
             registers.modemControl = data & 0x1F;
+            postCommand(Command::ModemControl, registers.modemControl);
             break;
         case Register::LineStatus:
             // line status register isn't writable
@@ -340,30 +688,14 @@ void Serial16450::iowrite8(uint16_t address, uint8_t data)
 
 uint8_t Serial16450::ioread8(uint16_t address)
 {
-    std::unique_lock<std::mutex> lock(mMutex);
-
     // 16450 uart occupies 8 bytes of address space
     Register r = static_cast<Register>(address & 0x7);
     switch (r) {
         case Register::Data_DivisorLowByte:
             if (!(registers.lineControl & 0x80) /* DLAB bit */) {
-                for (int fd : fds.clients) {
-                    int n = read(fd, &registers.receive, 1);
-                    if (n == 1) {
-                        break;
-                    }
-                }
-                registers.readable = false;
-                registers.readInterruptFlag = false;
-
-                // trigger reload timer
-                time_t delay = (1600000000ULL * registers.divisor) / 18432ULL;
-                struct itimerspec timeout {
-                    .it_interval = {},
-                    .it_value = { .tv_sec = 0, .tv_nsec = delay }
-                };
-                timerfd_settime(fds.readTimer, 0, &timeout, nullptr);
-                return registers.receive;
+                Status status = guestStatus();
+                postCommand(Command::ReceiveTaken, 0, &tickets.receive);
+                return status.receive;
             }
             return reinterpret_cast<uint8_t*>(&registers.divisor)[0];
         case Register::InterruptControl_DivisorHighByte:
@@ -371,31 +703,61 @@ uint8_t Serial16450::ioread8(uint16_t address)
                 return registers.interruptControl;
             }
             return reinterpret_cast<uint8_t*>(&registers.divisor)[1];
-        case Register::InterruptStatus_FifoControl:
-            if (registers.readInterruptEnabled && registers.readInterruptFlag) {
+        case Register::InterruptStatus_FifoControl: {
+            Status status = guestStatus();
+            if (registers.readInterruptEnabled && status.readInterruptFlag) {
                 return 0x04;
             }
-            if (registers.writeInterruptEnabled && registers.writeInterruptFlag) {
+            if (registers.writeInterruptEnabled && status.writeInterruptFlag) {
                 // reading the interrupt status register clears the write interrupt condition
                 // TODO: is the 16450 uart like the AVR uart where the txready signal *always*
                 //       generates an interrupt? or does "clearing" the condition really cause
                 //       it to stop generating the txready interrupt?
-                registers.writeInterruptFlag = false;
+                postCommand(Command::TransmitInterruptTaken, 0, &tickets.interruptStatus);
                 return 0x02;
             }
+            if (registers.modemInterruptEnabled && (status.modemStatus & 0x0f)) {
+                return 0x00;
+            }
             // no interrupt
             return 0x01;
+        }
         case Register::LineControl:
             return registers.lineControl;
         case Register::ModemControl:
             return registers.modemControl;
-        case Register::LineStatus:
-            return (registers.writable ? 0x60 : 0x00) | (registers.readable ? 0x01 : 0x00);
-        case Register::ModemStatus:
-            // modem status register: we don't implement modem controls
-            return 0;
+        case Register::LineStatus: {
+            Status status = guestStatus();
+            return (status.writable ? 0x60 : 0x00) | (status.readable ? 0x01 : 0x00);
+        }
+        case Register::ModemStatus: {
+            Status status = guestStatus();
+            uint8_t modemStatus = status.modemStatus;
+            // loopback reads back the guest's own outputs without waiting for the event loop
+            if (registers.modemControl & 0x10) {
+                modemStatus = (modemStatus & 0x0f) | loopbackModemStatus(registers.modemControl);
+            }
+            // reading clears the deltas
+            if (modemStatus & 0x0f) {
+                postCommand(Command::ModemStatusTaken, modemStatus & 0x0f, &tickets.modemStatus);
+            }
+            return modemStatus;
+        }
         case Register::Scratchpad:
             return registers.scratchpad;
     }
     return 0xff;
-}
\ No newline at end of file
+}
+
+// the status registers only change when the event loop publishes a new status
+uint64_t Serial16450::pollTimeout(uint16_t address)
+{
+    switch (static_cast<Register>(address & 0x7)) {
+        case Register::InterruptStatus_FifoControl:
+        case Register::LineStatus:
+        case Register::ModemStatus:
+            return UINT64_MAX;
+        default:
+            return 0;
+    }
+}
@@ -2,18 +2,44 @@
 #define SERIAL_HPP_
 
 #include "DevicePio.hpp"
+#include "InterruptLine.hpp"
+#include "SerialBackend.hpp"
+#include "i386EXDMAController.hpp"
+#include "../ByteRing.hpp"
 #include "../EventLoop.hpp"
+#include "../MpscQueue.hpp"
+#include "../SeqLock.hpp"
 
+#include <atomic>
+#include <map>
+#include <memory>
 #include <mutex>
-#include <set>
 #include <string>
 #include <thread>
 #include <vector>
 
-// maps a serial port to a unix socket
+// maps a serial port to a host backend (unix or tcp socket, pty, file, null)
+//
+// the vcpu never takes the device mutex. register writes and the side effects of register reads
+// are queued as commands for the event loop thread, and the line and interrupt status is read
+// from a snapshot the event loop thread publishes.
+//
+// a port that is one of the 386EX's SIOs can have its receiver and transmitter served by a DMA
+// channel. received characters then go to memory instead of the receive buffer register, and the
+// transmitter is fed from memory, paced like the guest's own accesses (all at once unpaced).
 
 class Serial16450 : public DevicePio
 {
+public:
+    // how the port follows its baud rate. unpaced, the holding register is always empty and
+    // received bytes are handed over as fast as the guest reads them
+    enum class Pacing {
+        Off,
+        Scaled,
+        Accurate
+    };
+
+private:
     enum class Register : uint16_t {
         Data_DivisorLowByte = 0,
         InterruptControl_DivisorHighByte = 1,
@@ -25,44 +51,130 @@ class Serial16450 : public DevicePio
         Scratchpad = 7
     };
 
+    enum class Command : uint8_t {
+        Transmit,
+        ReceiveTaken,
+        TransmitInterruptTaken,
+        InterruptControl,
+        Divisor,
+        ModemControl,
+        ModemStatusTaken
+    };
+
+    struct DeviceCommand {
+        Command type;
+        uint16_t value;
+        // when the guest made the access, pacing counts from there rather than from when the
+        // event loop got to it
+        uint64_t time;
+    };
+
+    // state owned by the event loop thread, the vcpu sees it through mStatus
+    struct Status {
+        // position of the last command applied
+        uint64_t applied;
+        uint8_t receive;
+        bool readable;
+        bool writable;
+        bool readInterruptFlag;
+        bool writeInterruptFlag;
+        // line state in the upper nibble, changes since the guest last read it in the lower
+        uint8_t modemStatus;
+    };
+
     EventLoop mEventLoop;
-    std::string mSocketName;
+    std::string mName;
+    std::unique_ptr<SerialBackend> mBackend;
     std::mutex mMutex;
-    uint32_t mGSI;
+    InterruptLine mInterrupt;
+    Pacing mPacing;
+    unsigned mPacingScale;
+    bool mRs485;
     int mEventFlags;
 
     struct __descriptors {
-        std::set<int> clients;
-        int server;
-        int vm;
-        int irq;
-        int refresh;
-        int readTimer;
-        int writeTimer;
-        __descriptors() : clients{}, server(-1), vm(-1), irq(-1), refresh(-1),
-                readTimer(-1), writeTimer(-1) {}
+        // connections of the backend, true if they also deliver input
+        std::map<int, bool> clients;
+        int command;
+        __descriptors() : clients{}, command(-1) {}
     } fds;
 
+    // the DMA request lines of an SIO
+    std::shared_ptr<i386EXDMAController> mDma;
+    i386EXDMAController::Request mDmaReceive;
+    i386EXDMAController::Request mDmaTransmit;
+
+    // one shot timers on the event loop pacing the port to its baud rate
+    EventLoop::TimerId mReadTimer;
+    EventLoop::TimerId mWriteTimer;
+
+    // event loop side, guarded by mMutex
+    struct {
+        Status status;
+        uint16_t divisor;
+        uint8_t modemControl;
+        bool readInterruptEnabled;
+        bool writeInterruptEnabled;
+        bool modemInterruptEnabled;
+        // output the connections didn't take yet is over the high water mark, CTS is dropped
+        bool transmitBlocked;
+    } device;
+
+    // host side buffers, moved to and from the connections in batches
+    ByteRing<4096> mReceiveRing;
+    ByteRing<4096> mTransmitRing;
+    // output backlog at which CTS drops, and rises again
+    static constexpr size_t TransmitHighWater = 3072;
+    static constexpr size_t TransmitLowWater = 1024;
+
+    static constexpr size_t CommandCapacity = 256;
+    // unpaced, outstanding writes at which THRE reads as busy, so a polling guest can't overrun
+    // the queue
+    static constexpr uint64_t CommandBacklog = CommandCapacity / 2;
+    MpscQueue<DeviceCommand, CommandCapacity> mCommands;
+    std::atomic<bool> mCommandsPending;
+    SeqLock<Status> mStatus;
+
+    // vcpu side. registers only the guest writes live here, the tickets are the queue positions
+    // of the last commands whose effect the published status may not show yet
     struct {
-        // direct registers
-        uint8_t receive;
         uint16_t divisor;
         uint8_t interruptControl;
         uint8_t lineControl;
         uint8_t modemControl;
         uint8_t scratchpad;
-        // used to construct other registers
-        bool readable;
-        bool writable;
-        bool readInterruptFlag;
-        bool writeInterruptFlag;
         bool readInterruptEnabled;
         bool writeInterruptEnabled;
+        bool modemInterruptEnabled;
     } registers;
 
+    struct {
+        uint64_t transmit;
+        uint64_t receive;
+        uint64_t interruptStatus;
+        uint64_t modemStatus;
+    } tickets;
+
+    void postCommand(Command type, uint16_t value, uint64_t* ticket = nullptr);
+    void applyCommands();
+    void applyInterruptControl(uint8_t interruptControl);
+    void applyModemControl(uint8_t modemControl);
+    Status guestStatus() const;
+
+    void addClient(int fd, bool input);
     void handleClientEvent(int clientFd, uint32_t events);
+    void removeClient(int fd);
+    void deliverReceived();
+    bool transferReceived();
+    void transmitterEmpty();
+    bool transferTransmit();
+    void dmaArmed();
+    void flushTransmit();
+    void updateModemStatus(bool report = true);
     void reloadEventLoop();
-    void triggerInterrupt();
+    bool interruptPending() const;
+    void updateInterrupt();
+    uint64_t characterTime() const;
 
 public:
     Serial16450(const EventLoop& eventLoop);
@@ -74,12 +186,30 @@ public:
     Serial16450& operator=(const Serial16450&) = delete;
     Serial16450& operator=(Serial16450&& port) = delete;
 
-    bool start(const std::string& socketName, int vmFd, uint32_t gsi);
+    // scale speeds a Scaled port up by that factor. must be set before start()
+    void setPacing(Pacing pacing, unsigned scale = 1);
+
+    // parse "off", "accurate" or a speed up factor, returns false on a malformed string
+    static bool parsePacing(const char* spec, Pacing& pacing, unsigned& scale);
+
+    // half duplex line through a MAX485, RTS enables the driver and disables the receiver.
+    // must be set before start()
+    void setRs485(bool enable);
+
+    // serve the receiver and the transmitter from the channels DMACFG routes the lines to. must
+    // be set before start()
+    void setDma(std::shared_ptr<i386EXDMAController> dma, i386EXDMAController::Request receive,
+            i386EXDMAController::Request transmit);
+
+    bool start(std::unique_ptr<SerialBackend> backend, int vmFd, uint32_t gsi);
     void stop();
 
+    const std::string& name() const { return mName; }
+
     // DevicePio implementation
     void iowrite8(uint16_t address, uint8_t value) override;
     uint8_t ioread8(uint16_t address) override;
+    uint64_t pollTimeout(uint16_t address) override;
 };
 
 #endif /* SERIAL_HPP_ */
\ No newline at end of file
@@ -0,0 +1,382 @@
+#include "SerialBackend.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define LOG_ERROR(fmt) { \
+    std::cerr << "[ERROR] [serial \"" << mName << "\"]: "<< fmt << std::endl; \
+};
+
+namespace
+{
+    // accepts clients on a listening socket
+    class ListeningBackend : public SerialBackend
+    {
+    protected:
+        // a copy of the port's loop, dropping it removes the accept handler
+        std::unique_ptr<EventLoop> mEventLoop;
+        int mServer;
+
+        virtual void configure(int fd) {}
+
+        bool acceptClients(EventLoop& eventLoop, ConnectHandler connect) {
+            if (::listen(mServer, 1) == -1) {
+                LOG_ERROR("unable to listen: " << strerror(errno));
+                return false;
+            }
+
+            mEventLoop.reset(new EventLoop(eventLoop));
+            return mEventLoop->addEvent(mServer, EPOLLIN, [this, connect] (uint32_t events) {
+                if (events & EPOLLERR) {
+                    LOG_ERROR("error occurred with server socket.");
+                    return;
+                }
+
+                // client writes happen on the event loop thread, they must not block it
+                int fd = accept4(mServer, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd == -1) {
+                    LOG_ERROR("failed to accept client connection.");
+                    return;
+                }
+                configure(fd);
+                connect(fd, true);
+            });
+        }
+
+    public:
+        ListeningBackend(const std::string& name) : SerialBackend(name), mEventLoop{},
+                mServer(-1) {}
+
+        ~ListeningBackend() {
+            close();
+        }
+
+        void close() override {
+            mEventLoop.reset();
+            if (mServer != -1) {
+                ::close(mServer);
+                mServer = -1;
+            }
+        }
+
+        // a client that went away must not raise SIGPIPE
+        ssize_t transmit(int fd, const struct iovec* iov, int count) override {
+            struct msghdr message {};
+            message.msg_iov = const_cast<struct iovec*>(iov);
+            message.msg_iovlen = count;
+            return sendmsg(fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+    };
+
+    class UnixSocketBackend : public ListeningBackend
+    {
+        std::string mPath;
+
+    public:
+        UnixSocketBackend(const std::string& path) : ListeningBackend("unix:" + path),
+                mPath(path) {}
+
+        bool open(EventLoop& eventLoop, ConnectHandler connect) override {
+            struct sockaddr_un addr;
+            memset(&addr, 0, sizeof addr);
+            addr.sun_family = AF_UNIX;
+            if (mPath.size() >= sizeof addr.sun_path) {
+                LOG_ERROR("socket path too long.");
+                return false;
+            }
+            strcpy(addr.sun_path, mPath.c_str());
+            unlink(addr.sun_path);
+
+            mServer = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (mServer == -1) {
+                LOG_ERROR("failed to create unix socket.");
+                return false;
+            }
+
+            if (bind(mServer, (struct sockaddr*) &addr, sizeof addr) == -1) {
+                LOG_ERROR("unable to bind unix socket server.");
+                return false;
+            }
+            return acceptClients(eventLoop, connect);
+        }
+    };
+
+    // raw tcp, no telnet negotiation
+    class TcpBackend : public ListeningBackend
+    {
+        std::string mHost;
+        std::string mPort;
+
+        void configure(int fd) override {
+            int enable = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof enable);
+        }
+
+    public:
+        TcpBackend(const std::string& host, const std::string& port)
+                : ListeningBackend("tcp:" + host + ":" + port), mHost(host), mPort(port) {}
+
+        bool open(EventLoop& eventLoop, ConnectHandler connect) override {
+            struct addrinfo hints {};
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = AI_PASSIVE;
+            struct addrinfo* addresses;
+            int error = getaddrinfo(mHost.c_str(), mPort.c_str(), &hints, &addresses);
+            if (error) {
+                LOG_ERROR("unable to resolve address: " << gai_strerror(error));
+                return false;
+            }
+
+            for (struct addrinfo* address = addresses; address; address = address->ai_next) {
+                mServer = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC,
+                        address->ai_protocol);
+                if (mServer == -1) {
+                    continue;
+                }
+
+                int enable = 1;
+                setsockopt(mServer, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof enable);
+                if (!bind(mServer, address->ai_addr, address->ai_addrlen)) {
+                    break;
+                }
+                ::close(mServer);
+                mServer = -1;
+            }
+            freeaddrinfo(addresses);
+
+            if (mServer == -1) {
+                LOG_ERROR("unable to bind tcp socket server.");
+                return false;
+            }
+            return acceptClients(eventLoop, connect);
+        }
+    };
+
+    // pseudo terminal, programs like minicom open the slave side
+    class PtyBackend : public SerialBackend
+    {
+        int mSlave;
+
+    public:
+        PtyBackend() : SerialBackend("pty"), mSlave(-1) {}
+
+        ~PtyBackend() {
+            close();
+        }
+
+        bool open(EventLoop& eventLoop, ConnectHandler connect) override {
+            int master = posix_openpt(O_RDWR | O_NOCTTY);
+            if (master == -1) {
+                LOG_ERROR("unable to open a pseudo terminal.");
+                return false;
+            }
+            fcntl(master, F_SETFD, FD_CLOEXEC);
+            fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+
+            char path[64];
+            if (grantpt(master) == -1 || unlockpt(master) == -1
+                    || ptsname_r(master, path, sizeof path)) {
+                LOG_ERROR("unable to unlock the pseudo terminal.");
+                ::close(master);
+                return false;
+            }
+
+            // keep the slave open, otherwise the master reports a hangup until a program opens
+            // it. raw mode, so the line discipline passes bytes through unchanged
+            mSlave = ::open(path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+            if (mSlave == -1) {
+                LOG_ERROR("unable to open " << path);
+                ::close(master);
+                return false;
+            }
+            struct termios attributes;
+            if (!tcgetattr(mSlave, &attributes)) {
+                cfmakeraw(&attributes);
+                tcsetattr(mSlave, TCSANOW, &attributes);
+            }
+
+            mName = std::string("pty:") + path;
+            connect(master, true);
+            return true;
+        }
+
+        void close() override {
+            if (mSlave != -1) {
+                ::close(mSlave);
+                mSlave = -1;
+            }
+        }
+    };
+
+    // guest output only, written to a file
+    class FileBackend : public SerialBackend
+    {
+        std::string mPath;
+        int mPipe[2];
+
+    public:
+        FileBackend(const std::string& path) : SerialBackend("file:" + path), mPath(path),
+                mPipe{-1, -1} {}
+
+        ~FileBackend() {
+            close();
+        }
+
+        bool open(EventLoop& eventLoop, ConnectHandler connect) override {
+            // splice doesn't write to files opened for appending
+            int fd = ::open(mPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd == -1) {
+                LOG_ERROR("unable to open " << mPath << ": " << strerror(errno));
+                return false;
+            }
+            if (pipe2(mPipe, O_CLOEXEC) == -1) {
+                LOG_ERROR("unable to create pipe.");
+                ::close(fd);
+                return false;
+            }
+            connect(fd, false);
+            return true;
+        }
+
+        void close() override {
+            for (int& fd : mPipe) {
+                if (fd != -1) {
+                    ::close(fd);
+                    fd = -1;
+                }
+            }
+        }
+
+        // the ring is mapped into the pipe and its pages moved to the file, no userspace copy.
+        // the pipe refers to the ring's memory, so it is always drained before returning
+        ssize_t transmit(int fd, const struct iovec* iov, int count) override {
+            ssize_t queued = vmsplice(mPipe[1], iov, count, 0);
+            if (queued <= 0) {
+                return queued;
+            }
+
+            ssize_t moved = 0;
+            while (moved < queued) {
+                ssize_t n = splice(mPipe[0], nullptr, fd, nullptr, queued - moved, SPLICE_F_MOVE);
+                if (n <= 0) {
+                    LOG_ERROR("unable to write capture: " << strerror(errno));
+                    uint8_t discard[256];
+                    while (moved < queued) {
+                        n = read(mPipe[0], discard, std::min<size_t>(sizeof discard, queued - moved));
+                        if (n <= 0) {
+                            break;
+                        }
+                        moved += n;
+                    }
+                    return -1;
+                }
+                moved += n;
+            }
+            return moved;
+        }
+    };
+
+    // discards guest output and never has input
+    class NullBackend : public SerialBackend
+    {
+    public:
+        NullBackend() : SerialBackend("null") {}
+
+        bool open(EventLoop& eventLoop, ConnectHandler connect) override {
+            return true;
+        }
+
+        void close() override {}
+
+        bool alwaysConnected() const override {
+            return true;
+        }
+    };
+} /* anonymous */
+
+std::unique_ptr<SerialBackend> SerialBackend::create(const std::string& spec)
+{
+    if (!spec.compare(0, 5, "unix:") && spec.size() > 5) {
+        return std::unique_ptr<SerialBackend>(new UnixSocketBackend(spec.substr(5)));
+    }
+    if (!spec.compare(0, 4, "tcp:") && spec.size() > 4) {
+        std::string address = spec.substr(4);
+        size_t colon = address.rfind(':');
+        std::string host = (colon == std::string::npos) ? "127.0.0.1" : address.substr(0, colon);
+        std::string port = (colon == std::string::npos) ? address : address.substr(colon + 1);
+        // [::1]:PORT for ipv6 addresses
+        if (host.size() > 1 && host.front() == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2);
+        }
+        if (host.empty() || port.empty()) {
+            return nullptr;
+        }
+        return std::unique_ptr<SerialBackend>(new TcpBackend(host, port));
+    }
+    if (spec == "pty") {
+        return std::unique_ptr<SerialBackend>(new PtyBackend());
+    }
+    if (!spec.compare(0, 5, "file:") && spec.size() > 5) {
+        return std::unique_ptr<SerialBackend>(new FileBackend(spec.substr(5)));
+    }
+    if (spec == "null") {
+        return std::unique_ptr<SerialBackend>(new NullBackend());
+    }
+    return nullptr;
+}
+
+bool SerialBackend::sendDescriptors(int socket, char tag, const int* fds, size_t count)
+{
+    constexpr size_t MaxDescriptors = 8;
+    if (count > MaxDescriptors) {
+        errno = EINVAL;
+        return false;
+    }
+
+    alignas(struct cmsghdr) char control[CMSG_SPACE(MaxDescriptors * sizeof(int))] = {};
+    struct iovec iov = { &tag, sizeof tag };
+    struct msghdr message {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(count * sizeof(int));
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(header), fds, count * sizeof(int));
+    return sendmsg(socket, &message, MSG_NOSIGNAL) == sizeof tag;
+}
+
+bool SerialBackend::watchHangup(EventLoop& eventLoop, int socket, std::function<void()> hangup)
+{
+    return eventLoop.addEvent(socket, EPOLLIN, [socket, hangup] (uint32_t events) {
+        char discard[64];
+        ssize_t n = recv(socket, discard, sizeof discard, MSG_DONTWAIT);
+        if (n == 0 || (n == -1 && errno != EAGAIN)) {
+            hangup();
+        }
+    });
+}
+
+ssize_t SerialBackend::receive(int fd, const struct iovec* iov, int count)
+{
+    return readv(fd, iov, count);
+}
+
+ssize_t SerialBackend::transmit(int fd, const struct iovec* iov, int count)
+{
+    return writev(fd, iov, count);
+}
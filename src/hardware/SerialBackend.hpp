@@ -0,0 +1,59 @@
+#ifndef SERIALBACKEND_HPP_
+#define SERIALBACKEND_HPP_
+
+#include "../EventLoop.hpp"
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// host side of a serial port. a backend hands the port connections, descriptors the port reads
+// guest input from and writes guest output to. the port owns (and closes) the connections, the
+// backend owns whatever produces them. listening backends accept any number of clients, the
+// others open a single connection that lasts as long as the port.
+
+class SerialBackend
+{
+protected:
+    std::string mName;
+
+public:
+    // input is false for connections that only take guest output
+    using ConnectHandler = std::function<void(int fd, bool input)>;
+
+    SerialBackend(const std::string& name) : mName(name) {}
+    SerialBackend(const SerialBackend&) = delete;
+    SerialBackend(SerialBackend&&) = delete;
+
+    virtual ~SerialBackend() = default;
+
+    SerialBackend& operator=(const SerialBackend&) = delete;
+    SerialBackend& operator=(SerialBackend&&) = delete;
+
+    // "unix:PATH", "tcp:[HOST:]PORT", "pty", "file:PATH" or "null". nullptr if malformed
+    static std::unique_ptr<SerialBackend> create(const std::string& spec);
+
+    // shared memory peers on unix socket connections: the tag byte goes out with the descriptors
+    // attached (SCM_RIGHTS), false with errno set if it didn't. afterwards the peer only has to
+    // be watched for hanging up, whatever it sends is discarded
+    static bool sendDescriptors(int socket, char tag, const int* fds, size_t count);
+    static bool watchHangup(EventLoop& eventLoop, int socket, std::function<void()> hangup);
+
+    const std::string& name() const { return mName; }
+
+    // connections of listening backends are reported on the event loop thread
+    virtual bool open(EventLoop& eventLoop, ConnectHandler connect) = 0;
+    virtual void close() = 0;
+
+    // a port without connections holds its output, unless the backend is a sink
+    virtual bool alwaysConnected() const { return false; }
+
+    // batched data path, readv and writev unless the backend knows better
+    virtual ssize_t receive(int fd, const struct iovec* iov, int count);
+    virtual ssize_t transmit(int fd, const struct iovec* iov, int count);
+};
+
+#endif /* SERIALBACKEND_HPP_ */
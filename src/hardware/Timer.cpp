@@ -1,42 +1,327 @@
 #include "Timer.hpp"
+#include "../DeviceActivity.hpp"
 
 #include <cstdio>
 #include <cstring>
 #include <cassert>
+#include <ctime>
 
-ProgrammableIntervalTimer::ProgrammableIntervalTimer() : timerPrescaler(2), state{} {
-    // initialize the last updated timer
-    auto now = std::chrono::high_resolution_clock::now();
-    state[0].lastRecord = now;
-    state[1].lastRecord = now;
-    state[2].lastRecord = now;
-    state[0].waitingForLoad = true;
-    state[1].waitingForLoad = true;
-    state[2].waitingForLoad = true;
-    state[0].accessMode = AccessMode::LowByteHighByte;
-    state[1].accessMode = AccessMode::LowByteHighByte;
-    state[2].accessMode = AccessMode::LowByteHighByte;
+#include <unistd.h>
+#include <linux/kvm.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+
+namespace
+{
+    inline uint8_t toBCD(uint16_t value)
+    {
+        return (((value / 10) % 10) << 4) | (value % 10);
+    }
+
+    inline uint16_t fromBCD(uint8_t value)
+    {
+        return ((value >> 4) * 10) + (value & 0x0f);
+    }
+} /* anonymous */
+
+ProgrammableIntervalTimer::ProgrammableIntervalTimer(const EventLoop& eventLoop,
+        const VirtualClock& clock) : mEventLoop(eventLoop), mClock(clock), mMutex{}, mGSI{},
+        fds{}, tickPeriod(SourceClockPeriod * 2), tickDivider(SourceClockPeriod * 2),
+        timerPrescaler(2), nextEdge(0), state{} {
+    for (auto& channel : state) {
+        channel.waitingForLoad = true;
+        channel.accessMode = AccessMode::LowByteHighByte;
+        channel.cycle = 0x10000;
+        channel.cycleDivider = Reciprocal(channel.cycle);
+    }
 }
 
-ProgrammableIntervalTimer::~ProgrammableIntervalTimer() {}
+ProgrammableIntervalTimer::~ProgrammableIntervalTimer() {
+    stop();
+}
+
+bool ProgrammableIntervalTimer::start(int vmFd, uint32_t gsi) {
+    stop();
+
+    fds.timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (fds.timer == -1) {
+        perror("pit: unable to create timer descriptor");
+        return false;
+    }
+
+    fds.vm = vmFd;
+    fds.irq = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fds.irq == -1) {
+        perror("pit: unable to create irq event");
+        return false;
+    }
+
+    // edge triggered, no resample required
+    mGSI = gsi;
+    struct kvm_irqfd irqfd {
+        .fd = (__u32) fds.irq,
+        .gsi = mGSI
+    };
+    if (ioctl(fds.vm, KVM_IRQFD, &irqfd) == -1) {
+        perror("pit: failed to add irq event");
+        return false;
+    }
+
+    mEventLoop.addEvent(fds.timer, EPOLLIN, [this] (uint32_t events) {
+        handleTimerEvent(events);
+    });
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    armInterrupt(mClock.now());
+    return true;
+}
+
+void ProgrammableIntervalTimer::stop() {
+    if (fds.timer != -1) {
+        mEventLoop.removeEvent(fds.timer);
+        close(fds.timer);
+        fds.timer = -1;
+    }
+
+    if (fds.vm != -1 && fds.irq != -1) {
+        struct kvm_irqfd irqfd {
+            .fd = (__u32) fds.irq,
+            .gsi = mGSI,
+            .flags = KVM_IRQFD_FLAG_DEASSIGN
+        };
+        ioctl(fds.vm, KVM_IRQFD, &irqfd);
+        close(fds.irq);
+        fds.irq = -1;
+    }
+}
+
+// the gate inputs aren't modeled, the hardware triggered modes behave as if triggered on load
+ProgrammableIntervalTimer::OperatingMode
+ProgrammableIntervalTimer::baseMode(OperatingMode mode) {
+    switch (mode) {
+        case OperatingMode::HardwareRetriggerableOneShot:
+            return OperatingMode::InterruptOnTerminalCount;
+        case OperatingMode::HardwareTriggeredStrobe:
+            return OperatingMode::SoftwareTriggeredStrobe;
+        case OperatingMode::RateGenerator_2:
+            return OperatingMode::RateGenerator;
+        case OperatingMode::SquareWaveGenerator_2:
+            return OperatingMode::SquareWaveGenerator;
+        default:
+            return mode;
+    }
+}
 
 // prescaler register uses "divisor - 2", we store the adjusted one
 void ProgrammableIntervalTimer::setPrescaler(uint16_t prescaler) {
-    resolveTimers();
+    std::unique_lock<std::mutex> lock(mMutex);
+    uint64_t time = mClock.now();
+
+    // rebase the running counters on the current time before the tick length changes
+    for (uint8_t i = 0; i < 3; i++) {
+        auto& channel = state[i];
+        if (channel.waitingForLoad) {
+            continue;
+        }
+        resolvePendingLoad(i, time);
+        uint64_t phase = currentPhase(i, time);
+        OperatingMode mode = baseMode(channel.operatingMode);
+        if (mode == OperatingMode::RateGenerator || mode == OperatingMode::SquareWaveGenerator) {
+            phase = channel.cycleDivider.modulo(phase);
+        }
+        channel.startPhase = phase;
+        channel.startTime = time;
+    }
+
     timerPrescaler = prescaler;
+    tickPeriod = SourceClockPeriod * prescaler;
+    tickDivider = Reciprocal(tickPeriod);
+
+    for (auto& channel : state) {
+        if (!channel.waitingForLoad && channel.pendingLoad) {
+            channel.pendingTime = time + (channel.cycle - channel.startPhase) * tickPeriod;
+        }
+    }
+    armInterrupt(time);
+}
+
+uint64_t ProgrammableIntervalTimer::currentPhase(uint8_t timer, uint64_t time) {
+    auto& channel = state[timer];
+    if (time <= channel.startTime) {
+        return channel.startPhase;
+    }
+    return channel.startPhase + tickDivider.divide(time - channel.startTime);
+}
+
+void ProgrammableIntervalTimer::resolvePendingLoad(uint8_t timer, uint64_t time) {
+    auto& channel = state[timer];
+    if (channel.pendingLoad && !channel.waitingForLoad && time >= channel.pendingTime) {
+        channel.startTime = channel.pendingTime;
+        channel.startPhase = 0;
+        channel.pendingLoad = false;
+        setCycle(timer);
+    }
+}
+
+void ProgrammableIntervalTimer::setCycle(uint8_t timer) {
+    auto& channel = state[timer];
+    channel.cycle = channel.reload ? channel.reload
+            : (channel.numberFormat == NumberFormat::Binary ? 0x10000 : 10000);
+    channel.cycleDivider = Reciprocal(channel.cycle);
+}
+
+uint16_t ProgrammableIntervalTimer::currentCount(uint8_t timer, uint64_t time) {
+    auto& channel = state[timer];
+    if (channel.waitingForLoad) {
+        return channel.reload;
+    }
+
+    resolvePendingLoad(timer, time);
+    uint64_t phase = currentPhase(timer, time);
+    uint64_t cycle = channel.cycle;
+    switch (baseMode(channel.operatingMode)) {
+        case OperatingMode::RateGenerator:
+            return cycle - channel.cycleDivider.modulo(phase);
+        case OperatingMode::SquareWaveGenerator:
+        {
+            // counts down by two, twice per cycle
+            uint64_t half = (cycle + 1) / 2;
+            phase = channel.cycleDivider.modulo(phase);
+            return (cycle - 2 * (phase < half ? phase : phase - half)) & ~1ULL;
+        }
+        default:
+            // one shot modes keep counting (and wrap) after the terminal count
+            return cycle - phase;
+    }
+}
+
+bool ProgrammableIntervalTimer::currentOutput(uint8_t timer, uint64_t time) {
+    auto& channel = state[timer];
+    OperatingMode mode = baseMode(channel.operatingMode);
+    if (channel.waitingForLoad) {
+        return mode != OperatingMode::InterruptOnTerminalCount;
+    }
+
+    resolvePendingLoad(timer, time);
+    uint64_t phase = currentPhase(timer, time);
+    uint64_t cycle = channel.cycle;
+    switch (mode) {
+        case OperatingMode::InterruptOnTerminalCount:
+            return phase >= cycle;
+        case OperatingMode::SoftwareTriggeredStrobe:
+            return phase != cycle;
+        case OperatingMode::RateGenerator:
+            return channel.cycleDivider.modulo(phase) != cycle - 1;
+        case OperatingMode::SquareWaveGenerator:
+            return channel.cycleDivider.modulo(phase) < (cycle + 1) / 2;
+        default:
+            return true;
+    }
+}
+
+// a reload value was written completely
+void ProgrammableIntervalTimer::loadCounter(uint8_t timer, uint64_t time) {
+    auto& channel = state[timer];
+    OperatingMode mode = baseMode(channel.operatingMode);
+    bool periodic = (mode == OperatingMode::RateGenerator)
+            || (mode == OperatingMode::SquareWaveGenerator);
+
+    if (periodic && !channel.waitingForLoad) {
+        // new value is picked up at the end of the current cycle
+        resolvePendingLoad(timer, time);
+        uint64_t boundary = (channel.cycleDivider.divide(currentPhase(timer, time)) + 1)
+                * channel.cycle;
+        channel.pendingTime = channel.startTime + (boundary - channel.startPhase) * tickPeriod;
+        channel.pendingLoad = true;
+    } else {
+        // counting starts on the next timer clock
+        channel.waitingForLoad = false;
+        channel.pendingLoad = false;
+        setCycle(timer);
+        channel.startPhase = 0;
+        channel.startTime = time + tickPeriod;
+    }
+
+    if (timer == 0) {
+        armInterrupt(time);
+    }
+}
+
+// schedule the next rising edge of channel 0. the virtual clock isn't CLOCK_MONOTONIC, so the
+// timerfd is armed relative to now and rearmed on every edge to keep the two from drifting apart
+void ProgrammableIntervalTimer::armInterrupt(uint64_t time) {
+    if (fds.timer == -1) {
+        return;
+    }
+
+    struct itimerspec timeout {};
+    auto& channel = state[0];
+    if (!channel.waitingForLoad) {
+        resolvePendingLoad(0, time);
+        uint64_t phase = currentPhase(0, time);
+        uint64_t edge = 0;
+
+        switch (baseMode(channel.operatingMode)) {
+            case OperatingMode::RateGenerator:
+            case OperatingMode::SquareWaveGenerator:
+            {
+                uint64_t boundary = (channel.cycleDivider.divide(phase) + 1) * channel.cycle;
+                edge = channel.startTime + (boundary - channel.startPhase) * tickPeriod;
+                break;
+            }
+            default:
+                if (phase < channel.cycle) {
+                    edge = channel.startTime + (channel.cycle - channel.startPhase) * tickPeriod;
+                }
+                break;
+        }
+
+        if (edge) {
+            uint64_t delay = (edge > time) ? edge - time : 1;
+            timeout.it_value.tv_sec = delay / 1000000000ULL;
+            timeout.it_value.tv_nsec = delay % 1000000000ULL;
+        }
+        nextEdge = edge;
+    }
+    timerfd_settime(fds.timer, 0, &timeout, nullptr);
+}
+
+void ProgrammableIntervalTimer::handleTimerEvent(uint32_t events) {
+    if (events & EPOLLERR) {
+        fprintf(stderr, "pit: error occurred with timer event\n");
+        return;
+    }
+
+    // missed edges are coalesced into a single interrupt
+    uint64_t expirations = 0;
+    if (read(fds.timer, &expirations, sizeof expirations) != sizeof expirations
+            || !expirations) {
+        return;
+    }
+
+    uint64_t data = 1;
+    write(fds.irq, &data, sizeof data);
+    DeviceActivity::notify();
+
+    // the timerfd may fire a little early by the virtual clock, don't schedule the same edge again
+    std::unique_lock<std::mutex> lock(mMutex);
+    uint64_t time = mClock.now();
+    armInterrupt((time > nextEdge) ? time : nextEdge);
 }
 
 void ProgrammableIntervalTimer::writeCommand(ChannelCommand command) {
-    resolveTimers();
     if (command.standard.channel == 3) {
         // READBACK COMMAND
-        for (int i = 0; i < 3; i++) {
+        uint64_t time = mClock.now();
+        for (uint8_t i = 0; i < 3; i++) {
             // skip channel if not selected
             if ((i == 0 && !command.readback.readChannel0)
                     || (i == 1 && !command.readback.readChannel1)
                     || (i == 2 && !command.readback.readChannel2))
                 continue;
-            
+
             // setup byte select state machine
             if (!command.readback.latchStatus) {
                 state[i].accessByte = ByteSelect::StatusByte;
@@ -49,13 +334,13 @@ void ProgrammableIntervalTimer::writeCommand(ChannelCommand command) {
 
             // latch value if requested
             if (!command.readback.latchCount) {
-                state[i].latch = state[i].value;
+                state[i].latch = currentCount(i, time);
                 state[i].latched = true;
             }
         }
     } else if (command.standard.accessMode == AccessMode::LatchCountValue) {
         // COUNTER LATCH COMMAND
-        state[command.standard.channel].latch = state[command.standard.channel].value;
+        state[command.standard.channel].latch = currentCount(command.standard.channel, mClock.now());
         state[command.standard.channel].latched = true;
     } else {
         // CONFIGURE TIMER COMMAND
@@ -65,6 +350,7 @@ void ProgrammableIntervalTimer::writeCommand(ChannelCommand command) {
 
         // setup timer to be reset (timer is paused until load, waits for one virtual timer clock)
         state[command.standard.channel].waitingForLoad = true;
+        state[command.standard.channel].pendingLoad = false;
         switch (command.standard.accessMode) {
             // reset the access byte state machine
             case AccessMode::LowByteHighByte:
@@ -76,6 +362,12 @@ void ProgrammableIntervalTimer::writeCommand(ChannelCommand command) {
                 state[command.standard.channel].accessByte = ByteSelect::HighByte;
                 state[command.standard.channel].writeByte = ByteSelect::HighByte;
                 break;
+            default:
+                break;
+        }
+
+        if (command.standard.channel == 0) {
+            armInterrupt(mClock.now());
         }
     }
 }
@@ -85,46 +377,36 @@ void ProgrammableIntervalTimer::writeRegister(uint8_t timer, uint8_t value) {
     auto& selectedState = state[timer];
 
     // setup the reload value
-    selectedState.pendingLoad = true;
     uint16_t currentReload = selectedState.reload;
     switch (selectedState.writeByte) {
         case ByteSelect::LowByte:
             if (selectedState.numberFormat == NumberFormat::Binary) {
                 selectedState.reload = (currentReload & 0xFF00) | (uint16_t) value;
             } else {
-                selectedState.reload = (currentReload - (currentReload % 100)) + value;
+                selectedState.reload = (currentReload - (currentReload % 100)) + fromBCD(value);
             }
             if (selectedState.accessMode == AccessMode::LowByteHighByte) {
                 // there's another byte in set reload operation
                 selectedState.writeByte = ByteSelect::HighByte;
             } else {
                 // final byte in set reload operation
-                if (selectedState.waitingForLoad) {
-                    selectedState.waitingForLoad = false;
-                    selectedState.pendingLoad = false;
-                    selectedState.value = selectedState.reload;
-                    selectedState.lastRecord = std::chrono::high_resolution_clock::now();
-                }
+                loadCounter(timer, mClock.now());
             }
             break;
         case ByteSelect::HighByte:
             if (selectedState.numberFormat == NumberFormat::Binary) {
                 selectedState.reload = (currentReload & 0x00FF) | ((uint16_t) value << 8);
             } else {
-                selectedState.reload = (100 * (uint16_t) value) + (currentReload % 100);
+                selectedState.reload = (100 * fromBCD(value)) + (currentReload % 100);
             }
             if (selectedState.accessMode == AccessMode::LowByteHighByte) {
                 // reset to low byte if we use a two byte reload operation
                 selectedState.writeByte = ByteSelect::LowByte;
             }
             // always the final byte in set reload operation
-            if (selectedState.waitingForLoad) {
-                selectedState.waitingForLoad = false;
-                    selectedState.pendingLoad = false;
-                selectedState.value = selectedState.reload;
-                selectedState.lastRecord = std::chrono::high_resolution_clock::now();
-
-            }
+            loadCounter(timer, mClock.now());
+            break;
+        default:
             break;
     }
 }
@@ -132,34 +414,38 @@ void ProgrammableIntervalTimer::writeRegister(uint8_t timer, uint8_t value) {
 uint8_t ProgrammableIntervalTimer::readRegister(uint8_t timer) {
     assert(timer < 3);
     auto& selectedState = state[timer];
-    uint16_t value = selectedState.latched ? selectedState.latch : selectedState.value;
     ReadBackCommandResult ret{};
 
     // resolve the result
-    resolveTimers();
     switch (selectedState.accessByte) {
         case ByteSelect::LowByte:
+        {
+            uint16_t value = selectedState.latched ? selectedState.latch : currentCount(timer, mClock.now());
             if (selectedState.numberFormat == NumberFormat::Binary) {
                 ret.value = value & 0x00ff;
             } else {
                 // BCD format
-                ret.value = value % 100;
+                ret.value = toBCD(value % 100);
             }
             break;
+        }
         case ByteSelect::HighByte:
+        {
+            uint16_t value = selectedState.latched ? selectedState.latch : currentCount(timer, mClock.now());
             if (selectedState.numberFormat == NumberFormat::Binary) {
                 ret.value = (value >> 8) & 0x00ff;
             } else {
                 // BCD format
-                ret.value = value / 100;
+                ret.value = toBCD(value / 100);
             }
             break;
+        }
         case ByteSelect::StatusByte:
             ret.numberFormat = selectedState.numberFormat;
             ret.operatingMode = selectedState.operatingMode;
             ret.accessMode = selectedState.accessMode;
-            ret.pendingLoad = selectedState.pendingLoad || selectedState.waitingForLoad;
-            ret.outputState = selectedState.outputState;
+            ret.pendingLoad = selectedState.waitingForLoad;
+            ret.outputState = currentOutput(timer, mClock.now());
             break;
     }
 
@@ -192,36 +478,9 @@ uint8_t ProgrammableIntervalTimer::readRegister(uint8_t timer) {
     return ret.value;
 }
 
-// resolve the state of the timers
-void ProgrammableIntervalTimer::resolveTimers() {
-    auto now = std::chrono::high_resolution_clock::now();
-    for (int i = 0; i < 3; i++) {
-        // no operation if timer is paused
-        if (state[i].waitingForLoad)
-            continue;
-
-        // get elapsed ticks
-        auto elapsed = now - state[i].lastRecord;
-        state[i].lastRecord = now;
-        uint64_t ticks = elapsed.count() / (SourceClockPeriod * timerPrescaler);
-
-        // did timer overflow?
-        if (ticks > state[i].value) {
-            ticks -= state[i].value;
-            ticks %= (state[i].reload + 1);
-            state[i].value = state[i].reload - ticks;
-            state[i].pendingLoad = false;
-        } else {
-            state[i].value -= ticks;
-        }
-
-        // output value
-        //printf("timer %d value: %u\n", i, state[i].value);
-    }
-}
-
 // DevicePio 8 bit interface
 void ProgrammableIntervalTimer::iowrite8(uint16_t address, uint8_t data) {
+    std::unique_lock<std::mutex> lock(mMutex);
     if ((address & 0x3) == 0x03) {
         writeCommand(ChannelCommand{ .value = data });
     } else {
@@ -230,6 +489,7 @@ void ProgrammableIntervalTimer::iowrite8(uint16_t address, uint8_t data) {
 }
 
 uint8_t ProgrammableIntervalTimer::ioread8(uint16_t address) {
+    std::unique_lock<std::mutex> lock(mMutex);
     if ((address & 0x3) != 0x03) {
         return readRegister(address & 0x3);
     }
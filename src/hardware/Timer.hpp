@@ -2,10 +2,16 @@
 #define TIMER_HPP_
 
 #include <cinttypes>
-#include <chrono>
+#include <mutex>
 
 #include "DevicePio.hpp"
 #include "Prescalable.hpp"
+#include "../EventLoop.hpp"
+#include "../VirtualClock.hpp"
+
+// 8254 compatible timer of the 386EX. counters aren't stepped, they are derived from the time
+// they were loaded, so reading a counter is a clock read and a few multiplies. the rising edges of
+// channel 0 are scheduled with a timerfd and delivered as IRQ0 through an irqfd.
 
 struct ProgrammableIntervalTimer : public DevicePio, Prescalable {
     // 25 MHz source clock
@@ -75,16 +81,36 @@ struct ProgrammableIntervalTimer : public DevicePio, Prescalable {
         };
     };
 
+    EventLoop mEventLoop;
+    const VirtualClock& mClock;
+    std::mutex mMutex;
+    uint32_t mGSI;
+
+    struct __descriptors {
+        int vm;
+        int irq;
+        int timer;
+        __descriptors() : vm(-1), irq(-1), timer(-1) {}
+    } fds;
+
+    // length of a counter tick in ns (source clock * prescaler)
+    uint64_t tickPeriod;
+    Reciprocal tickDivider;
     uint16_t timerPrescaler;
+    // time of the next scheduled channel 0 edge
+    uint64_t nextEdge;
     struct {
-        // timer state
-        std::chrono::high_resolution_clock::time_point lastRecord;
-        uint16_t value;
+        // counting state: the counter was "phase" ticks into its cycle at "startTime" (ns)
+        uint64_t startTime;
+        uint64_t startPhase;
+        uint32_t cycle;
+        Reciprocal cycleDivider;
+        // reloads in the periodic modes take effect at the end of the current cycle
+        uint64_t pendingTime;
         uint16_t latch;
         uint16_t reload;
         bool     pendingLoad;
         bool     waitingForLoad;
-        bool     outputState;
         AccessMode accessMode;
         OperatingMode operatingMode;
         NumberFormat numberFormat;
@@ -95,9 +121,19 @@ struct ProgrammableIntervalTimer : public DevicePio, Prescalable {
         bool       latched;
     } state[3];
 
-    ProgrammableIntervalTimer();
+    ProgrammableIntervalTimer(const EventLoop& eventLoop, const VirtualClock& clock);
+    ProgrammableIntervalTimer(const ProgrammableIntervalTimer&) = delete;
+    ProgrammableIntervalTimer(ProgrammableIntervalTimer&&) = delete;
+
     virtual ~ProgrammableIntervalTimer();
 
+    ProgrammableIntervalTimer& operator=(const ProgrammableIntervalTimer&) = delete;
+    ProgrammableIntervalTimer& operator=(ProgrammableIntervalTimer&&) = delete;
+
+    // delivers channel 0 to the given gsi
+    bool start(int vmFd, uint32_t gsi);
+    void stop();
+
     // Prescalable methods
     void setPrescaler(uint16_t prescaler) override;
 
@@ -111,7 +147,16 @@ struct ProgrammableIntervalTimer : public DevicePio, Prescalable {
     uint8_t readRegister(uint8_t timer);
 
 private:
-    void resolveTimers();
+    static OperatingMode baseMode(OperatingMode mode);
+
+    uint64_t currentPhase(uint8_t timer, uint64_t time);
+    uint16_t currentCount(uint8_t timer, uint64_t time);
+    bool currentOutput(uint8_t timer, uint64_t time);
+    void resolvePendingLoad(uint8_t timer, uint64_t time);
+    void setCycle(uint8_t timer);
+    void loadCounter(uint8_t timer, uint64_t time);
+    void armInterrupt(uint64_t time);
+    void handleTimerEvent(uint32_t events);
 };
 
-#endif /* TIMER_HPP_ */
\ No newline at end of file
+#endif /* TIMER_HPP_ */
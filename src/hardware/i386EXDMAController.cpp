@@ -0,0 +1,458 @@
+#include "i386EXDMAController.hpp"
+#include "../DeviceActivity.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace
+{
+    // offsets in the expanded i/o space (F000h), the 8237 registers are at the same offsets in
+    // the PC/AT space
+    constexpr uint16_t ExpandedBase = 0xF000;
+    constexpr uint16_t Configuration = 0xF830;
+
+    // DMAMOD1
+    constexpr uint8_t TransferMask = 0x0c;
+    constexpr uint8_t TransferWrite = 0x04;
+    constexpr uint8_t TransferRead = 0x08;
+    constexpr uint8_t AutoInitialize = 0x10;
+    constexpr uint8_t Decrement = 0x20;
+
+    // DMACMD1
+    constexpr uint8_t ControllerDisable = 0x04;
+
+    // DMACFG request sources, D0REQ in bits 2:0 and D1REQ in bits 6:4
+    constexpr uint8_t SourceMask = 0x07;
+    constexpr uint8_t SourceSioReceive = 0x01;
+    constexpr uint8_t SourceSioTransmit = 0x02;
+
+    // decrementing runs are reversed through a buffer on the stack
+    constexpr size_t ReversedRun = 64;
+} /* anonymous */
+
+i386EXDMAController::i386EXDMAController(const EventLoop& eventLoop, GuestMemory& memory)
+    : mEventLoop(eventLoop), mMutex{}, mInterrupt{}, mMemory(memory), channels{}, mArmed{},
+    registers{}
+{
+    masterClear();
+}
+
+i386EXDMAController::~i386EXDMAController()
+{
+    stop();
+}
+
+bool i386EXDMAController::start(int vmFd, uint32_t gsi)
+{
+    stop();
+    if (!mInterrupt.start(mEventLoop, vmFd, gsi, [this] {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mInterrupt.set(interruptPending());
+    })) {
+        fprintf(stderr, "dma: unable to set up irq %u\n", gsi);
+        return false;
+    }
+    return true;
+}
+
+void i386EXDMAController::stop()
+{
+    mInterrupt.stop();
+}
+
+void i386EXDMAController::attach(Request line, ArmedHandler armed)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    mArmed[static_cast<int>(line)] = std::move(armed);
+}
+
+// SIO0 receives on channel 0 and transmits on channel 1, SIO1 the other way around. -1 if
+// DMACFG doesn't route the line
+int i386EXDMAController::channelFor(Request line) const
+{
+    for (int channel = 0; channel < 2; channel++) {
+        uint8_t source = (registers.configuration >> (channel * 4)) & SourceMask;
+        bool sio0 = (channel == 0);
+        switch (line) {
+            case Request::Sio0Receive:
+                if (sio0 && source == SourceSioReceive) return channel;
+                break;
+            case Request::Sio0Transmit:
+                if (!sio0 && source == SourceSioTransmit) return channel;
+                break;
+            case Request::Sio1Receive:
+                if (!sio0 && source == SourceSioReceive) return channel;
+                break;
+            case Request::Sio1Transmit:
+                if (sio0 && source == SourceSioTransmit) return channel;
+                break;
+        }
+    }
+    return -1;
+}
+
+// requires mMutex. a receive line needs a write transfer (to memory), a transmit line a read
+bool i386EXDMAController::armed(int channel, Request line) const
+{
+    if (channel == -1 || channels[channel].masked || (registers.command1 & ControllerDisable)) {
+        return false;
+    }
+    bool receive = (line == Request::Sio0Receive || line == Request::Sio1Receive);
+    return (channels[channel].mode & TransferMask) == (receive ? TransferWrite : TransferRead);
+}
+
+bool i386EXDMAController::armed(Request line)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    return armed(channelFor(line), line);
+}
+
+size_t i386EXDMAController::transfer(Request line, uint8_t* data, size_t length)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    int channel = channelFor(line);
+    bool receive = (line == Request::Sio0Receive || line == Request::Sio1Receive);
+
+    size_t moved = 0;
+    while (moved < length && armed(channel, line)) {
+        size_t count = moveRun(channel, receive, data + moved,
+                runLength(channel, length - moved));
+        moved += count;
+        advance(channel, count);
+    }
+    return moved;
+}
+
+// the bytes the channel moves in one piece: up to its terminal count and, without overflow, the
+// end (or start) of its 64 KiB page. requires mMutex
+size_t i386EXDMAController::runLength(int channel, size_t length) const
+{
+    const Channel& c = channels[channel];
+    uint32_t limit = (registers.overflowEnable & (1 << channel)) ? 0x3ffffff : 0xffff;
+    size_t run = std::min<size_t>(length, c.count + 1);
+    if (c.mode & Decrement) {
+        return std::min<size_t>({run, (c.target & limit) + 1, ReversedRun});
+    }
+    return std::min<size_t>(run, limit + 1 - (c.target & limit));
+}
+
+// copies a run with a single translation, returns the bytes moved (at least one). writes to
+// unmapped or read only memory are lost, reads of unmapped memory float high. requires mMutex
+size_t i386EXDMAController::moveRun(int channel, bool receive, uint8_t* data, size_t run)
+{
+    uint32_t target = channels[channel].target;
+    if (!(channels[channel].mode & Decrement)) {
+        size_t count = receive ? mMemory.write(target, data, run) : mMemory.read(target, data, run);
+        if (count) {
+            return count;
+        }
+        if (!receive) {
+            data[0] = 0xff;
+        }
+        return 1;
+    }
+
+    // a decrementing run covers target - run + 1 up to target, the data goes the other way
+    uint8_t reversed[ReversedRun];
+    uint32_t low = target - (run - 1);
+    if (receive) {
+        std::reverse_copy(data, data + run, reversed);
+        if (mMemory.write(low, reversed, run) == run) {
+            return run;
+        }
+        mMemory.write(target, data, 1);
+    } else {
+        if (mMemory.read(low, reversed, run) == run) {
+            std::reverse_copy(reversed, reversed + run, data);
+            return run;
+        }
+        if (!mMemory.read(target, data, 1)) {
+            data[0] = 0xff;
+        }
+    }
+    return 1;
+}
+
+// moves past count bytes, at most up to the terminal count. requires mMutex
+void i386EXDMAController::advance(int channel, size_t count)
+{
+    Channel& c = channels[channel];
+    uint32_t step = (c.mode & Decrement) ? -count : count;
+    if (registers.overflowEnable & (1 << channel)) {
+        c.target = (c.target + step) & 0x3ffffff;
+    } else {
+        c.target = (c.target & 0x3ff0000) | ((c.target + step) & 0xffff);
+    }
+
+    if (count <= c.count) {
+        c.count -= count;
+        return;
+    }
+    c.count = 0xffffff;
+    terminalCount(channel);
+}
+
+// requires mMutex
+void i386EXDMAController::terminalCount(int channel)
+{
+    Channel& c = channels[channel];
+    if (c.mode & AutoInitialize) {
+        c.target = c.baseTarget;
+        c.count = c.baseCount;
+    } else {
+        c.masked = true;
+    }
+
+    registers.status |= 1 << channel;
+    registers.interruptStatus |= 1 << channel;
+    DeviceActivity::notify();
+    if (interruptPending()) {
+        postUpdate();
+    }
+}
+
+// requires mMutex
+bool i386EXDMAController::interruptPending() const
+{
+    return registers.interruptStatus & registers.interruptEnable & 0x03;
+}
+
+// the line belongs to the event loop thread
+void i386EXDMAController::postUpdate()
+{
+    mEventLoop.post([this] {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mInterrupt.set(interruptPending());
+    });
+}
+
+// the peripherals check their lines again on their own threads. requires mMutex
+void i386EXDMAController::notifyArmed()
+{
+    for (auto& armed : mArmed) {
+        if (armed) {
+            armed();
+        }
+    }
+}
+
+// the 16 bit registers are accessed a byte at a time, the byte pointer selects which.
+// requires mMutex
+void i386EXDMAController::writeWord(uint32_t& value, unsigned shift, uint8_t data)
+{
+    shift += registers.bytePointer ? 8 : 0;
+    value = (value & ~(0xffu << shift)) | (data << shift);
+    registers.bytePointer = !registers.bytePointer;
+}
+
+uint8_t i386EXDMAController::readWord(uint32_t value, unsigned shift)
+{
+    shift += registers.bytePointer ? 8 : 0;
+    registers.bytePointer = !registers.bytePointer;
+    return value >> shift;
+}
+
+// requires mMutex
+void i386EXDMAController::masterClear()
+{
+    registers.command1 = 0;
+    registers.status = 0;
+    registers.softwareRequest = 0;
+    registers.bytePointer = false;
+    for (auto& channel : channels) {
+        channel.masked = true;
+    }
+}
+
+void i386EXDMAController::iowrite8(uint16_t address, uint8_t value)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (address == Configuration) {
+        registers.configuration = value;
+        notifyArmed();
+        return;
+    }
+
+    uint16_t offset = (address >= ExpandedBase) ? address - ExpandedBase : address;
+    switch (offset) {
+        case 0x00:
+        case 0x02:
+        {
+            // the base and the current address
+            Channel& c = channels[offset >> 1];
+            writeWord(c.baseTarget, 0, value);
+            c.target = (c.target & ~0xffffu) | (c.baseTarget & 0xffff);
+            break;
+        }
+        case 0x01:
+        case 0x03:
+        {
+            Channel& c = channels[offset >> 1];
+            writeWord(c.baseCount, 0, value);
+            c.count = (c.count & ~0xffffu) | (c.baseCount & 0xffff);
+            break;
+        }
+        case 0x08:
+            registers.command1 = value;
+            notifyArmed();
+            break;
+        case 0x09:
+            // recorded only, there is nothing a software request could transfer from
+            if (value & 0x04) {
+                registers.softwareRequest |= 1 << (value & 0x01);
+            } else {
+                registers.softwareRequest &= ~(1 << (value & 0x01));
+            }
+            break;
+        case 0x0a:
+            // channels 2 and 3 of the PC/AT controller don't exist
+            if (value & 0x02) {
+                break;
+            }
+            channels[value & 0x01].masked = value & 0x04;
+            notifyArmed();
+            break;
+        case 0x0b:
+            if (value & 0x02) {
+                break;
+            }
+            channels[value & 0x01].mode = value;
+            notifyArmed();
+            break;
+        case 0x0c:
+            registers.bytePointer = false;
+            break;
+        case 0x0d:
+            masterClear();
+            break;
+        case 0x0e:
+            channels[0].masked = false;
+            channels[1].masked = false;
+            notifyArmed();
+            break;
+        case 0x0f:
+            channels[0].masked = value & 0x01;
+            channels[1].masked = value & 0x02;
+            notifyArmed();
+            break;
+        case 0x10:
+        case 0x12:
+            writeWord(channels[(offset >> 1) & 1].requester, 0, value);
+            break;
+        case 0x11:
+        case 0x13:
+            writeWord(channels[(offset >> 1) & 1].requester, 16, value);
+            break;
+        case 0x18:
+            registers.busSize = value;
+            break;
+        case 0x19:
+            registers.chaining = value;
+            break;
+        case 0x1a:
+            registers.command2 = value;
+            break;
+        case 0x1b:
+            registers.mode2 = value;
+            break;
+        case 0x1c:
+            registers.interruptEnable = value;
+            postUpdate();
+            break;
+        case 0x1d:
+            registers.overflowEnable = value;
+            break;
+        case 0x1e:
+            registers.interruptStatus = 0;
+            postUpdate();
+            break;
+        case 0x83:
+        case 0x87:
+        {
+            // TAR2, the page
+            Channel& c = channels[(offset == 0x87) ? 0 : 1];
+            c.baseTarget = (c.baseTarget & ~0xff0000u) | (value << 16);
+            c.target = (c.target & ~0xff0000u) | (value << 16);
+            break;
+        }
+        case 0x85:
+        case 0x86:
+        {
+            // TAR3, address bits 25:24
+            Channel& c = channels[(offset == 0x86) ? 0 : 1];
+            c.baseTarget = (c.baseTarget & ~0x3000000u) | ((value & 0x03) << 24);
+            c.target = (c.target & ~0x3000000u) | ((value & 0x03) << 24);
+            break;
+        }
+        case 0x98:
+        case 0x99:
+        {
+            // BYC2, count bits 23:16
+            Channel& c = channels[offset - 0x98];
+            c.baseCount = (c.baseCount & 0xffff) | (value << 16);
+            c.count = (c.count & 0xffff) | (value << 16);
+            break;
+        }
+    }
+}
+
+uint8_t i386EXDMAController::ioread8(uint16_t address)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (address == Configuration) {
+        return registers.configuration;
+    }
+
+    uint16_t offset = (address >= ExpandedBase) ? address - ExpandedBase : address;
+    switch (offset) {
+        case 0x00:
+        case 0x02:
+            return readWord(channels[offset >> 1].target, 0);
+        case 0x01:
+        case 0x03:
+            return readWord(channels[offset >> 1].count, 0);
+        case 0x08:
+        {
+            // terminal counts clear on read, requests in the upper nibble
+            uint8_t status = registers.status | (registers.softwareRequest << 4);
+            registers.status = 0;
+            return status;
+        }
+        case 0x09:
+            return registers.softwareRequest;
+        case 0x0f:
+            return (channels[0].masked ? 0x01 : 0) | (channels[1].masked ? 0x02 : 0);
+        case 0x10:
+        case 0x12:
+            return readWord(channels[(offset >> 1) & 1].requester, 0);
+        case 0x11:
+        case 0x13:
+            return readWord(channels[(offset >> 1) & 1].requester, 16);
+        case 0x18:
+            return registers.busSize;
+        case 0x19:
+            return registers.interruptStatus;
+        case 0x1c:
+            return registers.interruptEnable;
+        case 0x1d:
+            return registers.overflowEnable;
+        case 0x83:
+        case 0x87:
+            return channels[(offset == 0x87) ? 0 : 1].target >> 16;
+        case 0x85:
+        case 0x86:
+            return (channels[(offset == 0x86) ? 0 : 1].target >> 24) & 0x03;
+        case 0x98:
+        case 0x99:
+            return channels[offset - 0x98].count >> 16;
+        default:
+            return 0xff;
+    }
+}
+
+// the status registers only change on terminal counts, which signal activity
+uint64_t i386EXDMAController::pollTimeout(uint16_t address)
+{
+    uint16_t offset = (address >= ExpandedBase) ? address - ExpandedBase : address;
+    return (offset == 0x08 || offset == 0x19) ? UINT64_MAX : 0;
+}
@@ -0,0 +1,123 @@
+#ifndef I386EXDMACONTROLLER_HPP_
+#define I386EXDMACONTROLLER_HPP_
+
+#include "DevicePio.hpp"
+#include "InterruptLine.hpp"
+#include "../EventLoop.hpp"
+#include "../GuestMemory.hpp"
+
+#include <cstddef>
+#include <functional>
+#include <mutex>
+
+// the two channel DMA unit of the 386EX: the 8237 compatible registers at their PC/AT addresses
+// (channels 0 and 1 and their page registers) and in the expanded i/o space, with the 386EX's
+// additions (TAR3, BYC2, requester address, interrupt enable and status). DMACFG routes the
+// receive and transmit requests of SIO0 and SIO1 to the channels.
+//
+// channels move bytes between a peripheral and guest ram without the guest touching the
+// peripheral: the peripheral calls transfer() on its own thread whenever it has received data or
+// its transmitter is empty, and the bytes go straight to (or come from) guest memory, a run at
+// a time up to the terminal count or the end of the 64 KiB page.
+// only the peripheral's request lines are modelled, software requests and memory to memory
+// transfers aren't. without overflow enabled (DMAOVFE) the target address wraps within its 64 KiB
+// page like the 8237's.
+//
+// reaching the terminal count masks the channel (unless it auto initializes), sets its bit in
+// DMASTS and DMAIS and, if enabled in DMAIEN, raises the DMA interrupt until DMACLRTC is written.
+//
+// registers are accessed on the vcpu thread, transfers on the peripherals' threads, both under
+// mMutex. the interrupt line is driven on the event loop thread.
+
+class i386EXDMAController : public DevicePio
+{
+public:
+    // the request lines DMACFG can route
+    enum class Request : uint8_t {
+        Sio0Receive,
+        Sio0Transmit,
+        Sio1Receive,
+        Sio1Transmit
+    };
+
+    // called when a channel may have started serving the line, on any thread
+    using ArmedHandler = std::function<void()>;
+
+private:
+    struct Channel {
+        // current and base target address (26 bits) and byte count (24 bits, one less than the
+        // bytes to transfer)
+        uint32_t target;
+        uint32_t baseTarget;
+        uint32_t count;
+        uint32_t baseCount;
+        uint32_t requester;
+        uint8_t mode;
+        bool masked;
+    };
+
+    EventLoop mEventLoop;
+    std::mutex mMutex;
+    InterruptLine mInterrupt;
+    GuestMemory& mMemory;
+
+    Channel channels[2];
+    ArmedHandler mArmed[4];
+
+    struct {
+        uint8_t command1;
+        uint8_t command2;
+        uint8_t mode2;
+        uint8_t status;
+        uint8_t softwareRequest;
+        uint8_t busSize;
+        uint8_t chaining;
+        uint8_t interruptEnable;
+        uint8_t interruptStatus;
+        uint8_t overflowEnable;
+        uint8_t configuration;
+        // low or high byte of the 16 bit registers next
+        bool bytePointer;
+    } registers;
+
+    int channelFor(Request line) const;
+    bool armed(int channel, Request line) const;
+    size_t runLength(int channel, size_t length) const;
+    size_t moveRun(int channel, bool receive, uint8_t* data, size_t run);
+    void advance(int channel, size_t count);
+    void terminalCount(int channel);
+    bool interruptPending() const;
+    void postUpdate();
+    void notifyArmed();
+    void writeWord(uint32_t& value, unsigned shift, uint8_t data);
+    uint8_t readWord(uint32_t value, unsigned shift);
+    void masterClear();
+
+public:
+    i386EXDMAController(const EventLoop& eventLoop, GuestMemory& memory);
+    i386EXDMAController(const i386EXDMAController&) = delete;
+    i386EXDMAController(i386EXDMAController&&) = delete;
+
+    virtual ~i386EXDMAController();
+
+    i386EXDMAController& operator=(const i386EXDMAController&) = delete;
+    i386EXDMAController& operator=(i386EXDMAController&&) = delete;
+
+    bool start(int vmFd, uint32_t gsi);
+    void stop();
+
+    // peripheral side. attach a handler for one of the peripheral's lines (nullptr detaches it)
+    void attach(Request line, ArmedHandler armed);
+    // whether a channel serves the line right now
+    bool armed(Request line);
+    // moves up to length bytes for the line: from data to memory for a receive line, from memory
+    // to data for a transmit line. returns the bytes moved, 0 if no channel serves the line
+    size_t transfer(Request line, uint8_t* data, size_t length);
+
+    // DevicePio implementation
+    void iowrite8(uint16_t address, uint8_t value) override;
+    uint8_t ioread8(uint16_t address) override;
+    uint64_t pollTimeout(uint16_t address) override;
+};
+
+#endif /* I386EXDMACONTROLLER_HPP_ */
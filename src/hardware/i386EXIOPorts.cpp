@@ -0,0 +1,237 @@
+#include "i386EXIOPorts.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#define LOG_ERROR(fmt) { \
+    std::cerr << "[ERROR] [386EX ports \"" << mName << "\"]: "<< fmt << std::endl; \
+};
+
+#ifndef NDEBUG
+#define LOG_INFO(fmt) { \
+    std::cerr << "[INFO] [386EX ports \"" << mName << "\"]: "<< fmt << std::endl; \
+};
+#else
+#define LOG_INFO(fmt)
+#endif
+
+namespace
+{
+    // P1CFG-P3CFG, then PnPIN, PnLTC and PnDIR 8 ports apart
+    constexpr uint16_t ConfigurationBase = 0xF820;
+    constexpr uint16_t PortBase = 0xF860;
+
+    // offset of CFG in a change, LTC and DIR use their register offsets
+    constexpr uint8_t ConfigurationChange = 0;
+} /* anonymous */
+
+static_assert(sizeof(i386EXIOPorts::Page) <= 4096, "the shared page overflows");
+
+i386EXIOPorts::i386EXIOPorts(const EventLoop& eventLoop, uint8_t port1, uint8_t port2,
+        uint8_t port3)
+    : mEventLoop(eventLoop), mName{}, mBackend{}, fds{}, mPage(nullptr),
+    mDefaultInputs{port1, port2, port3}, registers{}
+{
+    // ports are inputs with the latch set at reset
+    for (auto& port : registers) {
+        port.latch = 0xFF;
+        port.direction = 0xFF;
+    }
+}
+
+i386EXIOPorts::~i386EXIOPorts()
+{
+    stop();
+}
+
+bool i386EXIOPorts::start(const std::string& socketPath)
+{
+    stop();
+    mName = "unix:" + socketPath;
+
+    fds.memory = memfd_create("386ex-ports", MFD_CLOEXEC);
+    if (fds.memory == -1 || ftruncate(fds.memory, sizeof(Page)) == -1) {
+        LOG_ERROR("unable to create the shared page: " << strerror(errno));
+        return false;
+    }
+    void* memory = mmap(nullptr, sizeof(Page), PROT_READ | PROT_WRITE, MAP_SHARED, fds.memory,
+            0);
+    if (memory == MAP_FAILED) {
+        LOG_ERROR("unable to map the shared page: " << strerror(errno));
+        return false;
+    }
+    mPage = new (memory) Page();
+    for (int port = 0; port < 3; port++) {
+        mPage->inputs[port].store(mDefaultInputs[port], std::memory_order_relaxed);
+        mPage->configuration[port].store(registers[port].configuration, std::memory_order_relaxed);
+        mPage->latch[port].store(registers[port].latch, std::memory_order_relaxed);
+        mPage->direction[port].store(registers[port].direction, std::memory_order_relaxed);
+    }
+
+    fds.event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fds.event == -1) {
+        LOG_ERROR("unable to create the fixture event.");
+        return false;
+    }
+
+    mBackend = SerialBackend::create(mName);
+    if (!mBackend || !mBackend->open(mEventLoop, [this] (int fd, bool input) { addFixture(fd); })) {
+        return false;
+    }
+    return true;
+}
+
+void i386EXIOPorts::stop()
+{
+    removeFixture();
+
+    if (mBackend) {
+        mBackend->close();
+        mBackend.reset();
+    }
+
+    // the vcpu may still read the inputs
+    if (mPage) {
+        for (int port = 0; port < 3; port++) {
+            mDefaultInputs[port] = mPage->inputs[port].load(std::memory_order_relaxed);
+        }
+        mPage->~Page();
+        munmap(mPage, sizeof(Page));
+        mPage = nullptr;
+    }
+    for (int* fd : { &fds.memory, &fds.event }) {
+        if (*fd != -1) {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+// a single fixture drives the pins, it gets the page and the eventfd
+void i386EXIOPorts::addFixture(int fd)
+{
+    if (fds.fixture != -1) {
+        LOG_INFO("a fixture is already connected.");
+        close(fd);
+        return;
+    }
+
+    int descriptors[2] = { fds.memory, fds.event };
+    if (!SerialBackend::sendDescriptors(fd, 'P', descriptors, 2)) {
+        LOG_ERROR("unable to pass the page to a fixture: " << strerror(errno));
+        close(fd);
+        return;
+    }
+
+    fds.fixture = fd;
+    SerialBackend::watchHangup(mEventLoop, fd, [this] { removeFixture(); });
+}
+
+// the pins keep the levels the fixture left behind
+void i386EXIOPorts::removeFixture()
+{
+    if (fds.fixture == -1) {
+        return;
+    }
+    mEventLoop.removeEvent(fds.fixture);
+    close(fds.fixture);
+    fds.fixture = -1;
+}
+
+uint8_t i386EXIOPorts::pins(int port) const
+{
+    uint8_t inputs = mPage ? mPage->inputs[port].load(std::memory_order_relaxed)
+            : mDefaultInputs[port];
+    uint8_t outputs = ~registers[port].direction & ~registers[port].configuration;
+    uint8_t driven = (registers[port].latch & outputs) | (inputs & ~outputs);
+    // open drain inputs with a clear latch pull low
+    uint8_t pulledLow = registers[port].direction & ~registers[port].configuration
+            & ~registers[port].latch;
+    return driven & ~pulledLow;
+}
+
+// a full ring drops the change, the fixture sees the count
+void i386EXIOPorts::pushChange(int port, uint8_t reg, uint8_t value)
+{
+    if (!mPage) {
+        return;
+    }
+
+    mPage->configuration[port].store(registers[port].configuration, std::memory_order_relaxed);
+    mPage->latch[port].store(registers[port].latch, std::memory_order_relaxed);
+    mPage->direction[port].store(registers[port].direction, std::memory_order_relaxed);
+
+    uint32_t tail = mPage->tail.load(std::memory_order_relaxed);
+    if (tail - mPage->head.load(std::memory_order_acquire) >= RingSize) {
+        mPage->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    Change& change = mPage->changes[tail % RingSize];
+    change.time = EventLoop::now();
+    change.port = port + 1;
+    change.reg = reg;
+    change.value = value;
+    change.pins = pins(port);
+    // the fixture sets waiting before it checks the ring a last time. publishing the tail and
+    // reading waiting is a store to load handshake, seq_cst on both sides keeps the load from
+    // passing the store
+    mPage->tail.store(tail + 1, std::memory_order_seq_cst);
+    if (mPage->waiting.exchange(0, std::memory_order_seq_cst)) {
+        uint64_t one = 1;
+        write(fds.event, &one, sizeof one);
+    }
+}
+
+void i386EXIOPorts::iowrite8(uint16_t address, uint8_t value)
+{
+    if (address < PortBase) {
+        int port = (address - ConfigurationBase) >> 1;
+        if ((address & 1) || port > 2) {
+            return;
+        }
+        registers[port].configuration = value;
+        pushChange(port, ConfigurationChange, value);
+        return;
+    }
+
+    int port = (address - PortBase) >> 3;
+    switch (static_cast<Register>((address - PortBase) & 7)) {
+        case Register::Latch:
+            registers[port].latch = value;
+            break;
+        case Register::Direction:
+            registers[port].direction = value;
+            break;
+        default:
+            // PnPIN is read only
+            return;
+    }
+    pushChange(port, (address - PortBase) & 7, value);
+}
+
+uint8_t i386EXIOPorts::ioread8(uint16_t address)
+{
+    if (address < PortBase) {
+        int port = (address - ConfigurationBase) >> 1;
+        return ((address & 1) || port > 2) ? 0 : registers[port].configuration;
+    }
+
+    int port = (address - PortBase) >> 3;
+    switch (static_cast<Register>((address - PortBase) & 7)) {
+        case Register::Pin:
+            return pins(port);
+        case Register::Latch:
+            return registers[port].latch;
+        case Register::Direction:
+            return registers[port].direction;
+        default:
+            return 0;
+    }
+}
@@ -0,0 +1,120 @@
+#ifndef I386EXIOPORTS_HPP_
+#define I386EXIOPORTS_HPP_
+
+#include "DevicePio.hpp"
+#include "SerialBackend.hpp"
+#include "../EventLoop.hpp"
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+// the three 8 bit i/o ports of the 386EX (PnCFG, PnPIN, PnLTC and PnDIR). a pin configured as an
+// output drives its latch, an input (open drain) pulls low with a clear latch and otherwise reads
+// what the outside drives. pins switched to their peripheral function read the outside as well.
+//
+// the outside is a page of shared memory. a fixture connects to a unix socket and receives the
+// page's memfd and an eventfd with SCM_RIGHTS. it drives the pins by storing into inputs, which
+// the guest's next PnPIN read sees, and follows every guest write to the port registers through
+// a single producer, single consumer ring in the page. the fixture sets waiting before it sleeps
+// on the eventfd (after checking the ring once more), the eventfd is only written then.
+//
+// registers are accessed on the vcpu thread, the fixture connection is served by the event loop
+// thread. one fixture at a time.
+
+class i386EXIOPorts : public DevicePio
+{
+public:
+    struct Change {
+        // CLOCK_MONOTONIC, ns
+        uint64_t time;
+        // port 1-3
+        uint8_t port;
+        // offset of the register written: 0 CFG, 2 LTC, 4 DIR
+        uint8_t reg;
+        uint8_t value;
+        // the pin levels after the write
+        uint8_t pins;
+        uint32_t reserved;
+    };
+
+    static constexpr uint32_t RingSize = 128;
+
+    struct Page {
+        // pins as driven from the outside, written by the fixture
+        std::atomic<uint8_t> inputs[3];
+        uint8_t reserved1;
+        // the guest's registers, for reference
+        std::atomic<uint8_t> configuration[3];
+        uint8_t reserved2;
+        std::atomic<uint8_t> latch[3];
+        uint8_t reserved3;
+        std::atomic<uint8_t> direction[3];
+        uint8_t reserved4;
+        // the fixture sleeps on the eventfd
+        std::atomic<uint32_t> waiting;
+        // changes lost to a full ring
+        std::atomic<uint32_t> dropped;
+        // free running ring positions, head advanced by the fixture, tail by the emulator
+        std::atomic<uint32_t> head;
+        std::atomic<uint32_t> tail;
+        Change changes[RingSize];
+    };
+
+private:
+    enum class Register : uint16_t {
+        Pin = 0,
+        Latch = 2,
+        Direction = 4
+    };
+
+    EventLoop mEventLoop;
+    std::string mName;
+    std::unique_ptr<SerialBackend> mBackend;
+
+    struct __descriptors {
+        int memory;
+        int event;
+        int fixture;
+        __descriptors() : memory(-1), event(-1), fixture(-1) {}
+    } fds;
+
+    Page* mPage;
+    // inputs until the page exists
+    uint8_t mDefaultInputs[3];
+
+    // vcpu side
+    struct {
+        uint8_t configuration;
+        uint8_t latch;
+        uint8_t direction;
+    } registers[3];
+
+    uint8_t pins(int port) const;
+    void pushChange(int port, uint8_t reg, uint8_t value);
+    void addFixture(int fd);
+    void removeFixture();
+
+public:
+    // the levels the pins read with nothing connected (the TS-3100 jumpers on ports 1 and 3)
+    i386EXIOPorts(const EventLoop& eventLoop, uint8_t port1, uint8_t port2, uint8_t port3);
+    i386EXIOPorts(const i386EXIOPorts&) = delete;
+    i386EXIOPorts(i386EXIOPorts&&) = delete;
+
+    virtual ~i386EXIOPorts();
+
+    i386EXIOPorts& operator=(const i386EXIOPorts&) = delete;
+    i386EXIOPorts& operator=(i386EXIOPorts&&) = delete;
+
+    // fixtures connect to the unix socket at socketPath
+    bool start(const std::string& socketPath);
+    void stop();
+
+    const std::string& name() const { return mName; }
+
+    // DevicePio implementation
+    void iowrite8(uint16_t address, uint8_t value) override;
+    uint8_t ioread8(uint16_t address) override;
+};
+
+#endif /* I386EXIOPORTS_HPP_ */
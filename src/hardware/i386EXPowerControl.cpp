@@ -0,0 +1,74 @@
+#include "i386EXPowerControl.hpp"
+
+#include <cstdio>
+
+#include <linux/kvm.h>
+#include <sys/ioctl.h>
+
+// bits 7:2 are reserved
+static constexpr uint8_t PowerControlMask = 0x03;
+
+i386EXPowerControl::i386EXPowerControl() : mVmFd(-1), mHaltPoll(-1), mPowerControl(0) {}
+
+bool i386EXPowerControl::start(int vmFd)
+{
+    mVmFd = vmFd;
+    mHaltPoll = -1;
+    if (ioctl(mVmFd, KVM_CHECK_EXTENSION, KVM_CAP_HALT_POLL) <= 0) {
+        return true;
+    }
+
+    // the per vm interval starts out as the module parameter
+    FILE* parameter = fopen("/sys/module/kvm/parameters/halt_poll_ns", "r");
+    if (!parameter) {
+        return true;
+    }
+    unsigned long long haltPoll;
+    if (fscanf(parameter, "%llu", &haltPoll) == 1) {
+        mHaltPoll = haltPoll;
+    }
+    fclose(parameter);
+    return true;
+}
+
+i386EXPowerControl::Mode i386EXPowerControl::mode() const
+{
+    return static_cast<Mode>(mPowerControl);
+}
+
+void i386EXPowerControl::setHaltPoll(uint64_t haltPoll)
+{
+    struct kvm_enable_cap capability {};
+    capability.cap = KVM_CAP_HALT_POLL;
+    capability.args[0] = haltPoll;
+    if (ioctl(mVmFd, KVM_ENABLE_CAP, &capability) == -1) {
+        perror("power control: KVM_CAP_HALT_POLL");
+        mHaltPoll = -1;
+    }
+}
+
+void i386EXPowerControl::iowrite8(uint16_t address, uint8_t value)
+{
+    Mode previous = mode();
+    mPowerControl = value & PowerControlMask;
+    if (mode() == previous) {
+        return;
+    }
+
+#if !(defined NDEBUG)
+    fprintf(stderr, "LOADED POWER CONTROL REGISTER = %02x\n", mPowerControl);
+#endif
+    if (mHaltPoll != -1 && (previous == Mode::Powerdown || mode() == Mode::Powerdown)) {
+        setHaltPoll(mode() == Mode::Powerdown ? 0 : mHaltPoll);
+    }
+}
+
+uint8_t i386EXPowerControl::ioread8(uint16_t address)
+{
+    return mPowerControl;
+}
+
+uint64_t i386EXPowerControl::pollTimeout(uint16_t address)
+{
+    return UINT64_MAX;
+}
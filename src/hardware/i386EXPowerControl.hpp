@@ -0,0 +1,55 @@
+#ifndef I386EXPOWERCONTROL_HPP_
+#define I386EXPOWERCONTROL_HPP_
+
+#include "DevicePio.hpp"
+
+#include <cstdint>
+
+// power control register (PWRCON) of the 386EX clock and power management unit, the clock
+// prescaler (CLKPRS) next to it is i386EXClockPrescaler.
+//
+// with the in-kernel irqchip HLT never leaves the kernel, the vcpu thread blocks in kvm's halt
+// path until the next interrupt in every mode. what the mode changes is how long kvm polls before
+// it blocks: idle keeps the host default for a quick wake up, powerdown asks for a long sleep and
+// polling is turned off. the peripherals keep their clocks in powerdown, the host never sees the
+// cpu halt to stop them.
+
+class i386EXPowerControl : public DevicePio
+{
+public:
+    enum class Mode : uint8_t {
+        Disabled = 0,
+        Idle = 1,
+        Powerdown = 2
+    };
+
+private:
+    int mVmFd;
+    // the host's halt polling interval (ns), -1 if it can't be changed per vm
+    int64_t mHaltPoll;
+    uint8_t mPowerControl;
+
+    void setHaltPoll(uint64_t haltPoll);
+
+public:
+    i386EXPowerControl();
+    i386EXPowerControl(const i386EXPowerControl&) = delete;
+    i386EXPowerControl(i386EXPowerControl&&) = delete;
+
+    virtual ~i386EXPowerControl() = default;
+
+    i386EXPowerControl& operator=(const i386EXPowerControl&) = delete;
+    i386EXPowerControl& operator=(i386EXPowerControl&&) = delete;
+
+    // without KVM_CAP_HALT_POLL the modes only differ in what the register reads back
+    bool start(int vmFd);
+
+    Mode mode() const;
+
+    // DevicePio implementation
+    void iowrite8(uint16_t address, uint8_t value) override;
+    uint8_t ioread8(uint16_t address) override;
+    uint64_t pollTimeout(uint16_t address) override;
+};
+
+#endif /* I386EXPOWERCONTROL_HPP_ */
@@ -1,25 +1,44 @@
+#include <algorithm>
 #include <cassert>
+#include <cctype>
 #include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <map>
 #include <memory>
+#include <string>
 
 #include <fcntl.h>
+#include <getopt.h>
 #include <signal.h>
+#include <strings.h>
 #include <unistd.h>
 #include <linux/kvm.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 
 #include "AddressRange.hpp"
+#include "DeviceActivity.hpp"
+#include "EventLoopPool.hpp"
+#include "GuestMemory.hpp"
+#include "PollDetector.hpp"
+#include "VirtualClock.hpp"
 #include "hardware/ChipSelectUnit.hpp"
+#include "hardware/ExternalDevice.hpp"
 #include "hardware/Timer.hpp"
+#include "hardware/i386EXDMAController.hpp"
 #include "hardware/i386EXClockPrescaler.hpp"
+#include "hardware/i386EXIOPorts.hpp"
+#include "hardware/i386EXPowerControl.hpp"
 #include "hardware/Serial.hpp"
+#include "hardware/HD44780.hpp"
 #include "hardware/HexDisplay.hpp"
+#include "hardware/Keyboard8042.hpp"
 #include "hardware/DS12887.hpp"
+#include "debug/GdbStub.hpp"
+#include "debug/GuestProfiler.hpp"
+#include "debug/TraceTrigger.hpp"
 
 //#define HIGH_MEMORY_SIZE (0x100000)
 #define HIGH_MEMORY_SIZE (0)
@@ -61,7 +80,7 @@ void handlerPOSTCode(bool is_write, uint16_t addr, void* data, size_t length, si
     }
 }
 
-void handlerKeyboard(bool is_write, uint16_t addr, void* data, size_t length, size_t count) {
+void handlerSpeaker(bool is_write, uint16_t addr, void* data, size_t length, size_t count) {
     //fprintf(stderr, "PC SPEAKER ACCESSED\n");
     uint8_t* data_ = reinterpret_cast<uint8_t*>(data);
     if (!is_write) {
@@ -87,10 +106,6 @@ void handlerUnhandled(bool is_write, uint16_t addr, void* data, size_t length, s
     }
 }
 
-void handlerLCD(bool is_write, uint16_t addr, void* data, size_t length, size_t count) {
-    fprintf(stderr, "LCD ACCESSED\n");
-}
-
 void handlerProductCode(bool is_write, uint16_t addr, void* data, size_t length, size_t count) {
     assert(length == 1);
     assert(count == 1);
@@ -146,26 +161,6 @@ void handlerA20Gate(bool is_write, uint16_t addr, void* data, size_t length, siz
     }
 }
 
-void handlerPort1Pin(bool is_write, uint16_t addr, void* data, size_t length, size_t count) {
-    assert(length == 1);
-    assert(count == 1);
-
-    if (!is_write) {
-        fprintf(stderr, "REQUESTED JUMPER VALUES (386 PORT1)\n", a20register);
-        *reinterpret_cast<uint8_t*>(data) = 0x80;
-    }
-}
-
-void handlerPort3Pin(bool is_write, uint16_t addr, void* data, size_t length, size_t count) {
-    assert(length == 1);
-    assert(count == 1);
-
-    if (!is_write) {
-        fprintf(stderr, "REQUESTED JUMPER VALUES (386 PORT3)\n", a20register);
-        *reinterpret_cast<uint8_t*>(data) = 0x04;
-    }
-}
-
 enum class FlashState {
     Read,
     CommandByte_1,
@@ -209,8 +204,7 @@ void handlerDiskRegisters(bool is_write, uint16_t addr, void* data, size_t lengt
 #endif
 
 std::map<AddressRange, io_handler_t> ioHandlerTable = {
-    { { 0x60,   0x05 }, handlerKeyboard },
-    { { 0x72,   0x02 }, handlerLCD },
+    { { 0x61,   0x03 }, handlerSpeaker },
     { { 0x74,   0x01 }, handlerProductCode },
     { { 0x75,   0x01 }, handlerOptionCode },
     { { 0x77,   0x01 }, handlerJumperRegister },
@@ -221,13 +215,287 @@ std::map<AddressRange, io_handler_t> ioHandlerTable = {
     { { 0xD000, 0x08 }, handlerDiskRegisters },
 #endif
     { { 0xF834, 0x01 }, handlerTimerConfiguration },
-    { { 0xF860, 0x01 }, handlerPort1Pin },
-    { { 0xF870, 0x01 }, handlerPort3Pin },
 };
 
+void usage(const char* program) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -p, --profile=HZ        sample the guest instruction pointer HZ times a second and\n"
+            "                          print a histogram on exit\n"
+            "      --profile-top=N     number of addresses in the profile report (default 32)\n"
+            "  -t, --trace=ADDR[:N]    single step N instructions (default 64) whenever the linear\n"
+            "                          address ADDR is executed\n"
+            "      --watch=ADDR[:N]    single step N instructions after ADDR is written\n"
+            "      --watch-rw=ADDR[:N] single step N instructions after ADDR is read or written\n"
+            "  -g, --gdb=PATH          serve the gdb remote protocol on the unix socket PATH\n"
+            "      --gdb-wait          keep the cpu stopped at the reset vector until gdb continues\n"
+            "      --cmos=PATH         battery backed ram of the RTC (default roms/cmos.bin)\n"
+            "      --rtc=host|virtual[:SECONDS]\n"
+            "                          start the RTC at the host's local time (default), or at a\n"
+            "                          fixed time (seconds since 1970, default 2000-01-01) so\n"
+            "                          runs are repeatable\n"
+            "      --device-threads=N  number of device event loop threads (default 1, at most one\n"
+            "                          per cpu). the timer and RTC run on the first, COM1-4 on\n"
+            "                          the following ones\n"
+            "      --device-cpus=LIST  cpus the device threads may run on, e.g. \"2-3\"\n"
+            "      --pit=kernel|user   timer implementation: the in-kernel i8254 (default) or the\n"
+            "                          userspace 386EX timer that follows the clock prescaler\n"
+            "      --com1..--com4=unix:PATH|tcp:[HOST:]PORT|pty|file:PATH|null\n"
+            "                          host side of a serial port (default\n"
+            "                          unix:/tmp/3100.comN.socket). tcp listens on 127.0.0.1\n"
+            "                          unless HOST is given, file captures output only\n"
+            "      --pacing=[comN:]off|accurate|FACTOR\n"
+            "                          baud rate pacing of one (or every) serial port: off, as\n"
+            "                          programmed (default) or FACTOR times faster\n"
+            "      --poll-wait=USEC    longest a vcpu spinning on an unchanged device register\n"
+            "                          sleeps before reading it again (default 1000, 0 never)\n"
+            "      --rs485=comN        make a serial port half duplex like the MAX485 option, RTS\n"
+            "                          switches between transmitting and receiving\n"
+            "      --keyboard=unix:PATH|tcp:[HOST:]PORT|pty|null\n"
+            "                          where the 8042 gets set 1 scan codes from (default\n"
+            "                          unix:/tmp/3100.keyboard.socket)\n"
+            "      --lcd=PATH          unix socket lcd viewers connect to (default\n"
+            "                          /tmp/3100.lcd.socket)\n"
+            "      --gpio=PATH         unix socket a fixture driving the 386EX i/o ports connects\n"
+            "                          to (default /tmp/3100.gpio.socket)\n"
+            "      --pc104=PATH        attach the PC/104 device process listening on the unix\n"
+            "                          socket PATH, it claims its own i/o or memory range. may be\n"
+            "                          given more than once\n"
+            "  -h, --help              show this message\n",
+            program);
+}
+
 int main (int argc, char** argv) {
     assert(PAGE_SIZE == getpagesize());
 
+    // ----------------------- COMMAND LINE -----------------------------------------
+    unsigned profileFrequency = 0;
+    size_t profileTop = 32;
+    TraceTrigger traceTriggers;
+    std::string gdbSocketName;
+    bool gdbWait = false;
+    bool userspacePIT = false;
+    std::string cmosPath = "roms/cmos.bin";
+    int64_t rtcStartTime = -1;
+    size_t deviceThreads = 1;
+    cpu_set_t deviceCpus;
+    bool deviceCpusSet = false;
+    std::string serialSpecs[4];
+    std::string keyboardSpec = "unix:/tmp/3100.keyboard.socket";
+    std::string lcdSocketName = "/tmp/3100.lcd.socket";
+    std::string gpioSocketName = "/tmp/3100.gpio.socket";
+    std::vector<std::string> pc104SocketNames;
+    Serial16450::Pacing serialPacing[4];
+    unsigned serialPacingScale[4];
+    bool serialRs485[4] = {};
+    uint64_t pollWait = 1000;
+    for (int i = 0; i < 4; i++) {
+        serialSpecs[i] = "unix:/tmp/3100.com" + std::to_string(i + 1) + ".socket";
+        serialPacing[i] = Serial16450::Pacing::Accurate;
+        serialPacingScale[i] = 1;
+    }
+
+    static const struct option longOptions[] = {
+        { "profile",     required_argument, nullptr, 'p' },
+        { "profile-top", required_argument, nullptr, 'P' },
+        { "trace",       required_argument, nullptr, 't' },
+        { "watch",       required_argument, nullptr, 'w' },
+        { "watch-rw",    required_argument, nullptr, 'W' },
+        { "gdb",         required_argument, nullptr, 'g' },
+        { "gdb-wait",    no_argument,       nullptr, 'G' },
+        { "pit",         required_argument, nullptr, 'T' },
+        { "cmos",        required_argument, nullptr, 'C' },
+        { "rtc",         required_argument, nullptr, 'R' },
+        { "device-threads", required_argument, nullptr, 'D' },
+        { "device-cpus", required_argument, nullptr, 'A' },
+        { "com1",        required_argument, nullptr, '1' },
+        { "com2",        required_argument, nullptr, '2' },
+        { "com3",        required_argument, nullptr, '3' },
+        { "com4",        required_argument, nullptr, '4' },
+        { "keyboard",    required_argument, nullptr, 'K' },
+        { "lcd",         required_argument, nullptr, 'L' },
+        { "gpio",        required_argument, nullptr, 'O' },
+        { "pc104",       required_argument, nullptr, 'X' },
+        { "pacing",      required_argument, nullptr, 'S' },
+        { "rs485",       required_argument, nullptr, 'M' },
+        { "poll-wait",   required_argument, nullptr, 'I' },
+        { "help",        no_argument,       nullptr, 'h' },
+        { nullptr,       0,                 nullptr, 0 }
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "p:t:g:h", longOptions, nullptr)) != -1) {
+        switch (option) {
+            case 'p':
+                profileFrequency = strtoul(optarg, nullptr, 0);
+                if (!profileFrequency) {
+                    fprintf(stderr, "invalid profile frequency: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'P':
+                profileTop = strtoul(optarg, nullptr, 0);
+                break;
+            case 't':
+            case 'w':
+            case 'W':
+            {
+                TraceTrigger::Trigger trigger;
+                TraceTrigger::Type type = (option == 't') ? TraceTrigger::Type::Execute
+                        : (option == 'w') ? TraceTrigger::Type::Write
+                        : TraceTrigger::Type::Access;
+                if (!TraceTrigger::parse(optarg, type, trigger)) {
+                    fprintf(stderr, "invalid trace trigger: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                if (!traceTriggers.addTrigger(trigger)) {
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case 'g':
+                gdbSocketName = optarg;
+                break;
+            case 'G':
+                gdbWait = true;
+                break;
+            case 'T':
+                if (!strcmp(optarg, "user")) {
+                    userspacePIT = true;
+                } else if (strcmp(optarg, "kernel")) {
+                    fprintf(stderr, "invalid pit implementation: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'C':
+                cmosPath = optarg;
+                break;
+            case 'R':
+                if (!strcmp(optarg, "host")) {
+                    rtcStartTime = -1;
+                } else if (!strcmp(optarg, "virtual")) {
+                    rtcStartTime = 946684800;
+                } else if (!strncmp(optarg, "virtual:", 8)) {
+                    char* end;
+                    rtcStartTime = strtoll(optarg + 8, &end, 0);
+                    if (*end || rtcStartTime < 0) {
+                        fprintf(stderr, "invalid rtc start time: %s\n", optarg + 8);
+                        return EXIT_FAILURE;
+                    }
+                } else {
+                    fprintf(stderr, "invalid rtc mode: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'D':
+            {
+                // strtoul would take "-1" as ULONG_MAX
+                char* end;
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                deviceThreads = strtoul(optarg, &end, 0);
+                if (*end || !isdigit((unsigned char) *optarg) || !deviceThreads
+                        || (cpus > 0 && deviceThreads > (size_t) cpus)) {
+                    fprintf(stderr, "invalid number of device threads: %s (1 to %ld)\n", optarg,
+                            std::max(cpus, 1L));
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case 'A':
+                if (!EventLoopPool::parseCpuList(optarg, deviceCpus)) {
+                    fprintf(stderr, "invalid cpu list: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                deviceCpusSet = true;
+                break;
+            case '1':
+            case '2':
+            case '3':
+            case '4':
+                if (!SerialBackend::create(optarg)) {
+                    fprintf(stderr, "invalid serial backend: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                serialSpecs[option - '1'] = optarg;
+                break;
+            case 'K':
+                // a file only takes guest output, the keyboard has none
+                if (!strncmp(optarg, "file:", 5) || !SerialBackend::create(optarg)) {
+                    fprintf(stderr, "invalid keyboard backend: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                keyboardSpec = optarg;
+                break;
+            case 'L':
+                lcdSocketName = optarg;
+                break;
+            case 'O':
+                gpioSocketName = optarg;
+                break;
+            case 'X':
+                pc104SocketNames.push_back(optarg);
+                break;
+            case 'S':
+            {
+                // "comN:" selects one port, otherwise all of them
+                int first = 0, last = 3;
+                const char* mode = optarg;
+                if (!strncasecmp(optarg, "com", 3) && optarg[3] >= '1' && optarg[3] <= '4'
+                        && optarg[4] == ':') {
+                    first = last = optarg[3] - '1';
+                    mode = optarg + 5;
+                }
+
+                Serial16450::Pacing pacing;
+                unsigned scale;
+                if (!Serial16450::parsePacing(mode, pacing, scale)) {
+                    fprintf(stderr, "invalid serial pacing: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                for (int i = first; i <= last; i++) {
+                    serialPacing[i] = pacing;
+                    serialPacingScale[i] = scale;
+                }
+                break;
+            }
+            case 'M':
+                if (strncasecmp(optarg, "com", 3) || optarg[3] < '1' || optarg[3] > '4'
+                        || optarg[4]) {
+                    fprintf(stderr, "invalid serial port: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                serialRs485[optarg[3] - '1'] = true;
+                break;
+            case 'I':
+            {
+                char* end;
+                pollWait = strtoull(optarg, &end, 0);
+                if (*end || !*optarg || pollWait > 1000000) {
+                    fprintf(stderr, "invalid poll wait: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    // both own the guest debug registers
+    if (!gdbSocketName.empty() && !traceTriggers.empty()) {
+        fprintf(stderr, "trace triggers can't be used together with the gdb stub.\n");
+        return EXIT_FAILURE;
+    }
+    if (gdbWait && gdbSocketName.empty()) {
+        fprintf(stderr, "--gdb-wait requires --gdb.\n");
+        return EXIT_FAILURE;
+    }
+
     // open the kvm handle
     int kvmFd = open("/dev/kvm", O_RDWR | O_CLOEXEC);
     if (kvmFd == -1) {
@@ -454,62 +722,56 @@ int main (int argc, char** argv) {
     };
 #endif
 
-    ret = ioctl(vmFd, KVM_SET_USER_MEMORY_REGION, &regionRam);
-    if (ret == -1) {
+    // every slot change goes through guestMemory, which keeps the translation table for the
+    // debuggers and the dma unit
+    GuestMemory guestMemory(vmFd);
+    if (!guestMemory.setRegion(regionRam)) {
         perror("KVM_SET_USER_MEMORY_REGION");
         return EXIT_FAILURE;
     }
 
-    ret = ioctl(vmFd, KVM_SET_USER_MEMORY_REGION, &regionRomDos);
-    if (ret == -1) {
+    if (!guestMemory.setRegion(regionRomDos)) {
         perror("KVM_SET_USER_MEMORY_REGION");
         return EXIT_FAILURE;
     }
 
-    ret = ioctl(vmFd, KVM_SET_USER_MEMORY_REGION, &regionBios);
-    if (ret == -1) {
+    if (!guestMemory.setRegion(regionBios)) {
         perror("KVM_SET_USER_MEMORY_REGION");
         return EXIT_FAILURE;
     }
 
 #if HIGH_MEMORY_SIZE
     // wrap is disabled (a20 line enabled) by default on 386EX
-    ret = ioctl(vmFd, KVM_SET_USER_MEMORY_REGION, &regionRamWrapHighMem);
-    if (ret == -1) {
+    if (!guestMemory.setRegion(regionRamWrapHighMem)) {
         perror("KVM_SET_USER_MEMORY_REGION");
         return EXIT_FAILURE;
     }
 #endif
 
-    ret = ioctl(vmFd, KVM_SET_USER_MEMORY_REGION, &regionFlash);
-    if (ret == -1) {
+    if (!guestMemory.setRegion(regionFlash)) {
         perror("KVM_SET_USER_MEMORY_REGION");
         return EXIT_FAILURE;
     }
 
-    ret = ioctl(vmFd, KVM_SET_USER_MEMORY_REGION, &regionFlashAlias);
-    if (ret == -1) {
+    if (!guestMemory.setRegion(regionFlashAlias)) {
         perror("KVM_SET_USER_MEMORY_REGION");
         return EXIT_FAILURE;
     }
 
 #if (defined VIRTUAL_DISK)
-    ret = ioctl(vmFd, KVM_SET_USER_MEMORY_REGION, &regionOptionRom);
-    if (ret == -1) {
+    if (!guestMemory.setRegion(regionOptionRom)) {
         perror("KVM_SET_USER_MEMORY_REGION");
         return EXIT_FAILURE;
     }
 
-    ret = ioctl(vmFd, KVM_SET_USER_MEMORY_REGION, &regionOptionRom_Boot);
-    if (ret == -1) {
+    if (!guestMemory.setRegion(regionOptionRom_Boot)) {
         perror("KVM_SET_USER_MEMORY_REGION");
         return EXIT_FAILURE;
     }
 #endif
 
 #if 0
-    ret = ioctl(vmFd, KVM_SET_USER_MEMORY_REGION, &regionVGARom);
-    if (ret == -1) {
+    if (!guestMemory.setRegion(regionVGARom)) {
         perror("KVM_SET_USER_MEMORY_REGION");
         return EXIT_FAILURE;
     }
@@ -522,11 +784,14 @@ int main (int argc, char** argv) {
         return EXIT_FAILURE;
     }
 
-    struct kvm_pit_config configurationPIT = { .flags = KVM_PIT_SPEAKER_DUMMY };
-    ret = ioctl(vmFd, KVM_CREATE_PIT2, &configurationPIT);
-    if (ret == -1) {
-        perror("KVM_CREATE_PIT2");
-        return EXIT_FAILURE;
+    // the userspace timer is created with the other devices
+    if (!userspacePIT) {
+        struct kvm_pit_config configurationPIT = { .flags = KVM_PIT_SPEAKER_DUMMY };
+        ret = ioctl(vmFd, KVM_CREATE_PIT2, &configurationPIT);
+        if (ret == -1) {
+            perror("KVM_CREATE_PIT2");
+            return EXIT_FAILURE;
+        }
     }
 
     // create a virtual cpu for the vm
@@ -582,59 +847,118 @@ int main (int argc, char** argv) {
         return EXIT_FAILURE;
     }
 
+    // setup guest debugging (single step everything if DISASSEMBLE is enabled)
 #ifdef DISASSEMBLE
-    // enable single stepping
-    struct kvm_guest_debug debug = {
-        .control = KVM_GUESTDBG_ENABLE | KVM_GUESTDBG_SINGLESTEP
-    };
-
-    ret = ioctl(vcpuFd, KVM_SET_GUEST_DEBUG, &debug);
-    if (ret == -1) {
-        perror("KVM_SET_GUEST_DEBUG");
+    bool singleStepAll = true;
+#else
+    bool singleStepAll = false;
+#endif
+    if (!traceTriggers.start(vcpuFd, singleStepAll)) {
         return EXIT_FAILURE;
     }
-#endif /* NDEBUG */
 
-    EventLoop deviceEventLoop;
+    // device event loops, index 0 for the timekeeping devices and the debugger
+    EventLoopPool devicePool(deviceThreads);
+    if (deviceCpusSet && !devicePool.setAffinity(deviceCpus)) {
+        perror("unable to set device thread affinity");
+        return EXIT_FAILURE;
+    }
+    VirtualClock virtualClock;
 
     // -------------------- DEVICES ----------------------
     std::map<AddressRange, std::shared_ptr<DevicePio>> pioDeviceTable;
 
-    //auto timer0 = std::make_shared<ProgrammableIntervalTimer>();
-    //pioDeviceTable.emplace(AddressRange{0x40, 0x04}, timer0);
-
-    // virtual device: 386EX prescaler unit
+    // virtual device: 386EX prescaler unit (and the timers it drives)
     std::vector<std::shared_ptr<Prescalable>> prescalableDevices = { };
+    if (userspacePIT) {
+        auto timer0 = std::make_shared<ProgrammableIntervalTimer>(devicePool[0],
+                virtualClock);
+        if (!timer0->start(vmFd, 0)) {
+            return EXIT_FAILURE;
+        }
+        pioDeviceTable.emplace(AddressRange{0x40, 0x04}, timer0);
+        prescalableDevices.push_back(timer0);
+    }
     auto prescaler = std::make_shared<i386EXClockPrescaler>(prescalableDevices);
     pioDeviceTable.emplace(AddressRange{0xF804, 0x02}, prescaler);
-    
-    // virtual device: COM1
-    auto com1 = std::make_shared<Serial16450>(deviceEventLoop);
-    if (!com1->start("/tmp/3100.com1.socket", vmFd, 4)) {
+
+    // virtual device: 386EX power control (idle and powerdown)
+    auto powerControl = std::make_shared<i386EXPowerControl>();
+    if (!powerControl->start(vmFd)) {
         return EXIT_FAILURE;
     }
-    pioDeviceTable.emplace(AddressRange{0x03f8, 0x08}, com1);
+    pioDeviceTable.emplace(AddressRange{0xF800, 0x01}, powerControl);
+
+    // virtual device: 386EX DMA unit (DMAINT on the slave 8259's IR4, IRQ12)
+    auto dma = std::make_shared<i386EXDMAController>(devicePool[0], guestMemory);
+    if (!dma->start(vmFd, 12)) {
+        return EXIT_FAILURE;
+    }
+    pioDeviceTable.emplace(AddressRange{0x00, 0x10}, dma);
+    pioDeviceTable.emplace(AddressRange{0x83, 0x01}, dma);
+    pioDeviceTable.emplace(AddressRange{0x87, 0x01}, dma);
+    pioDeviceTable.emplace(AddressRange{0xF000, 0x20}, dma);
+    pioDeviceTable.emplace(AddressRange{0xF083, 0x01}, dma);
+    pioDeviceTable.emplace(AddressRange{0xF085, 0x03}, dma);
+    pioDeviceTable.emplace(AddressRange{0xF098, 0x02}, dma);
+    pioDeviceTable.emplace(AddressRange{0xF830, 0x01}, dma);
+
+    // virtual devices: COM1-4, each on the next device thread. COM1 and COM2 are the 386EX's
+    // SIO0 and SIO1, which the DMA unit can serve
+    static const struct {
+        uint16_t base;
+        uint32_t gsi;
+    } serialPorts[4] = {
+        { 0x03f8, 4 }, { 0x02f8, 3 }, { 0x03e8, 4 }, { 0x02e8, 3 }
+    };
+    for (size_t i = 0; i < 4; i++) {
+        auto port = std::make_shared<Serial16450>(devicePool[i + 1]);
+        port->setPacing(serialPacing[i], serialPacingScale[i]);
+        port->setRs485(serialRs485[i]);
+        if (i == 0) {
+            port->setDma(dma, i386EXDMAController::Request::Sio0Receive,
+                    i386EXDMAController::Request::Sio0Transmit);
+        } else if (i == 1) {
+            port->setDma(dma, i386EXDMAController::Request::Sio1Receive,
+                    i386EXDMAController::Request::Sio1Transmit);
+        }
+        if (!port->start(SerialBackend::create(serialSpecs[i]), vmFd, serialPorts[i].gsi)) {
+            return EXIT_FAILURE;
+        }
+        if (serialSpecs[i].compare(0, 5, "unix:")) {
+            fprintf(stderr, "COM%zu: %s\n", i + 1, port->name().c_str());
+        }
+        pioDeviceTable.emplace(AddressRange{serialPorts[i].base, 0x08}, port);
+    }
 
-    // virtual device: COM2
-    auto com2 = std::make_shared<Serial16450>(deviceEventLoop);
-    if (!com2->start("/tmp/3100.com2.socket", vmFd, 3)) {
+    // virtual device: 386EX i/o ports. with nothing connected the pins of ports 1 and 3 read the
+    // jumper values the BIOS expects
+    auto ioPorts = std::make_shared<i386EXIOPorts>(devicePool[0], 0x80, 0xFF, 0x04);
+    if (!ioPorts->start(gpioSocketName)) {
         return EXIT_FAILURE;
     }
-    pioDeviceTable.emplace(AddressRange{0x02f8, 0x08}, com2);
+    pioDeviceTable.emplace(AddressRange{0xF820, 0x06}, ioPorts);
+    for (uint16_t portAddress = 0xF860; portAddress <= 0xF870; portAddress += 0x08) {
+        pioDeviceTable.emplace(AddressRange{portAddress, 0x06}, ioPorts);
+    }
 
-    // virtual device: COM3
-    auto com3 = std::make_shared<Serial16450>(deviceEventLoop);
-    if (!com3->start("/tmp/3100.com3.socket", vmFd, 4)) {
+    // virtual device: 8042 keyboard controller (IRQ1)
+    auto keyboard = std::make_shared<Keyboard8042>(devicePool[0]);
+    if (!keyboard->start(SerialBackend::create(keyboardSpec), vmFd, 1)) {
         return EXIT_FAILURE;
     }
-    pioDeviceTable.emplace(AddressRange{0x03e8, 0x08}, com3);
+    if (keyboardSpec.compare(0, 5, "unix:")) {
+        fprintf(stderr, "keyboard: %s\n", keyboard->name().c_str());
+    }
+    pioDeviceTable.emplace(AddressRange{0x60, 0x01}, keyboard);
+    pioDeviceTable.emplace(AddressRange{0x64, 0x01}, keyboard);
 
-    // virtual device: COM4
-    auto com4 = std::make_shared<Serial16450>(deviceEventLoop);
-    if (!com4->start("/tmp/3100.com4.socket", vmFd, 3)) {
+    // virtual device: HD44780 lcd
+    auto lcd = std::make_shared<HD44780>(devicePool[0]);
+    if (!lcd->start(lcdSocketName)) {
         return EXIT_FAILURE;
     }
-    pioDeviceTable.emplace(AddressRange{0x02e8, 0x08}, com4);
+    pioDeviceTable.emplace(AddressRange{0x72, 0x02}, lcd);
 
     // virtual device: Hex Display
     auto hexDisplay = std::make_shared<HexDisplay>();
@@ -651,9 +975,56 @@ int main (int argc, char** argv) {
     }
 
     // virtual device: RTC
-    auto rtc = std::make_shared<DS12887>();
+    auto rtc = std::make_shared<DS12887>(devicePool[0], virtualClock);
+    if (rtcStartTime != -1) {
+        rtc->resetTime(rtcStartTime);
+    }
+    if (!rtc->start(cmosPath, vmFd, 8)) {
+        return EXIT_FAILURE;
+    }
     pioDeviceTable.emplace(AddressRange{0x70, 0x02}, rtc);
 
+    // external devices: PC/104 devices in processes of their own, claiming their ranges
+    std::map<AddressRange, std::shared_ptr<ExternalDevice>> mmioDeviceTable;
+    for (auto& socketName : pc104SocketNames) {
+        auto device = std::make_shared<ExternalDevice>(devicePool[0]);
+        if (!device->start(socketName, vmFd)) {
+            return EXIT_FAILURE;
+        }
+
+        const ExternalDevice::Claim& claim = device->claim();
+        AddressRange range{claim.base, claim.length};
+        bool claimed = true;
+        if (claim.space == ExternalDevice::Space::IO) {
+            claimed = !ioHandlerTable.count(range) && pioDeviceTable.emplace(range, device).second;
+        } else {
+            // accesses to memory slots never exit
+            std::vector<const struct kvm_userspace_memory_region*> regions = {
+                &regionRam, &regionRomDos, &regionBios, &regionRamWrap, &regionFlash,
+                &regionFlashAlias
+            };
+#if (HIGH_MEMORY_SIZE)
+            regions.push_back(&regionRamWrapHighMem);
+#endif
+#if (defined VIRTUAL_DISK)
+            regions.push_back(&regionOptionRom);
+            regions.push_back(&regionOptionRom_Boot);
+#endif
+            for (auto* region : regions) {
+                if (claim.base < region->guest_phys_addr + region->memory_size
+                        && region->guest_phys_addr < claim.base + claim.length) {
+                    claimed = false;
+                }
+            }
+            claimed = claimed && mmioDeviceTable.emplace(range, device).second;
+        }
+        if (!claimed) {
+            fprintf(stderr, "%s: the claimed range %" PRIx64 "-%" PRIx64 " is in use.\n",
+                    device->name().c_str(), claim.base, claim.base + claim.length - 1);
+            return EXIT_FAILURE;
+        }
+    }
+
 #ifdef DISASSEMBLE
     // setup a disassembly library
     ZydisDecoder decoderReal, decoderP16, decoderP32;
@@ -667,13 +1038,48 @@ int main (int argc, char** argv) {
     // signals
     signal(SIGINT, sigintHandler);
 
+    // guest profiler (symbolized against the memory map above)
+    std::unique_ptr<GuestProfiler> profiler;
+    if (profileFrequency) {
+        profiler = std::make_unique<GuestProfiler>(profileFrequency);
+        profiler->addRegion(0x00000, LOW_MEMORY_SIZE, "ram");
+#if (defined VIRTUAL_DISK)
+        profiler->addRegion(0xC8000, 0x2000, "option-rom");
+#endif
+        profiler->addRegion(0xE0000, 0x10000, "dos-rom");
+        profiler->addRegion(0xF0000, 0x10000, "bios");
+        profiler->addRegion(0x03460000, 0x10000, "flash:dos-rom");
+        profiler->addRegion(0x03470000, 0x10000, "flash:bios");
+        profiler->addRegion(0x03400000, 0x60000, "flash:disk");
+        if (!profiler->start(vcpuFd, vcpuRun)) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    // gdb stub (memory is accessed through guestMemory)
+    std::unique_ptr<GdbStub> gdbStub;
+    if (!gdbSocketName.empty()) {
+        gdbStub = std::make_unique<GdbStub>(devicePool[0], guestMemory);
+        if (!gdbStub->start(gdbSocketName, vcpuFd, vcpuRun, gdbWait)) {
+            return EXIT_FAILURE;
+        }
+    }
+
     // run until halt instruction is found
+    PollDetector pollDetector(pollWait * 1000);
     bool previousWasDebug = false;
     uint8_t lastA20Register = a20register;
     while (!requestExit) {
+        if (gdbStub) {
+            gdbStub->poll(requestExit);
+        }
+
         ret = ioctl(vcpuFd, KVM_RUN, NULL);
         if (ret == -1) {
             if (errno == EINTR) {
+                if (profiler) {
+                    profiler->poll();
+                }
                 continue;
             } else {
                 fprintf(stderr, "internal error occurred: %s\n", strerror(errno));
@@ -681,48 +1087,35 @@ int main (int argc, char** argv) {
             }
         }
 
+        // trace if a trigger is active (or everything if DISASSEMBLE is enabled)
+        bool traceInstructions = false;
+        if (vcpuRun->exit_reason == KVM_EXIT_DEBUG) {
+            if (gdbStub && gdbStub->handleDebugExit(vcpuRun->debug.arch, requestExit)) {
+                continue;
+            }
+            traceInstructions = traceTriggers.handleDebugExit(vcpuRun->debug.arch);
+        }
 #ifdef DISASSEMBLE
-        // get the register state
-        memset(&regs, 0, sizeof regs);
-        memset(&sregs, 0, sizeof sregs);
-        ioctl(vcpuFd, KVM_GET_REGS, &regs);
-        ioctl(vcpuFd, KVM_GET_SREGS, &sregs);
-
         if (!previousWasDebug || vcpuRun->exit_reason == KVM_EXIT_DEBUG) {
-            // figure out the memory region the instruction pointer is in
+            traceInstructions = true;
+        } else {
+            previousWasDebug = false;
+        }
+#endif /* DISASSEMBLE */
+
+        if (traceInstructions) {
+            // get the register state
+            memset(&regs, 0, sizeof regs);
+            memset(&sregs, 0, sizeof sregs);
+            ioctl(vcpuFd, KVM_GET_REGS, &regs);
+            ioctl(vcpuFd, KVM_GET_SREGS, &sregs);
+
+#ifdef DISASSEMBLE
+            // the decoder reads straight out of the slot the instruction pointer is in
             ZyanUSize ip = sregs.cs.base + regs.rip;
             ZyanUSize offset = 0;
-            ZyanUSize length = 0;
-            uint8_t* codeBuffer = NULL;
-            if (ip < 0xA0000) {
-                codeBuffer = ram;
-                offset = ip;
-                length = 0xA0000 - offset;
-            }
-#if 0
-            else if (ip >= 0xC0000 && ip < 0xC8000) {
-                codeBuffer = vgaRom;
-                offset = ip & 0x7FFF;
-                length = 0x8000 - ip;
-            }
-#endif
-            else if (ip >= 0xC8000 && ip < 0xCA000) {
-                codeBuffer = optionRom;
-                offset = ip & 0x1FFF;
-                length = 0x2000 - ip;
-            } else if (ip >= 0xE0000 && ip < 0xF0000) {
-                codeBuffer = flashMemory + 0x60000;
-                offset = ip & 0xFFFF;
-                length = 0x10000 - ip;
-            } else if (ip >= 0xF0000 && ip < 0x100000) {
-                codeBuffer = flashMemory + 0x70000;
-                offset = ip & 0xFFFF;
-                length = 0x10000 - ip;
-            } else if (ip >= 0x3400000 && ip <= 0x34FFFFF) {
-                codeBuffer = flashMemory;
-                offset = ip & 0x7FFFF;
-                length = 0x80000 - offset;
-            }
+            size_t length = 0;
+            uint8_t* codeBuffer = guestMemory.translate(ip, &length);
 
             ZydisDecodedInstruction instruction;
             int count = 8;
@@ -759,10 +1152,17 @@ int main (int argc, char** argv) {
                 length -= instruction.length;
             }
             fprintf(stderr, "--- ----------------- ---\n");
-        } else {
-            previousWasDebug = false;
+#else
+            fprintf(stderr, "[%08llx:%08llx]  eax=%08llx ebx=%08llx ecx=%08llx edx=%08llx "
+                    "esi=%08llx edi=%08llx ebp=%08llx esp=%08llx eflags=%08llx\n",
+                    sregs.cs.base, regs.rip, regs.rax, regs.rbx, regs.rcx, regs.rdx,
+                    regs.rsi, regs.rdi, regs.rbp, regs.rsp, regs.rflags);
+#endif /* DISASSEMBLE */
+        }
+
+        if (vcpuRun->exit_reason != KVM_EXIT_IO) {
+            pollDetector.reset();
         }
-#endif /* NDEBUG */
 
         switch (vcpuRun->exit_reason) {
             case KVM_EXIT_HLT:
@@ -780,12 +1180,21 @@ int main (int argc, char** argv) {
                 if (device != pioDeviceTable.end()) {
                     // new device pio structure
                     assert(vcpuRun->io.count == 1);
+                    uint32_t generation = DeviceActivity::generation();
                     device->second->performKVMExitOperation(
                             vcpuRun->io.direction == KVM_EXIT_IO_OUT,
                             vcpuRun->io.port,
                             ((char *) vcpuRun) + vcpuRun->io.data_offset,
                             vcpuRun->io.size);
+                    if (vcpuRun->io.direction == KVM_EXIT_IO_IN) {
+                        pollDetector.read(*device->second, vcpuRun->io.port,
+                                ((char *) vcpuRun) + vcpuRun->io.data_offset,
+                                vcpuRun->io.size, generation);
+                    } else {
+                        pollDetector.reset();
+                    }
                 } else {
+                    pollDetector.reset();
                     // old static handler structure
                     io_handler_t handlerFunc = handlerUnhandled;
                     auto handler = ioHandlerTable.find(vcpuRun->io.port);
@@ -804,25 +1213,22 @@ int main (int argc, char** argv) {
 #if (HIGH_MEMORY_SIZE)
                     // if we have high mem, we have to unmap memory before selecting upper memory
                     // or wrapping the lower memory
-                    ret = ioctl(vmFd, KVM_SET_USER_MEMORY_REGION, &regionRamWrapDisabled);
-                    if (ret == -1) {
+                    if (!guestMemory.setRegion(regionRamWrapDisabled)) {
                         perror("KVM_SET_USER_MEMORY_REGION");
                         return EXIT_FAILURE;
                     }
 #endif
                     if (a20register & 2) {
 #if (HIGH_MEMORY_SIZE)
-                        ret = ioctl(vmFd, KVM_SET_USER_MEMORY_REGION, &regionRamWrapHighMem);
+                        if (!guestMemory.setRegion(regionRamWrapHighMem)) {
 #else
-                        ret = ioctl(vmFd, KVM_SET_USER_MEMORY_REGION, &regionRamWrapDisabled);
+                        if (!guestMemory.setRegion(regionRamWrapDisabled)) {
 #endif
-                        if (ret == -1) {
                             perror("KVM_SET_USER_MEMORY_REGION");
                             return EXIT_FAILURE;
                         }
                     } else {
-                        ret = ioctl(vmFd, KVM_SET_USER_MEMORY_REGION, &regionRamWrap);
-                        if (ret == -1) {
+                        if (!guestMemory.setRegion(regionRamWrap)) {
                             perror("KVM_SET_USER_MEMORY_REGION");
                             return EXIT_FAILURE;
                         }
@@ -834,8 +1240,7 @@ int main (int argc, char** argv) {
                 // check if the disk registers were changed
                 if (updateDiskMapping) {
                     // unmap existing data
-                    ret = ioctl(vmFd, KVM_SET_USER_MEMORY_REGION, &regionOptionRom_Unmap);
-                    if (ret == -1) {
+                    if (!guestMemory.setRegion(regionOptionRom_Unmap)) {
                         perror("KVM_SET_USER_MEMORY_REGION (unmap disk)");
                         return EXIT_FAILURE;
                     }
@@ -865,8 +1270,7 @@ int main (int argc, char** argv) {
 
                     // update mapping
                     regionOptionRom_Disk.userspace_addr = (uint64_t) diskData;
-                    ret = ioctl(vmFd, KVM_SET_USER_MEMORY_REGION, &regionOptionRom_Disk);
-                    if (ret == -1) {
+                    if (!guestMemory.setRegion(regionOptionRom_Disk)) {
                         perror("KVM_SET_USER_MEMORY_REGION (map disk)");
                         return EXIT_FAILURE;
                     }
@@ -887,6 +1291,14 @@ int main (int argc, char** argv) {
                         ring->first = (ring->first + 1) % KVM_COALESCED_MMIO_MAX;
                     }   
                 }*/
+            {
+                auto device = mmioDeviceTable.find(vcpuRun->mmio.phys_addr);
+                if (device != mmioDeviceTable.end()) {
+                    device->second->performMmioOperation(vcpuRun->mmio.is_write,
+                            vcpuRun->mmio.phys_addr, vcpuRun->mmio.data, vcpuRun->mmio.len);
+                    break;
+                }
+            }
 #if (defined VIRTUAL_DISK)
                 // the flash disk is being accessed
                 if (vcpuRun->mmio.phys_addr >= 0x3400000 && vcpuRun->mmio.phys_addr < 0x350000) {
@@ -901,7 +1313,11 @@ int main (int argc, char** argv) {
                         uint8_t command = *reinterpret_cast<uint8_t*>(vcpuRun->mmio.data);
                         //fprintf(stderr, "data:%02x\n", command);
                         if (flashState == FlashState::Program) {
-                            flashMemory[offset] = command;
+                            // the slot is read only to the guest, not to the chip
+                            uint8_t* cell = guestMemory.span(0x3400000 + offset, 1);
+                            if (cell) {
+                                *cell = command;
+                            }
                             flashState = FlashState::Read;
                         } else if (command == 0xF0) {
                             // reset device
@@ -924,12 +1340,18 @@ int main (int argc, char** argv) {
                             fprintf(stderr, "flash disk: detected product identification command.\n");
                         } else if (flashState == FlashState::CommandByte_5 && command == 0x30) {
                             // sector erase
-                            memset(flashMemory + (offset & 0x70000), 0xff, 0x10000);
+                            uint8_t* sector = guestMemory.span(0x3400000 + (offset & 0x70000), 0x10000);
+                            if (sector) {
+                                memset(sector, 0xff, 0x10000);
+                            }
                             flashState = FlashState::Read;
                             fprintf(stderr, "flash disk: sector erased: %016lx\n", offset & 0x70000);
                         } else if (flashState == FlashState::CommandByte_5 && ((offset & 0x7FF) == 0x555) && command == 0x10) {
                             // chip erase
-                            memset(flashMemory, 0xff, 0x80000);
+                            uint8_t* chip = guestMemory.span(0x3400000, 0x80000);
+                            if (chip) {
+                                memset(chip, 0xff, 0x80000);
+                            }
                             flashState = FlashState::Read;
                             fprintf(stderr, "flash disk: chip erased\n");
                         } else {
@@ -951,25 +1373,21 @@ int main (int argc, char** argv) {
 
                     if (unmapFlash) {
                         // unmap the flash memory (to control reads)
-                        ret = ioctl(vmFd, KVM_SET_USER_MEMORY_REGION, &regionFlash_Unmap);
-                        if (ret == -1) {
+                        if (!guestMemory.setRegion(regionFlash_Unmap)) {
                             perror("KVM_SET_USER_MEMORY_REGION (unmap flash)");
                             return EXIT_FAILURE;
                         }
-                        ret = ioctl(vmFd, KVM_SET_USER_MEMORY_REGION, &regionFlashAlias_Unmap);
-                        if (ret == -1) {
+                        if (!guestMemory.setRegion(regionFlashAlias_Unmap)) {
                             perror("KVM_SET_USER_MEMORY_REGION (unmap flash alias)");
                             return EXIT_FAILURE;
                         }
                     } else if (mapFlash) {
                         // map the flash memory
-                        ret = ioctl(vmFd, KVM_SET_USER_MEMORY_REGION, &regionFlash);
-                        if (ret == -1) {
+                        if (!guestMemory.setRegion(regionFlash)) {
                             perror("KVM_SET_USER_MEMORY_REGION (map flash)");
                             return EXIT_FAILURE;
                         }
-                        ret = ioctl(vmFd, KVM_SET_USER_MEMORY_REGION, &regionFlashAlias);
-                        if (ret == -1) {
+                        if (!guestMemory.setRegion(regionFlashAlias)) {
                             perror("KVM_SET_USER_MEMORY_REGION (map flash alias)");
                             return EXIT_FAILURE;
                         }
@@ -1018,6 +1436,15 @@ int main (int argc, char** argv) {
                 ring->first = (ring->first + 1) % KVM_COALESCED_MMIO_MAX;
             }   
         }*/
+
+        if (profiler) {
+            profiler->poll();
+        }
+    }
+
+    if (profiler) {
+        profiler->stop();
+        profiler->report(stderr, profileTop);
     }
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,103 @@
+    org 0x100
+    bits 16
+
+; benchmark for the timer of the emulator, compare "--pit=kernel" with "--pit=user"
+;  - counter reads: latched reads of channel 0 completed within 18 BIOS ticks (~1 s)
+;  - irq0 rate: BIOS ticks (IRQ0) counted during one RTC second
+
+    push es
+    xor  ax, ax
+    mov  es, ax
+
+    ; ---------------- counter reads ----------------
+    mov  dx, msg_reads
+    mov  ah, 0x09
+    int  0x21
+
+    ; start on a tick boundary
+    call wait_tick
+    mov  bx, [es:0x46c]
+    add  bx, 18
+    xor  esi, esi
+read_loop:
+    ; counter latch command for channel 0, read low and high byte
+    mov  al, 0x00
+    out  0x43, al
+    in   al, 0x40
+    in   al, 0x40
+    inc  esi
+    cmp  bx, [es:0x46c]
+    jne  read_loop
+
+    mov  eax, esi
+    call print_decimal
+
+    ; ---------------- irq0 rate ----------------
+    mov  dx, msg_ticks
+    mov  ah, 0x09
+    int  0x21
+
+    ; start on a second boundary of the rtc
+    call wait_second
+    mov  bx, [es:0x46c]
+    call wait_second
+    mov  ax, [es:0x46c]
+    sub  ax, bx
+    movzx eax, ax
+    call print_decimal
+
+    mov  dx, msg_newline
+    mov  ah, 0x09
+    int  0x21
+
+    pop  es
+
+    ; exit to dos
+    mov  ah, 0x4C
+    int  0x21
+
+; wait for the BIOS tick count (0040:006C) to change, es = 0
+wait_tick:
+    mov  ax, [es:0x46c]
+.wait:
+    cmp  ax, [es:0x46c]
+    je   .wait
+    ret
+
+; wait for the seconds register of the rtc to change
+wait_second:
+    mov  al, 0x00
+    out  0x70, al
+    in   al, 0x71
+    mov  ah, al
+.wait:
+    mov  al, 0x00
+    out  0x70, al
+    in   al, 0x71
+    cmp  al, ah
+    je   .wait
+    ret
+
+; print eax as an unsigned decimal number
+print_decimal:
+    mov  ecx, 10
+    xor  di, di
+.divide:
+    xor  edx, edx
+    div  ecx
+    add  dl, '0'
+    push dx
+    inc  di
+    test eax, eax
+    jnz  .divide
+.print:
+    pop  dx
+    mov  ah, 0x02
+    int  0x21
+    dec  di
+    jnz  .print
+    ret
+
+msg_reads   db 'counter reads/s: $'
+msg_ticks   db 0x0d, 0x0a, 'irq0/s: $'
+msg_newline db 0x0d, 0x0a, '$'